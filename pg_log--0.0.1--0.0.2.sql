@@ -0,0 +1,346 @@
+--
+-- pg_log--0.0.1--0.0.2.sql
+--
+-- rows read before the update keep the whole log line in message and
+-- have NULL in the new columns
+--
+-- dimension tables of repeated values, pglog stores their id
+--
+CREATE TABLE pglog_severities(id serial PRIMARY KEY, name text NOT NULL UNIQUE);
+CREATE TABLE pglog_users(id serial PRIMARY KEY, name text NOT NULL UNIQUE);
+CREATE TABLE pglog_databases(id serial PRIMARY KEY, name text NOT NULL UNIQUE);
+CREATE TABLE pglog_applications(id serial PRIMARY KEY, name text NOT NULL UNIQUE);
+CREATE TABLE pglog_client_hosts(id serial PRIMARY KEY, name text NOT NULL UNIQUE);
+--
+ALTER TABLE pglog
+ ADD COLUMN severity_id integer,
+ ADD COLUMN detail text,
+ ADD COLUMN hint text,
+ ADD COLUMN query text,
+ ADD COLUMN context text,
+ ADD COLUMN location text,
+ ADD COLUMN statement text,
+ ADD COLUMN log_time timestamptz,
+ ADD COLUMN pid integer,
+ ADD COLUMN user_id integer,
+ ADD COLUMN database_id integer,
+ ADD COLUMN application_id integer,
+ ADD COLUMN sqlstate text,
+ ADD COLUMN client_host_id integer,
+ ADD COLUMN fingerprint bigint,
+ ADD COLUMN query_id bigint,
+ ADD COLUMN template_id bigint,
+ ADD COLUMN duration_ms double precision;
+--
+CREATE INDEX pglog_log_time_idx ON pglog USING brin(log_time);
+CREATE INDEX pglog_severity_idx ON pglog(severity_id);
+CREATE INDEX pglog_query_id_idx ON pglog(query_id) WHERE query_id IS NOT NULL;
+CREATE INDEX pglog_template_id_idx ON pglog(template_id);
+--
+DROP VIEW log;
+CREATE VIEW log AS
+ SELECT l.id, l.message, s.name AS severity, l.detail, l.hint, l.query, l.context,
+  l.location, l.statement, l.log_time, l.pid, u.name AS user_name, d.name AS database_name,
+  a.name AS application_name, l.sqlstate, h.name AS client_host, l.fingerprint,
+  l.query_id, l.template_id, l.duration_ms
+ FROM pglog l
+  LEFT JOIN pglog_severities s ON s.id = l.severity_id
+  LEFT JOIN pglog_users u ON u.id = l.user_id
+  LEFT JOIN pglog_databases d ON d.id = l.database_id
+  LEFT JOIN pglog_applications a ON a.id = l.application_id
+  LEFT JOIN pglog_client_hosts h ON h.id = l.client_host_id;
+--
+-- statistics of "duration:" entries by statement fingerprint, histogram
+-- bucket 0 counts durations below 1 ms and bucket i durations from
+-- 2^(i-1) ms
+--
+CREATE TABLE pglog_slow_queries(
+ fingerprint bigint PRIMARY KEY,
+ kind text,
+ statement text,
+ calls bigint,
+ total_ms double precision,
+ min_ms double precision,
+ max_ms double precision,
+ histogram bigint[],
+ first_seen timestamptz,
+ last_seen timestamptz);
+--
+-- auto_explain plans by statement fingerprint and plan shape
+--
+CREATE TABLE pglog_plans(
+ fingerprint bigint,
+ plan_hash bigint,
+ statement text,
+ calls bigint,
+ total_ms double precision,
+ min_ms double precision,
+ max_ms double precision,
+ first_seen timestamptz,
+ last_seen timestamptz,
+ plan jsonb,
+ PRIMARY KEY (fingerprint, plan_hash));
+--
+-- checkpoints and restartpoints written with log_checkpoints: row of
+-- each "complete:" entry with flags of the previous "starting:" entry
+--
+CREATE TABLE pglog_checkpoints(
+ log_time timestamptz,
+ kind text,
+ flags text,
+ buffers_written integer,
+ buffers_pct double precision,
+ wal_added integer,
+ wal_removed integer,
+ wal_recycled integer,
+ write_s double precision,
+ sync_s double precision,
+ total_s double precision,
+ sync_files integer,
+ longest_sync_s double precision,
+ average_sync_s double precision,
+ distance_kb bigint,
+ estimate_kb bigint,
+ lsn pg_lsn,
+ redo_lsn pg_lsn);
+CREATE INDEX pglog_checkpoints_log_time_idx ON pglog_checkpoints USING brin(log_time);
+--
+-- vacuum and analyze written with log_autovacuum_min_duration: relation
+-- is schema.table of database
+--
+CREATE TABLE pglog_autovacuum(
+ log_time timestamptz,
+ kind text,
+ aggressive boolean,
+ wraparound boolean,
+ database text,
+ relation text,
+ index_scans integer,
+ pages_removed bigint,
+ pages_remain bigint,
+ tuples_removed bigint,
+ tuples_remain bigint,
+ buffer_hits bigint,
+ buffer_misses bigint,
+ buffer_dirtied bigint,
+ read_ms double precision,
+ write_ms double precision,
+ read_rate_mbs double precision,
+ write_rate_mbs double precision,
+ wal_records bigint,
+ wal_fpi bigint,
+ wal_bytes bigint,
+ cpu_user_s double precision,
+ cpu_system_s double precision,
+ elapsed_s double precision);
+CREATE INDEX pglog_autovacuum_relation_idx ON pglog_autovacuum(database, relation, log_time);
+--
+-- pglog_autovacuum totals by relation, updated with each batch
+--
+CREATE TABLE pglog_autovacuum_tables(
+ database text,
+ relation text,
+ kind text,
+ runs bigint,
+ elapsed_s double precision,
+ max_elapsed_s double precision,
+ pages_removed bigint,
+ tuples_removed bigint,
+ wal_bytes bigint,
+ first_seen timestamptz,
+ last_seen timestamptz,
+ PRIMARY KEY (database, relation, kind));
+--
+-- lock waits written with log_lock_waits: event is waiting, acquired,
+-- avoided_deadlock or deadlock, holders and wait_queue are pid lists
+--
+CREATE TABLE pglog_lock_waits(
+ log_time timestamptz,
+ pid integer,
+ event text,
+ lock_mode text,
+ lock_object text,
+ database oid,
+ relation oid,
+ wait_ms double precision,
+ holders text,
+ wait_queue text);
+CREATE INDEX pglog_lock_waits_log_time_idx ON pglog_lock_waits USING brin(log_time);
+--
+-- waiter is blocked by blocker: edges of waiting entries and of deadlock
+-- reports, pid is the process which wrote the entry
+--
+CREATE TABLE pglog_lock_edges(
+ log_time timestamptz,
+ pid integer,
+ event text,
+ waiter integer,
+ blocker integer,
+ lock_mode text,
+ lock_object text,
+ database oid,
+ relation oid,
+ statement text);
+CREATE INDEX pglog_lock_edges_log_time_idx ON pglog_lock_edges USING brin(log_time);
+--
+-- temporary files written with log_temp_files, fingerprint of their
+-- statement as in pglog
+--
+CREATE TABLE pglog_temp_files(
+ log_time timestamptz,
+ pid integer,
+ path text,
+ size_bytes bigint,
+ fingerprint bigint,
+ statement text);
+CREATE INDEX pglog_temp_files_log_time_idx ON pglog_temp_files USING brin(log_time);
+--
+-- pglog_temp_files by statement fingerprint and hour, updated with each
+-- batch: fingerprint is 0 for files without statement
+--
+CREATE TABLE pglog_temp_files_hourly(
+ fingerprint bigint,
+ hour timestamptz,
+ files bigint,
+ total_bytes bigint,
+ max_bytes bigint,
+ statement text,
+ PRIMARY KEY (fingerprint, hour));
+--
+-- sessions written with log_connections and log_disconnections, added
+-- at disconnection
+--
+CREATE TABLE pglog_sessions(
+ connected_at timestamptz,
+ disconnected_at timestamptz,
+ duration_s double precision,
+ pid integer,
+ user_name text,
+ database_name text,
+ application_name text,
+ client_host text,
+ client_port integer);
+CREATE INDEX pglog_sessions_connected_at_idx ON pglog_sessions(connected_at);
+--
+-- message templates, tokens is the number of tokens of their messages
+--
+CREATE TABLE pglog_templates(
+ id bigint PRIMARY KEY,
+ tokens integer,
+ template text,
+ entries bigint,
+ first_seen timestamptz,
+ last_seen timestamptz);
+--
+-- entries by template and hour (UTC hour start), updated with each refresh
+--
+CREATE TABLE pglog_template_hourly(
+ template_id bigint,
+ hour timestamptz,
+ entries bigint,
+ PRIMARY KEY (hour, template_id));
+--
+-- log files read by the worker: row with NULL path is the server log
+--
+CREATE TABLE pg_log_sources(
+ name text PRIMARY KEY,
+ path text,
+ format text NOT NULL DEFAULT 'lines',
+ rotation_pattern text,
+ target_table regclass NOT NULL,
+ reset_on_rotation boolean NOT NULL DEFAULT false,
+ enabled boolean NOT NULL DEFAULT true,
+ current_file text,
+ current_inode bigint,
+ current_offset bigint,
+ current_line bigint,
+ parser text,
+ current_file_number bigint);
+--
+INSERT INTO pg_log_sources(name, format, target_table, reset_on_rotation) VALUES ('postgresql', 'stderr', 'pglog', true);
+SELECT pg_catalog.pg_extension_config_dump('pg_log_sources', 'WHERE path IS NOT NULL');
+--
+-- last server log line inserted in pglog by per-database routing, saved
+-- with the lines so that lines delivered again are skipped
+--
+CREATE TABLE pglog_route_position(
+ file_number bigint NOT NULL,
+ line bigint NOT NULL);
+DROP FUNCTION pg_log();
+CREATE FUNCTION pg_log(OUT line integer, OUT message text, OUT severity text,
+ OUT detail text, OUT hint text, OUT query text, OUT context text,
+ OUT location text, OUT statement text, OUT log_time timestamptz, OUT pid integer,
+ OUT user_name text, OUT database_name text, OUT application_name text,
+ OUT sqlstate text, OUT client_host text, OUT fingerprint bigint, OUT query_id bigint,
+ OUT template_id bigint, OUT duration_ms double precision) RETURNS SETOF record 
+ AS 'pg_log.so', 'pg_log'
+ LANGUAGE C STRICT;
+--
+CREATE FUNCTION pg_log_sync(timeout integer DEFAULT 10000) RETURNS boolean
+ AS 'pg_log.so', 'pg_log_sync'
+ LANGUAGE C STRICT;
+--
+CREATE FUNCTION pg_log_lock_hotspots(start_time timestamptz, end_time timestamptz DEFAULT now(),
+ OUT database oid, OUT relation oid, OUT relation_name text, OUT waits bigint, OUT deadlocks bigint,
+ OUT total_wait_ms double precision, OUT max_wait_ms double precision) RETURNS SETOF record
+ AS $$
+ select w.database, w.relation, c.oid::regclass::text,
+        count(*) filter (where w.event = 'waiting'),
+        count(*) filter (where w.event = 'deadlock'),
+        sum(w.wait_ms) filter (where w.event = 'acquired'),
+        max(w.wait_ms) filter (where w.event = 'acquired')
+   from pglog_lock_waits w
+   left join pg_class c on c.oid = w.relation
+    and w.database = (select oid from pg_database where datname = current_database())
+  where w.log_time >= start_time and w.log_time < end_time and w.relation is not null
+  group by w.database, w.relation, c.oid
+  order by 4 desc, 6 desc nulls last
+ $$ LANGUAGE sql STABLE;
+--
+CREATE FUNCTION pg_log_lock_chains(start_time timestamptz, end_time timestamptz DEFAULT now(),
+ OUT log_time timestamptz, OUT pid integer, OUT event text, OUT chain text, OUT statements text[])
+ RETURNS SETOF record
+ AS $$
+ select e.log_time, e.pid, e.event,
+        string_agg(format('%s -> %s (%s on %s)', e.waiter, e.blocker, e.lock_mode, e.lock_object), ', '),
+        array_agg(e.statement)
+   from pglog_lock_edges e
+  where e.log_time >= start_time and e.log_time < end_time
+  group by e.log_time, e.pid, e.event
+  order by e.log_time
+ $$ LANGUAGE sql STABLE;
+--
+-- errors and durations logged by query id with pg_stat_statements
+-- counters of the same query id
+--
+CREATE FUNCTION pg_log_query_stats(start_time timestamptz DEFAULT now() - interval '1 day',
+ end_time timestamptz DEFAULT now(),
+ OUT query_id bigint, OUT errors bigint, OUT durations bigint, OUT duration_ms double precision,
+ OUT calls bigint, OUT total_exec_ms double precision, OUT query text) RETURNS SETOF record
+ AS $$
+BEGIN
+ IF to_regclass('pg_stat_statements') IS NULL THEN
+  RAISE EXCEPTION 'pg_log: pg_stat_statements is not installed';
+ END IF;
+ RETURN QUERY EXECUTE format(
+  'select l.query_id, l.errors, l.durations, l.duration_ms, s.calls, s.total_ms, s.query
+     from (select l.query_id,
+                  count(*) filter (where v.name in (''ERROR'', ''FATAL'', ''PANIC'')) as errors,
+                  count(l.duration_ms) as durations,
+                  sum(l.duration_ms) as duration_ms
+             from pglog l
+             left join pglog_severities v on v.id = l.severity_id
+            where l.log_time >= $1 and l.log_time < $2 and l.query_id is not null
+            group by l.query_id) l
+     left join (select queryid, sum(calls)::bigint as calls, sum(%s) as total_ms, min(query) as query
+                  from pg_stat_statements group by queryid) s on s.queryid = l.query_id
+    order by coalesce(s.total_ms, l.duration_ms, 0) desc, l.errors desc',
+  CASE WHEN current_setting('server_version_num')::int >= 130000 THEN 'total_exec_time' ELSE 'total_time' END)
+ USING start_time, end_time;
+END
+$$ LANGUAGE plpgsql STABLE;
+--
+CREATE FUNCTION pg_log_template_stats(OUT id bigint, OUT template text, OUT entries bigint,
+ OUT first_seen timestamptz, OUT last_seen timestamptz) RETURNS SETOF record
+ AS 'pg_log.so', 'pg_log_template_stats'
+ LANGUAGE C STRICT;
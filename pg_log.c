@@ -42,12 +42,12 @@
 
 #include "utils/builtins.h"
 
+#include "pg_log.h"
+
 #if PG_VERSION_NUM < 130000
 #include "catalog/pg_type.h"
 #endif
 
-#define PG_LOG_MAX_LINE_SIZE	32768	
-
 PG_MODULE_MAGIC;
 
 /*---- Function declarations ----*/
@@ -60,7 +60,6 @@ PG_FUNCTION_INFO_V1(pg_read);
 PG_FUNCTION_INFO_V1(pg_log);
 PG_FUNCTION_INFO_V1(pg_log_refresh);
 PG_FUNCTION_INFO_V1(pg_log_main);
-static char *pg_get_logname_internal();
 static Datum pg_read_internal(const char *filename);
 static Datum pg_log_internal(FunctionCallInfo fcinfo);
 static Datum pg_log_refresh_internal(FunctionCallInfo fcinfo);
@@ -70,80 +69,11 @@ static Datum pg_log_refresh_internal(FunctionCallInfo fcinfo);
 /*
  * GUC settings
  */
-static double pg_log_fraction;
+double pg_log_fraction;
 static int pg_log_naptime;
-static char *pg_log_datname = NULL;
+char *pg_log_datname = NULL;
 static char *pg_log_default_datname = "pg_log";
-
-/*
- * pg_read_file_v2 output
- */
-static text *g_result;
-
-/*
- * structure to store log data 
- *
- * About text, VARDATA and VARSIZE:
- *
- * 1. text is defined in PG c.h as:
- *
- * typedef struct varlena text;
- *
- * with:
- *
- * struct varlena
- * {
- *    char        vl_len_[4];
- *    char        vl_dat[FLEXIBLE_ARRAY_MEMBER];
- * }
- *
- * #define FLEXIBLE_ARRAY_MEMBER   // empty
- *
- * 2. VARDATA and VARSIZE are defined in postgres.h as:
- *
- *  #define VARDATA(PTR)                        VARDATA_4B(PTR)
- *  #define VARSIZE(PTR)                        VARSIZE_4B(PTR)
- *
- *  with:
- *
- *  #define VARDATA_4B(PTR)     (((varattrib_4b *) (PTR))->va_4byte.va_data)
- *  #define VARSIZE_4B(PTR) \
- *    ((((varattrib_4b *) (PTR))->va_4byte.va_header >> 2) & 0x3FFFFFFF)
- *
- * typedef union
- * {
- *    struct
- *    {
- *        uint32      va_header;
- *        char        va_data[FLEXIBLE_ARRAY_MEMBER];
- *    }           va_4byte;
- *    struct
- *    {
- *        uint32      va_header;
- *        uint32      va_tcinfo;/
- *        char        va_data[FLEXIBLE_ARRAY_MEMBER];
- *    }           va_compressed;
- *  } varattrib_4b;
- *
- */
-
-struct	{
-        /* data returned by pg_read_file_v2 */	
-	text	*data;
-	/* current number of processed characters */
-	int	char_count;
-	/* current number of processed lines */
-	int	line_count;
-	/* size of biggest line */
-	int	max_line_size;
-	/* index of current character in current line */
-	int	i; 
-	/* if pg_log_fraction != 1 this is used to start displaying data 
-	 * at beginning of the right line to avoid to display a broken
-	 * line.
-	 */
-	int	first_newline_position;
-} g_logdata;
+bool pg_log_route_by_database = false;
 
 /*
  * flags set by signal handlers
@@ -231,7 +161,18 @@ _PG_init(void)
 				NULL,
 				NULL,
 				NULL);
-	
+
+	DefineCustomBoolVariable("pg_log.route_by_database",
+				"copy log lines to the pglog table of the database that produced them",
+				NULL,
+				&pg_log_route_by_database,
+				false,
+				PGC_SIGHUP,
+				0,
+				NULL,
+				NULL,
+				NULL);
+
 
 	/* set up common data for all our workers */
 	memset(&worker, 0, sizeof(worker));
@@ -260,6 +201,10 @@ _PG_init(void)
 
 	elog(LOG, "%s started with pg_log.datname=%s", worker.bgw_name, pg_log_datname);
 
+	elog(LOG, "%s started with pg_log.route_by_database=%s", worker.bgw_name, pg_log_route_by_database ? "on" : "off");
+
+	pg_log_shmem_init();
+
 	elog(DEBUG5, "pg_log:_PG_init():exit");
 }
 
@@ -275,99 +220,7 @@ _PG_fini(void)
 }
 /* --- ---- */
 
-
-static void logdata_start(text *p_result)
-{
-	g_logdata.data = p_result;	
-	g_logdata.char_count = 0;
-	g_logdata.line_count = 0;
-       	g_logdata.i = 0;
-	g_logdata.max_line_size = 0;
-	g_logdata.first_newline_position = -1;
-
-}
-
-static void logdata_start_from_newline(text *p_result)
-{
-	/*
-	 * to start reading after first newline
-	 */
-	g_logdata.data = p_result;	
-	if (pg_log_fraction != 1)
-	 g_logdata.char_count = g_logdata.first_newline_position + 1;
-	else	
-	 g_logdata.char_count = 0;
-
-	g_logdata.line_count = 0;
-       	g_logdata.i = 0;
-
-}
-
-static bool logdata_has_more()
-{
-	return  g_logdata.char_count < VARSIZE(g_logdata.data);
-
-}
-
-static void logdata_next()
-{
-        g_logdata.char_count++;
-	g_logdata.i++;
-}
-
-static	char logdata_get()
-{
-	return *(VARDATA(g_logdata.data) + g_logdata.char_count);
-}
-
-static	void logdata_incr_line_count()
-{
-	g_logdata.line_count++;
-}
-
-static void logdata_set_max_line_size()
-{
-	g_logdata.max_line_size = g_logdata.i;
-}
-
-static bool logdata_index_gt_max_line_size()
-{
-	return g_logdata.i > g_logdata.max_line_size;
-}
-
-static int logdata_get_index()
-{
-	return g_logdata.i;
-}
-
-static void logdata_reset_index()
-{
-	g_logdata.i = 0;
-}
-
-static int logdata_get_char_count()
-{
-	return g_logdata.char_count;
-}
-
-static int logdata_get_line_count()
-{
-	return g_logdata.line_count;
-}
-
-static int logdata_get_max_line_size()
-{
-	return g_logdata.max_line_size;
-}
-
-static void logdata_set_first_newline_position (int pos)
-{
-	g_logdata.first_newline_position = pos;
-}
-
-/* --- ---- */
-
-static char *pg_get_logname_internal()
+char *pg_get_logname_internal()
 {
 	/*
 	 * get last modified file in <log_directory>
@@ -421,6 +274,49 @@ static char *pg_get_logname_internal()
 
 }
 
+/*
+ * full path of current server log file
+ */
+char *pg_log_server_file()
+{
+	return psprintf("%s/%s", GetConfigOption("log_directory", true, false), pg_get_logname_internal());
+}
+
+/*
+ * pipeline reading the last lines of current server log file corresponding
+ * to pg_log.fraction
+ */
+static PgLogPipeline *pg_log_server_pipeline(int flags)
+{
+	char		*full_log_filename;
+	struct stat	stat_buf;
+	int64		offset = 0;
+	PgLogPipeline	*pipeline;
+
+	full_log_filename = pg_log_server_file();
+	if (stat(full_log_filename, &stat_buf) != 0)
+		elog(ERROR, "pg_log: stat failed on %s", full_log_filename);
+
+	elog(DEBUG1, "pg_log: %s has %ld bytes", full_log_filename, stat_buf.st_size); 
+
+	/*
+	 * by default read only the last lines corresponding to pg_log.fraction
+	 * and start at first new line position
+	 */
+	if (pg_log_fraction != 1)
+	{
+		offset = stat_buf.st_size * ( 1 - pg_log_fraction);
+		if (offset > 0)
+			flags |= PG_LOG_PIPELINE_ALIGN;
+	}
+
+	pipeline = pg_log_pipeline_begin(full_log_filename, offset, 0, flags);
+	if (pipeline == NULL)
+		elog(ERROR, "pg_log: cannot read %s", full_log_filename);
+
+	return pipeline;
+}
+
 Datum	pg_get_logname(PG_FUNCTION_ARGS)
 {
 	PG_RETURN_CSTRING(pg_get_logname_internal());
@@ -436,75 +332,17 @@ Datum pg_read(PG_FUNCTION_ARGS)
 
 static Datum pg_read_internal(const char *filename)
 {
-	
-	const char	*log_filename;
-	const char	*log_directory;
-	char		*full_log_filename;
-	PGFunction	func;
-	text		*lfn;	
-	int64		offset;
-	int64		length;
-	struct stat	stat_buf;
-	int		rc;
-	text		*result;
-	char		c;
-	int		first_newline_position = 0;
-
-
-	log_filename = pg_get_logname_internal();
-     	log_directory = GetConfigOption("log_directory", true, false);
-	full_log_filename = palloc(strlen(log_filename) + strlen(log_directory) + 2);
-	strcpy(full_log_filename, log_directory); 
-	strcat(full_log_filename, "/");
-	strcat(full_log_filename, log_filename);
-	
-	lfn = (text *) palloc(strlen(full_log_filename) + VARHDRSZ);
-	memcpy(VARDATA(lfn), full_log_filename, strlen(full_log_filename));
-	SET_VARSIZE(lfn, strlen(full_log_filename) + VARHDRSZ);
-
-	rc = stat(full_log_filename, &stat_buf);
-	if (rc != 0)
-		elog(ERROR, "pg_log: stat failed on %s", full_log_filename);
-
-	elog(DEBUG1, "pg_log: %s has %ld bytes", full_log_filename, stat_buf.st_size); 
+	PgLogPipeline	*pipeline;
 
 	/*
-	 * by default read only the last lines corresponding to pg_log.fraction
+	 * check log data
 	 */
-	offset = stat_buf.st_size * ( 1 - pg_log_fraction);
-	length = stat_buf.st_size * pg_log_fraction; 
-	func = pg_read_file;
-	result =  (text *)DirectFunctionCall3(func, (Datum)lfn, (Datum)offset, (Datum)length);
+	pipeline = pg_log_server_pipeline(0);
+	while (pg_log_pipeline_next(pipeline) != NULL)
+		;
 
-	/*
-	 * check returned data
-	 */
-
-	for (logdata_start(result);  logdata_has_more(); logdata_next())
-	{
-		c = logdata_get();
-		if (c == '\n')
-		{
-			  if (first_newline_position == 0)
-				  first_newline_position = logdata_get_index();
-			  logdata_incr_line_count();
-			  if (logdata_index_gt_max_line_size())
-			  	logdata_set_max_line_size();
-			  logdata_reset_index();
-		}
-	
-	}
-	
-	/*
-	 * if all log must be read do not start at first new line position
-	 */
-	if (pg_log_fraction == 1)
-		logdata_set_first_newline_position(0);
-	else
- 		logdata_set_first_newline_position(first_newline_position);
-
-	elog(DEBUG1, "pg_log: checked %d characters in %d lines (longest=%d)", logdata_get_char_count(), logdata_get_line_count(), logdata_get_max_line_size());
-	g_result = result;
+	elog(DEBUG1, "pg_log: checked " INT64_FORMAT " characters in " INT64_FORMAT " lines (longest=%d)", pipeline->read_bytes, pipeline->lineno, pipeline->longest_line);
+	pg_log_pipeline_end(pipeline);
 
 	return (Datum)0;
 
@@ -519,18 +357,15 @@ Datum pg_log(PG_FUNCTION_ARGS)
 
 static Datum pg_log_internal(FunctionCallInfo fcinfo)
 {
-
-
 	ReturnSetInfo 	*rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
 	bool		randomAccess;
 	TupleDesc	tupdesc;
 	Tuplestorestate *tupstore;
-	AttInMetadata	 *attinmeta;
 	MemoryContext 	oldcontext;
 
-	const char	*log_filename = NULL;
+	PgLogPipeline	*pipeline;
+	PgLogBatch	*batch;
 	int		i;
-	int		c;
 
 	/* check to see if caller supports us returning a tuplestore */
 	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
@@ -542,18 +377,16 @@ static Datum pg_log_internal(FunctionCallInfo fcinfo)
 				(errcode(ERRCODE_SYNTAX_ERROR),
 				 errmsg("materialize mode required, but it is not allowed in this context")));
 
-	log_filename = GetConfigOption("log_filename", true, false);
-	pg_read_internal(log_filename);
-
 	/* The tupdesc and tuplestore must be created in ecxt_per_query_memory */
 	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
 #if PG_VERSION_NUM <= 120000
-	tupdesc = CreateTemplateTupleDesc(2, false);
+	tupdesc = CreateTemplateTupleDesc(1 + PG_LOG_NCOLUMNS, false);
 #else
-	tupdesc = CreateTemplateTupleDesc(2);
+	tupdesc = CreateTemplateTupleDesc(1 + PG_LOG_NCOLUMNS);
 #endif
 	TupleDescInitEntry(tupdesc, (AttrNumber) 1, "lineno", INT4OID, -1, 0);
-	TupleDescInitEntry(tupdesc, (AttrNumber) 2, "message", TEXTOID, -1, 0);
+	for (i = 0; i < PG_LOG_NCOLUMNS; i++)
+		TupleDescInitEntry(tupdesc, (AttrNumber) (2 + i), pg_log_columns[i].name, pg_log_columns[i].type, -1, 0);
 
 	randomAccess = (rsinfo->allowedModes & SFRM_Materialize_Random) != 0;
 	tupstore = tuplestore_begin_heap(randomAccess, false, work_mem);
@@ -563,37 +396,29 @@ static Datum pg_log_internal(FunctionCallInfo fcinfo)
 
 	MemoryContextSwitchTo(oldcontext);
 
-	attinmeta = TupleDescGetAttInMetadata(tupdesc);
-
-	for (logdata_start_from_newline(g_result), i=0 ;logdata_has_more();logdata_next(), i++)
-        {
-		char		buf_v1[20];
-		char		buf_v2[PG_LOG_MAX_LINE_SIZE];
-		char 		*values[2];
-		HeapTuple	tuple;
-
-		c = logdata_get();
-		buf_v2[i] = c;
-		
-		if ( logdata_get_index() > PG_LOG_MAX_LINE_SIZE - 1)
+	pipeline = pg_log_server_pipeline(PG_LOG_PIPELINE_GROUP);
+	while ((batch = pg_log_pipeline_next(pipeline)) != NULL)
+	{
+		for (i = 0; i < batch->nlines; i++)
 		{
-			elog(ERROR, "pg_log: log line %d larger than %d", logdata_get_line_count() + 1, PG_LOG_MAX_LINE_SIZE);
+			Datum		values[1 + PG_LOG_NCOLUMNS];
+			bool		nulls[1 + PG_LOG_NCOLUMNS];
+			int		j;
+
+			/*
+			 * build Datums from log entry slices: no input function call
+			 */
+			nulls[0] = false;
+			values[0] = Int32GetDatum((int32) (batch->lines[i].lineno - 1));
+			pg_log_record_values(pipeline->prefix, &batch->lines[i], &batch->records[i], &batch->matches[i],
+					     values + 1, nulls + 1);
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+			for (j = 1; j <= PG_LOG_NCOLUMNS; j++)
+				if (!nulls[j] && pg_log_columns[j - 1].type == TEXTOID)
+					pfree(DatumGetPointer(values[j]));
 		}
-
-                if (c == '\n')
-                {
-			sprintf(buf_v1, "%d", logdata_get_line_count());	
-			buf_v2[i] = '\0';
-			logdata_incr_line_count();
-			logdata_reset_index();
-			i = -1;
-
-			values[0] = buf_v1;
-			values[1] = buf_v2;
-			tuple = BuildTupleFromCStrings(attinmeta, values);
-			tuplestore_puttuple(tupstore, tuple);
-                }
-        }
+	}
+	pg_log_pipeline_end(pipeline);
 
 	return (Datum)0;
 
@@ -611,70 +436,8 @@ Datum pg_log_refresh(PG_FUNCTION_ARGS)
 static Datum pg_log_refresh_internal(FunctionCallInfo fcinfo)
 {
 
-	const char      *log_filename = NULL;
-        int             i;
-        int             c;
-	StringInfoData	buf_insert;
-	SPIPlanPtr 	plan_ptr;
-	Oid argtypes[2] = { INT4OID, TEXTOID };
-	Datum		values[2];
-	int		ret_code;
-
-        char            buf_v2[PG_LOG_MAX_LINE_SIZE];
-
-	log_filename = GetConfigOption("log_filename", true, false);
-        pg_read_internal(log_filename);
-
-	initStringInfo(&buf_insert);
-        appendStringInfo(&buf_insert, "insert into pglog(id, message) values ($1, $2)");
-
-	SPI_connect();
-
-	pgstat_report_activity(STATE_RUNNING, "truncate table pglog");
-	SPI_execute("truncate table pglog", false, 0);
-	/*
-	** shoud only be called when not in a transaction
-	** pgstat_report_stat(false);
-	*/
-	pgstat_report_activity(STATE_IDLE, NULL);
-
-	plan_ptr = SPI_prepare(buf_insert.data, 2, argtypes);
-
-	for (logdata_start_from_newline(g_result), i = 0; logdata_has_more(); logdata_next(), i++)
-        {
-		c = logdata_get();
-                buf_v2[i] = c;
-
-                if ( logdata_get_index() > PG_LOG_MAX_LINE_SIZE - 1)
-		{
-                        elog(ERROR, "pg_log: log line %d larger than %d", logdata_get_line_count() + 1, PG_LOG_MAX_LINE_SIZE);
-		}
-
-                if (c == '\n')
-                {
-                        buf_v2[i] = '\0';
-			logdata_incr_line_count();
-			logdata_reset_index();
-                        i = -1;
+	pg_log_refresh_sources();
 
-                        values[0] = Int32GetDatum(logdata_get_line_count());
-                        values[1] = CStringGetTextDatum(buf_v2);
-
-                        pgstat_report_activity(STATE_RUNNING, buf_insert.data);
-                        ret_code = SPI_execute_plan(plan_ptr, values, NULL, false, 0);  
-                        pgstat_report_activity(STATE_IDLE, NULL);
-
-                        if (ret_code != SPI_OK_INSERT)
-                                 elog(ERROR, "INSERT INTO pglog failed");
-                        if (SPI_processed != 1)
-                                 elog(ERROR, "INSERT INTO pglog did not process 1 row");
-
-                }
-        }
-
-
-
-	SPI_finish();
 	/*
 	** shoud only be called when not in a transaction
 	** pgstat_report_stat(false);
@@ -706,6 +469,9 @@ pg_log_main(PG_FUNCTION_ARGS)
 #endif
 	elog(LOG, "%s initialized", MyBgworkerEntry->bgw_name);
 
+	/* pg_log_sync() wakes us up */
+	pg_log_sync_attach();
+
 	/*
 	 * Main loop: do this until the SIGTERM handler tells us to terminate
 	 */
@@ -713,6 +479,7 @@ pg_log_main(PG_FUNCTION_ARGS)
 	while (!got_sigterm)
 	{
 		int	rc;
+		uint64	ticket;
 
 		/*
 		 * Background workers mustn't call usleep() or any direct equivalent:
@@ -763,6 +530,8 @@ pg_log_main(PG_FUNCTION_ARGS)
 		 * The pgstat_report_activity() call makes our activity visible
 		 * through the pgstat views.
 		 */
+		ticket = pg_log_sync_begin();
+
 		SetCurrentStatementStartTimestamp();
 		StartTransactionCommand();
 		PushActiveSnapshot(GetTransactionSnapshot());
@@ -772,6 +541,8 @@ pg_log_main(PG_FUNCTION_ARGS)
 		PopActiveSnapshot();
 		CommitTransactionCommand();
 
+		pg_log_sync_end(ticket);
+
 	}
 
 	proc_exit(1);
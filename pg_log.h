@@ -0,0 +1,640 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_log.h
+ *	  Declarations shared by pg_log modules.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (c) 2022, Pierre Forstmann.
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PG_LOG_H
+#define PG_LOG_H
+
+#include "datatype/timestamp.h"
+#include "executor/spi.h"
+#include "storage/dsm.h"
+#include "utils/hsearch.h"
+#include "utils/jsonb.h"
+
+#include "pg_log_parser.h"
+
+#include "port/pg_bswap.h"
+#if PG_VERSION_NUM >= 120000
+#include "port/pg_bitutils.h"
+#endif
+#if PG_VERSION_NUM >= 130000
+#include "common/hashfn.h"
+#else
+#include "access/hash.h"
+#endif
+
+/* size of file read chunk, grown for longer lines */
+#define PG_LOG_READ_CHUNK	(1024 * 1024)
+/* maximum number of lines of a pipeline batch */
+#define PG_LOG_BATCH_SIZE	1000
+
+#if PG_VERSION_NUM >= 140000
+#define PG_LOG_HASH_STRINGS	HASH_STRINGS
+#else
+#define PG_LOG_HASH_STRINGS	0
+#endif
+
+/*
+ * 64 bit hash of statement text
+ */
+static inline uint64 pg_log_hash64(const char *data, int len)
+{
+#if PG_VERSION_NUM >= 130000
+	return hash_bytes_extended((const unsigned char *) data, len, 0);
+#elif PG_VERSION_NUM >= 110000
+	return DatumGetUInt64(hash_any_extended((const unsigned char *) data, len, 0));
+#else
+	/* PG 10 has no 64 bit hash_any(): FNV-1a */
+	uint64	hash = UINT64CONST(0xcbf29ce484222325);
+	int	i;
+
+	for (i = 0; i < len; i++)
+		hash = (hash ^ (unsigned char) data[i]) * UINT64CONST(0x100000001b3);
+	return hash;
+#endif
+}
+
+/*
+ * GUC settings (pg_log.c)
+ */
+extern double pg_log_fraction;
+extern char *pg_log_datname;
+extern bool pg_log_route_by_database;
+
+/* pg_log.c */
+extern char *pg_get_logname_internal(void);
+extern char *pg_log_server_file(void);
+
+/*
+ * log_line_prefix template (pg_log_prefix.c)
+ */
+
+typedef enum
+{
+	PG_LOG_FIELD_TIME,
+	PG_LOG_FIELD_PID,
+	PG_LOG_FIELD_USER,
+	PG_LOG_FIELD_DATABASE,
+	PG_LOG_FIELD_APPLICATION,
+	PG_LOG_FIELD_SQLSTATE,
+	PG_LOG_FIELD_HOST,
+	PG_LOG_FIELD_QUERY_ID,
+	PG_LOG_NFIELDS
+} PgLogField;
+
+typedef struct
+{
+	const char	*data;
+	int		len;
+} PgLogSlice;
+
+typedef struct
+{
+	/* '\0' for a literal item, escape character otherwise */
+	char		escape;
+	/* PgLogField filled by this escape, -1 if not kept */
+	int		field;
+	/* literal text, stored in PgLogPrefix.literals */
+	const char	*literal;
+	int		literal_len;
+} PgLogPrefixItem;
+
+/*
+ * tags written by the server after log_line_prefix, in pg_log_tags order:
+ * severities start a log entry, others are parts of the previous entry
+ */
+typedef enum
+{
+	PG_LOG_TAG_LOG,
+	PG_LOG_TAG_ERROR,
+	PG_LOG_TAG_WARNING,
+	PG_LOG_TAG_FATAL,
+	PG_LOG_TAG_PANIC,
+	PG_LOG_TAG_NOTICE,
+	PG_LOG_TAG_INFO,
+	PG_LOG_TAG_DEBUG,
+	PG_LOG_TAG_DETAIL,
+	PG_LOG_TAG_HINT,
+	PG_LOG_TAG_QUERY,
+	PG_LOG_TAG_CONTEXT,
+	PG_LOG_TAG_LOCATION,
+	PG_LOG_TAG_STATEMENT,
+	PG_LOG_NTAGS
+} PgLogTag;
+
+#define PG_LOG_TAG_IS_PART(tag)	((tag) >= PG_LOG_TAG_DETAIL)
+#define PG_LOG_NPARTS		(PG_LOG_NTAGS - PG_LOG_TAG_DETAIL)
+
+extern const char *const pg_log_tags[];
+
+typedef struct
+{
+	/* length of prefix, severity tag included, 0 if line does not match */
+	int		length;
+	/* PgLogTag */
+	int		tag;
+	PgLogSlice	fields[PG_LOG_NFIELDS];
+} PgLogPrefixMatch;
+
+typedef struct PgLogPrefix PgLogPrefix;
+
+/*
+ * matcher of compiled template: generic one or kernel specialized for a
+ * common prefix shape, selected when log_line_prefix is compiled
+ */
+typedef bool (*PgLogPrefixMatchFunction) (const PgLogPrefix *prefix, const char *line, int len,
+					 PgLogPrefixMatch *match);
+
+struct PgLogPrefix
+{
+	/* log_line_prefix value the template was compiled from */
+	char		*source;
+	char		*literals;
+	PgLogPrefixItem	*items;
+	int		nitems;
+	/* index of %q item, -1 if none */
+	int		q_item;
+	/* escape of PG_LOG_FIELD_TIME: 't', 'm', 'n' or '\0' */
+	char		time_escape;
+	PgLogPrefixMatchFunction match;
+};
+
+extern PgLogPrefix *pg_log_get_prefix(void);
+extern bool pg_log_match_prefix(const PgLogPrefix *prefix, const char *line, int len, PgLogPrefixMatch *match);
+extern Datum pg_log_field_value(char time_escape, int field, const PgLogSlice *value, bool *isnull);
+
+/*
+ * pipeline (pg_log_pipeline.c)
+ *
+ * Log file data goes through scan, split, verify, filter and parse stages by
+ * batches of line descriptors which are consumed by a sink: a table
+ * writer, the tuplestore of an SRF, ...
+ */
+
+/* data up to first newline is a broken line */
+#define PG_LOG_PIPELINE_ALIGN		0x01
+/* match log_line_prefix of each line */
+#define PG_LOG_PIPELINE_PARSE_PREFIX	0x02
+/* group lines of a log entry in one record, implies PARSE_PREFIX */
+#define PG_LOG_PIPELINE_GROUP		0x04
+/* csvlog records, which may contain newlines */
+#define PG_LOG_PIPELINE_CSV		0x08
+/*
+ * file may still be written: with PG_LOG_PIPELINE_GROUP, the last log entry
+ * is kept until the next one starts
+ */
+#define PG_LOG_PIPELINE_TAIL		0x10
+
+/*
+ * log entry grouped by PG_LOG_PIPELINE_GROUP or PG_LOG_PIPELINE_CSV: line
+ * data spans all lines of the entry, continuation lines start with a tab
+ * in stderr format. Only nlines is set for csvlog.
+ */
+typedef struct
+{
+	/* number of lines */
+	int		nlines;
+	/* prefix of first line matched by split stage, in batch matches */
+	bool		matched;
+	/* severity tag, -1 if first line has no log_line_prefix */
+	int		severity;
+	/* message after severity tag with continuation lines */
+	PgLogSlice	message;
+	/* DETAIL, HINT, ... parts in PgLogTag order, data is NULL if absent */
+	PgLogSlice	parts[PG_LOG_NPARTS];
+} PgLogRecord;
+
+typedef struct
+{
+	int		nlines;
+	PgLogLine	lines[PG_LOG_BATCH_SIZE];
+	/* only set with PG_LOG_PIPELINE_PARSE_PREFIX */
+	PgLogPrefixMatch matches[PG_LOG_BATCH_SIZE];
+	/* only set with PG_LOG_PIPELINE_GROUP or PG_LOG_PIPELINE_CSV */
+	PgLogRecord	records[PG_LOG_BATCH_SIZE];
+} PgLogBatch;
+
+typedef struct PgLogPipeline PgLogPipeline;
+
+/* split stage of the pipeline, selected from flags when it begins */
+typedef void (*PgLogSplitFunction) (PgLogPipeline *pipeline, PgLogBatch *batch);
+
+struct PgLogPipeline
+{
+	int		flags;
+	PgLogSplitFunction split;
+	char		*file;
+	FILE		*fp;
+	/* scan buffer: used bytes, split stage position */
+	char		*buf;
+	size_t		size;
+	size_t		used;
+	size_t		pos;
+	bool		eof;
+	/* prefix match of the log entry at pos, if matched is true */
+	PgLogPrefixMatch record_match;
+	bool		record_matched;
+	/* file offset and number of the last line handed to the sink */
+	int64		offset;
+	int64		lineno;
+	PgLogPrefix	*prefix;
+	/* per stage counters */
+	int64		read_bytes;
+	int64		split_lines;
+	int64		filtered_lines;
+	int		longest_line;
+	/* database encoding lines are verified against */
+	int		encoding;
+	int64		invalid_bytes;
+	PgLogBatch	batch;
+};
+
+extern PgLogPipeline *pg_log_pipeline_begin(const char *file, int64 offset, int64 lineno, int flags);
+extern PgLogBatch *pg_log_pipeline_next(PgLogPipeline *pipeline);
+extern void pg_log_pipeline_end(PgLogPipeline *pipeline);
+extern int pg_log_verify_bytes(char *data, int len, int encoding);
+extern void pg_log_parse_records(const PgLogPrefix *prefix, PgLogBatch *batch);
+extern text *pg_log_slice_to_text(const char *data, int len);
+
+/*
+ * columns of a log entry row after its line number, in pglog and pg_log()
+ */
+typedef enum
+{
+	PG_LOG_COL_MESSAGE,
+	PG_LOG_COL_SEVERITY,
+	/* one column per part, in PgLogTag order */
+	PG_LOG_COL_DETAIL,
+	PG_LOG_COL_LOG_TIME = PG_LOG_COL_DETAIL + PG_LOG_NPARTS,
+	PG_LOG_COL_PID,
+	PG_LOG_COL_USER,
+	PG_LOG_COL_DATABASE,
+	PG_LOG_COL_APPLICATION,
+	PG_LOG_COL_SQLSTATE,
+	PG_LOG_COL_CLIENT_HOST,
+	/* hash of normalized statement, see pg_log_normalize.c */
+	PG_LOG_COL_FINGERPRINT,
+	/* %Q of log_line_prefix, PG 14+ */
+	PG_LOG_COL_QUERY_ID,
+	/* message template, see pg_log_template.c */
+	PG_LOG_COL_TEMPLATE_ID,
+	/* time of a "duration:" entry */
+	PG_LOG_COL_DURATION_MS,
+	PG_LOG_NCOLUMNS
+} PgLogColumn;
+
+#define PG_LOG_COL_PART(tag)	(PG_LOG_COL_DETAIL + (tag) - PG_LOG_TAG_DETAIL)
+
+typedef struct
+{
+	const char	*name;
+	Oid		type;
+	/* PgLogField of log_line_prefix column, -1 otherwise */
+	int		field;
+	/* PgLogDimension of column stored as an id in pglog, -1 otherwise */
+	int		dimension;
+} PgLogColumnDesc;
+
+extern const PgLogColumnDesc pg_log_columns[PG_LOG_NCOLUMNS];
+extern void pg_log_record_values(const PgLogPrefix *prefix, const PgLogLine *line, const PgLogRecord *record,
+				 const PgLogPrefixMatch *match, Datum *values, bool *nulls);
+
+/*
+ * bit masks of 64 byte blocks used by csvlog and jsonlog scanners
+ */
+#define PG_LOG_BLOCK	64
+
+static inline int pg_log_popcount64(uint64 x)
+{
+#if PG_VERSION_NUM >= 120000
+	return pg_popcount64(x);
+#else
+	int	n = 0;
+
+	while (x != 0)
+	{
+		x &= x - 1;
+		n++;
+	}
+	return n;
+#endif
+}
+
+static inline int pg_log_rightmost_one64(uint64 x)
+{
+#if PG_VERSION_NUM >= 120000
+	return pg_rightmost_one_pos64(x);
+#else
+	int	n = 0;
+
+	while ((x & 1) == 0)
+	{
+		x >>= 1;
+		n++;
+	}
+	return n;
+#endif
+}
+
+/*
+ * 8 bit mask of bytes of word equal to c
+ */
+static inline uint64 pg_log_match_bytes(uint64 word, uint64 c)
+{
+	uint64	x = word ^ (c * UINT64CONST(0x0101010101010101));
+	uint64	t;
+
+	/* high bit of each zero byte of x, no false positive */
+	t = ((x & UINT64CONST(0x7f7f7f7f7f7f7f7f)) + UINT64CONST(0x7f7f7f7f7f7f7f7f)) | x;
+	t = ~t & UINT64CONST(0x8080808080808080);
+
+	/* gather high bits: bit i is byte i */
+	return ((t >> 7) * UINT64CONST(0x0102040810204080)) >> 56;
+}
+
+/*
+ * bit i set if xor of bits 0 to i of x is set
+ */
+static inline uint64 pg_log_prefix_xor(uint64 x)
+{
+	x ^= x << 1;
+	x ^= x << 2;
+	x ^= x << 4;
+	x ^= x << 8;
+	x ^= x << 16;
+	x ^= x << 32;
+	return x;
+}
+
+/*
+ * masks[k] gives bytes of block of n <= 64 bytes at p equal to chars[k],
+ * checked 8 bytes at a time
+ */
+static inline void pg_log_block_masks(const char *p, int n, const char *chars, int nchars, uint64 *masks)
+{
+	char	block[PG_LOG_BLOCK];
+	int	i;
+	int	k;
+
+	if (n < PG_LOG_BLOCK)
+	{
+		memcpy(block, p, n);
+		memset(block + n, 0, PG_LOG_BLOCK - n);
+		p = block;
+	}
+
+	memset(masks, 0, sizeof(uint64) * nchars);
+	for (i = 0; i < PG_LOG_BLOCK / sizeof(uint64); i++)
+	{
+		uint64	word;
+
+		memcpy(&word, p + i * sizeof(uint64), sizeof(uint64));
+#ifdef WORDS_BIGENDIAN
+		word = pg_bswap64(word);
+#endif
+		for (k = 0; k < nchars; k++)
+			masks[k] |= pg_log_match_bytes(word, (unsigned char) chars[k]) << (i * 8);
+	}
+}
+
+/*
+ * csvlog (pg_log_csv.c)
+ */
+extern int pg_log_csv_split(const char *data, int len, bool align, PgLogBatch *batch);
+extern void pg_log_csv_record_values(const PgLogLine *line, Datum *values, bool *nulls);
+
+/*
+ * jsonlog (pg_log_json.c)
+ */
+extern void pg_log_json_record_values(const PgLogLine *line, Datum *values, bool *nulls);
+extern text *pg_log_json_text(const char *p, int len);
+
+/*
+ * dimension tables of repeated column values (pg_log_dict.c)
+ */
+typedef enum
+{
+	PG_LOG_DIM_SEVERITY,
+	PG_LOG_DIM_USER,
+	PG_LOG_DIM_DATABASE,
+	PG_LOG_DIM_APPLICATION,
+	PG_LOG_DIM_CLIENT_HOST,
+	PG_LOG_NDIMENSIONS
+} PgLogDimension;
+
+typedef struct
+{
+	const char	*table;
+	/* id column in pglog */
+	const char	*id_column;
+} PgLogDimensionDesc;
+
+/* longer names are interned without the shared memory cache */
+#define PG_LOG_DICT_NAME_LEN	64
+
+typedef struct
+{
+	Oid		relids[PG_LOG_NDIMENSIONS];
+	SPIPlanPtr	plans[PG_LOG_NDIMENSIONS];
+	/* last name interned in each dimension and its id */
+	char		last[PG_LOG_NDIMENSIONS][PG_LOG_DICT_NAME_LEN];
+	int32		last_id[PG_LOG_NDIMENSIONS];
+} PgLogDict;
+
+extern const PgLogDimensionDesc pg_log_dimensions[PG_LOG_NDIMENSIONS];
+extern Size pg_log_dict_shmem_size(void);
+extern void pg_log_dict_shmem_startup(void);
+extern void pg_log_dict_begin(PgLogDict *dict);
+extern int32 pg_log_dict_intern(PgLogDict *dict, int dimension, text *name);
+
+/*
+ * sessions connected and not yet disconnected, by pid (pg_log_session.c)
+ */
+#define PG_LOG_SESSION_NAME_LEN	64
+
+typedef struct
+{
+	TimestampTz	connected_at;
+	int		client_port;
+	char		client_host[PG_LOG_SESSION_NAME_LEN];
+	char		user_name[PG_LOG_SESSION_NAME_LEN];
+	char		database_name[PG_LOG_SESSION_NAME_LEN];
+	char		application_name[PG_LOG_SESSION_NAME_LEN];
+} PgLogSession;
+
+extern Size pg_log_session_shmem_size(void);
+extern void pg_log_session_shmem_startup(void);
+extern void pg_log_session_connect(int pid, TimestampTz connected_at, const char *host, int port);
+extern void pg_log_session_authorize(int pid, const char *user, const char *database, const char *application);
+extern bool pg_log_session_disconnect(int pid, PgLogSession *session);
+
+/*
+ * message templates (pg_log_template.c)
+ */
+typedef struct
+{
+	/* counts by template of current refresh, NULL if not collected */
+	HTAB		*counts;
+	/* counts by template and hour */
+	HTAB		*hours;
+	MemoryContext	context;
+} PgLogTemplates;
+
+extern Size pg_log_template_shmem_size(void);
+extern void pg_log_template_shmem_startup(void);
+extern void pg_log_template_begin(PgLogTemplates *templates);
+extern void pg_log_template_add(PgLogTemplates *templates, Datum *values, bool *nulls);
+extern void pg_log_template_end(PgLogTemplates *templates);
+
+/*
+ * statement normalization (pg_log_normalize.c)
+ */
+extern int pg_log_normalize(const char *src, int len, char *dst);
+extern uint64 pg_log_fingerprint(const char *statement, int len);
+extern void pg_log_fingerprint_values(Datum *values, bool *nulls);
+
+/*
+ * slow query statistics of "duration:" entries (pg_log_slow.c)
+ */
+
+/* bucket 0 is below 1 ms, bucket i from 2^(i-1) ms, last one is open */
+#define PG_LOG_SLOW_NBUCKETS	24
+
+typedef struct
+{
+	/* statements of current refresh, NULL if not collected */
+	HTAB		*statements;
+	/* auto_explain plans of current refresh */
+	HTAB		*plans;
+	MemoryContext	context;
+} PgLogSlowStats;
+
+extern bool pg_log_parse_duration(const char *p, int len, double *ms, const char **kind, int *kind_len,
+				  const char **statement, int *statement_len);
+extern void pg_log_duration_values(Datum *values, bool *nulls);
+extern void pg_log_slow_begin(PgLogSlowStats *stats);
+extern void pg_log_slow_add(PgLogSlowStats *stats, const Datum *values, const bool *nulls);
+extern void pg_log_slow_end(PgLogSlowStats *stats);
+
+/* pg_log_plan.c */
+extern text *pg_log_plan_query_text(const char *p, int len);
+extern Jsonb *pg_log_plan_parse(const char *p, int len, uint64 *shape);
+
+/*
+ * typed event tables filled from log entries (pg_log_events.c)
+ */
+typedef enum
+{
+	PG_LOG_EVENT_CHECKPOINTS,
+	PG_LOG_EVENT_AUTOVACUUM,
+	PG_LOG_EVENT_LOCK_WAITS,
+	PG_LOG_EVENT_LOCK_EDGES,
+	PG_LOG_EVENT_TEMP_FILES,
+	PG_LOG_EVENT_SESSIONS,
+	PG_LOG_NEVENT_TABLES
+} PgLogEventTable;
+
+#define PG_LOG_EVENT_MAX_COLUMNS	32
+
+/* rows of one event table added by current batch */
+typedef struct
+{
+	SPIPlanPtr	plan;
+	/* update of aggregate table, NULL if none */
+	SPIPlanPtr	aggregate_plan;
+	int		nrows;
+	int		capacity;
+	Datum		*values[PG_LOG_EVENT_MAX_COLUMNS];
+	bool		*nulls[PG_LOG_EVENT_MAX_COLUMNS];
+} PgLogEventRows;
+
+typedef struct
+{
+	/* NULL if events are not collected */
+	MemoryContext	context;
+	PgLogEventRows	tables[PG_LOG_NEVENT_TABLES];
+	/* flags of last "checkpoint starting:" entry */
+	char		*checkpoint_flags;
+	/* a checkpoint or restartpoint entry was read by this writer */
+	bool		checkpoint_read;
+	/* table of log entries, searched for starts read by previous writers */
+	const char	*target_table;
+} PgLogEvents;
+
+extern void pg_log_events_begin(PgLogEvents *events, const char *target_table);
+extern void pg_log_events_add(PgLogEvents *events, const Datum *values, const bool *nulls);
+extern void pg_log_events_flush(PgLogEvents *events);
+extern void pg_log_events_end(PgLogEvents *events);
+
+/*
+ * table writer (pg_log_source.c)
+ */
+
+typedef struct PgLogParserEntry PgLogParserEntry;
+
+/*
+ * log source formats
+ */
+typedef enum
+{
+	/* one row per line */
+	PG_LOG_FORMAT_LINES,
+	/* PostgreSQL stderr log: one row per log entry */
+	PG_LOG_FORMAT_STDERR,
+	/* PostgreSQL csvlog: one row per record, same columns as stderr */
+	PG_LOG_FORMAT_CSVLOG,
+	/* PostgreSQL jsonlog: one row per line, same columns as stderr */
+	PG_LOG_FORMAT_JSONLOG
+} PgLogFormat;
+
+typedef struct
+{
+	const char	*target_table;
+	PgLogFormat	format;
+	char		*insert;
+	SPIPlanPtr	plan;
+	/* parser plugin, NULL for (id, message) rows */
+	PgLogParserEntry *parser;
+	MemoryContext	batch_context;
+	/* per-database routing of server log, NULL if not used */
+	HTAB		*routes;
+	MemoryContext	routing_context;
+	/* dimension ids of log entry columns */
+	PgLogDict	dict;
+	PgLogSlowStats	slow;
+	PgLogEvents	events;
+	PgLogTemplates	templates;
+} PgLogWriter;
+
+extern void pg_log_writer_begin(PgLogWriter *writer, const char *target_table, const char *parser, PgLogFormat format);
+extern void pg_log_writer_write(PgLogWriter *writer, PgLogBatch *batch);
+extern void pg_log_writer_end(PgLogWriter *writer);
+extern void pg_log_truncate(const char *target_table);
+extern void pg_log_refresh_sources(void);
+
+/*
+ * shared memory and flush barrier (pg_log_shmem.c)
+ */
+extern void pg_log_shmem_init(void);
+extern void pg_log_sync_attach(void);
+extern uint64 pg_log_sync_begin(void);
+extern void pg_log_sync_set_position(const char *file, int64 offset);
+extern void pg_log_sync_end(uint64 ticket);
+
+/*
+ * per-database routing (pg_log_route.c)
+ */
+extern HTAB *pg_log_create_routes(MemoryContext cxt);
+extern void pg_log_route_line(HTAB *routes, MemoryContext cxt, const PgLogLine *line, const PgLogPrefixMatch *match);
+extern void pg_log_dispatch_routes(HTAB *routes, int64 file_number, bool reset);
+extern PGDLLEXPORT void pg_log_sink_main(Datum main_arg);
+
+#endif							/* PG_LOG_H */
@@ -0,0 +1,291 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_log_csv.c
+ *	  csvlog record splitter and parser.
+ *
+ * csvlog fields may be quoted and contain newlines, so records cannot be
+ * found with memchr(). Input is classified by 64 byte blocks: one 64 bit
+ * mask per block gives the position of quotes, another one of newlines or
+ * commas. Bytes inside quotes are given by the prefix xor of the quote
+ * mask, the quote state being carried from one block to the next: record
+ * and field boundaries are then the bits of the newline or comma mask
+ * outside quotes. Escaped quotes ("") toggle the state twice and need no
+ * special case.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (c) 2022, Pierre Forstmann.
+ *
+ *-------------------------------------------------------------------------
+*/
+#include "postgres.h"
+
+#include "catalog/pg_type.h"
+#include "utils/builtins.h"
+
+#include "pg_log.h"
+
+/*
+ * csvlog fields, leader_pid and query_id are only written by PG 14+
+ */
+typedef enum
+{
+	PG_LOG_CSV_LOG_TIME,
+	PG_LOG_CSV_USER_NAME,
+	PG_LOG_CSV_DATABASE_NAME,
+	PG_LOG_CSV_PROCESS_ID,
+	PG_LOG_CSV_CONNECTION_FROM,
+	PG_LOG_CSV_SESSION_ID,
+	PG_LOG_CSV_SESSION_LINE_NUM,
+	PG_LOG_CSV_COMMAND_TAG,
+	PG_LOG_CSV_SESSION_START_TIME,
+	PG_LOG_CSV_VIRTUAL_TRANSACTION_ID,
+	PG_LOG_CSV_TRANSACTION_ID,
+	PG_LOG_CSV_ERROR_SEVERITY,
+	PG_LOG_CSV_SQL_STATE_CODE,
+	PG_LOG_CSV_MESSAGE,
+	PG_LOG_CSV_DETAIL,
+	PG_LOG_CSV_HINT,
+	PG_LOG_CSV_INTERNAL_QUERY,
+	PG_LOG_CSV_INTERNAL_QUERY_POS,
+	PG_LOG_CSV_CONTEXT,
+	PG_LOG_CSV_QUERY,
+	PG_LOG_CSV_QUERY_POS,
+	PG_LOG_CSV_LOCATION,
+	PG_LOG_CSV_APPLICATION_NAME,
+	PG_LOG_CSV_BACKEND_TYPE,
+	PG_LOG_CSV_LEADER_PID,
+	PG_LOG_CSV_QUERY_ID,
+	PG_LOG_CSV_NFIELDS
+} PgLogCsvField;
+
+/*
+ * csvlog field of each pglog column
+ */
+static const int pg_log_csv_columns[PG_LOG_NCOLUMNS] = {
+	PG_LOG_CSV_MESSAGE,
+	PG_LOG_CSV_ERROR_SEVERITY,
+	PG_LOG_CSV_DETAIL,
+	PG_LOG_CSV_HINT,
+	PG_LOG_CSV_INTERNAL_QUERY,
+	PG_LOG_CSV_CONTEXT,
+	PG_LOG_CSV_LOCATION,
+	PG_LOG_CSV_QUERY,
+	PG_LOG_CSV_LOG_TIME,
+	PG_LOG_CSV_PROCESS_ID,
+	PG_LOG_CSV_USER_NAME,
+	PG_LOG_CSV_DATABASE_NAME,
+	PG_LOG_CSV_APPLICATION_NAME,
+	PG_LOG_CSV_SQL_STATE_CODE,
+	PG_LOG_CSV_CONNECTION_FROM,
+	/* computed */
+	-1,
+	PG_LOG_CSV_QUERY_ID,
+	-1,
+	-1
+};
+
+/*
+ * classify block of up to 64 bytes at p
+ *
+ * Return mask of bytes equal to c outside quotes, set *all to mask of all
+ * bytes equal to c. *inquote is all ones if block starts inside quotes and
+ * is updated for the next block.
+ */
+static uint64 pg_log_csv_block(const char *p, int n, char c, uint64 *inquote, uint64 *all)
+{
+	char	chars[2] = { '"', c };
+	uint64	masks[2];
+	uint64	inside;
+
+	pg_log_block_masks(p, n, chars, 2, masks);
+
+	inside = pg_log_prefix_xor(masks[0]) ^ *inquote;
+	*inquote = (uint64) 0 - (inside >> 63);
+	*all = masks[1];
+
+	return masks[1] & ~inside;
+}
+
+/*
+ * records start with a timestamp, used to find the first complete record
+ * after an arbitrary offset
+ */
+static bool pg_log_csv_record_start(const char *p, int avail)
+{
+	return avail >= 11 && p[4] == '-' && p[7] == '-' && p[10] == ' ' &&
+	       p[0] >= '0' && p[0] <= '9';
+}
+
+/*
+ * cut complete csvlog records of data into batch until batch is full
+ *
+ * If align is true, data starts at an arbitrary offset: bytes up to the
+ * first newline followed by a timestamp are returned as first record. Return
+ * number of bytes of returned records.
+ */
+int pg_log_csv_split(const char *data, int len, bool align, PgLogBatch *batch)
+{
+	const char	*record = data;
+	uint64		inquote = 0;
+	int		nlines = 0;
+	int		pos;
+
+	if (align)
+	{
+		const char	*p = data;
+		const char	*nl;
+
+		while ((nl = memchr(p, '\n', data + len - p)) != NULL)
+		{
+			p = nl + 1;
+			nlines++;
+			if (pg_log_csv_record_start(p, data + len - p))
+				break;
+		}
+		if (nl == NULL)
+			return 0;
+
+		batch->lines[batch->nlines].data = data;
+		batch->lines[batch->nlines].len = p - 1 - data;
+		batch->lines[batch->nlines].lineno = 0;
+		batch->records[batch->nlines++].nlines = nlines;
+		record = p;
+		nlines = 0;
+	}
+
+	for (pos = record - data; pos < len && batch->nlines < PG_LOG_BATCH_SIZE; pos += PG_LOG_BLOCK)
+	{
+		int	n = Min(PG_LOG_BLOCK, len - pos);
+		uint64	all;
+		uint64	ends = pg_log_csv_block(data + pos, n, '\n', &inquote, &all);
+		uint64	counted = 0;
+
+		while (ends != 0 && batch->nlines < PG_LOG_BATCH_SIZE)
+		{
+			int	bit = pg_log_rightmost_one64(ends);
+			uint64	upto = (bit == 63) ? ~UINT64CONST(0) : (UINT64CONST(1) << (bit + 1)) - 1;
+			PgLogLine *line = &batch->lines[batch->nlines];
+
+			nlines += pg_log_popcount64(all & upto & ~counted);
+			counted = upto;
+
+			line->data = record;
+			line->len = data + pos + bit - record;
+			line->lineno = 0;
+			batch->records[batch->nlines++].nlines = nlines;
+
+			record = data + pos + bit + 1;
+			nlines = 0;
+			ends &= ends - 1;
+		}
+		nlines += pg_log_popcount64(all & ~counted);
+	}
+
+	return record - data;
+}
+
+/*
+ * text of csv field, without quotes and with "" unescaped
+ */
+static text *pg_log_csv_text(const char *p, int len)
+{
+	text	*result;
+	char	*dst;
+	int	i;
+
+	if (len < 2 || p[0] != '"')
+		return cstring_to_text_with_len(p, len);
+
+	result = (text *) palloc(len + VARHDRSZ);
+	dst = VARDATA(result);
+	for (i = 1; i < len - 1; i++)
+	{
+		*dst++ = p[i];
+		if (p[i] == '"')
+			i++;
+	}
+	SET_VARSIZE(result, dst - VARDATA(result) + VARHDRSZ);
+
+	return result;
+}
+
+/*
+ * Datums of pglog columns from csvlog record
+ */
+void pg_log_csv_record_values(const PgLogLine *line, Datum *values, bool *nulls)
+{
+	PgLogSlice	fields[PG_LOG_CSV_NFIELDS];
+	const char	*start = line->data;
+	uint64		inquote = 0;
+	int		nfields = 0;
+	int		pos;
+	int		j;
+
+	memset(fields, 0, sizeof(fields));
+
+	/* field boundaries are commas outside quotes */
+	for (pos = 0; pos < line->len && nfields < PG_LOG_CSV_NFIELDS; pos += PG_LOG_BLOCK)
+	{
+		uint64	all;
+		uint64	commas = pg_log_csv_block(line->data + pos, Min(PG_LOG_BLOCK, line->len - pos), ',', &inquote, &all);
+
+		while (commas != 0 && nfields < PG_LOG_CSV_NFIELDS)
+		{
+			const char	*comma = line->data + pos + pg_log_rightmost_one64(commas);
+
+			fields[nfields].data = start;
+			fields[nfields++].len = comma - start;
+			start = comma + 1;
+			commas &= commas - 1;
+		}
+	}
+	if (nfields < PG_LOG_CSV_NFIELDS)
+	{
+		fields[nfields].data = start;
+		fields[nfields++].len = line->data + line->len - start;
+	}
+
+	for (j = 0; j < PG_LOG_NCOLUMNS; j++)
+	{
+		PgLogSlice	*field;
+
+		nulls[j] = true;
+		if (pg_log_csv_columns[j] < 0)
+			continue;
+		field = &fields[pg_log_csv_columns[j]];
+		if (field->data == NULL || field->len == 0)
+			continue;
+
+		/* connection_from is "host:port" for TCP connections, like %r */
+		if (j == PG_LOG_COL_CLIENT_HOST)
+		{
+			const char	*colon;
+
+			/* always quoted by the server */
+			if (field->len >= 2 && field->data[0] == '"' && field->data[field->len - 1] == '"')
+			{
+				field->data++;
+				field->len -= 2;
+				if (field->len == 0)
+					continue;
+			}
+			colon = field->data + field->len - 1;
+			while (colon > field->data && *colon >= '0' && *colon <= '9')
+				colon--;
+			if (colon > field->data && *colon == ':' && colon < field->data + field->len - 1)
+				field->len = colon - field->data;
+		}
+
+		if (pg_log_columns[j].field >= 0 && pg_log_columns[j].type != TEXTOID)
+			values[j] = pg_log_field_value('m', pg_log_columns[j].field, field, &nulls[j]);
+		else
+		{
+			values[j] = PointerGetDatum(pg_log_csv_text(field->data, field->len));
+			nulls[j] = false;
+		}
+	}
+	pg_log_fingerprint_values(values, nulls);
+	pg_log_duration_values(values, nulls);
+}
@@ -0,0 +1,279 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_log_dict.c
+ *	  dimension tables of repeated log entry column values.
+ *
+ * Severities, user, database, application names and client hosts are
+ * stored once in small dimension tables and pglog rows only keep their
+ * integer id. Ids are looked up in a shared memory hash table before
+ * running the SPI statement which finds or creates the dimension row.
+ *
+ * A dimension row created by a transaction which aborts disappears: ids
+ * found by SPI are only published in shared memory once the transaction
+ * has committed, without those found by a subtransaction which aborted.
+ * Ids found by a prepared transaction are not published: they are found
+ * again by SPI.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (c) 2022, Pierre Forstmann.
+ *
+ *-------------------------------------------------------------------------
+*/
+#include "postgres.h"
+
+#include "access/xact.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_type.h"
+#include "miscadmin.h"
+#include "nodes/makefuncs.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+
+#include "pg_log.h"
+
+/* maximum number of names kept in shared memory */
+#define PG_LOG_DICT_SIZE	4096
+
+const PgLogDimensionDesc pg_log_dimensions[PG_LOG_NDIMENSIONS] = {
+	{"pglog_severities", "severity_id"},
+	{"pglog_users", "user_id"},
+	{"pglog_databases", "database_id"},
+	{"pglog_applications", "application_id"},
+	{"pglog_client_hosts", "client_host_id"}
+};
+
+typedef struct
+{
+	/* dimension tables of each database have their own ids */
+	Oid		dbid;
+	Oid		relid;
+	char		name[PG_LOG_DICT_NAME_LEN];
+} PgLogDictKey;
+
+typedef struct
+{
+	PgLogDictKey	key;
+	int32		id;
+} PgLogDictEntry;
+
+typedef struct
+{
+	PgLogDictEntry	entry;
+	/* subtransaction which found the id */
+	SubTransactionId subid;
+} PgLogDictPending;
+
+static HTAB *pg_log_dict_hash = NULL;
+static LWLock *pg_log_dict_lock = NULL;
+
+/* ids found by SPI in current transaction, published at commit */
+static List *pending = NIL;
+static bool xact_callback_registered = false;
+
+Size pg_log_dict_shmem_size(void)
+{
+	return hash_estimate_size(PG_LOG_DICT_SIZE, sizeof(PgLogDictEntry));
+}
+
+/*
+ * called by shared memory startup hook with AddinShmemInitLock held
+ */
+void pg_log_dict_shmem_startup(void)
+{
+	HASHCTL	info;
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(PgLogDictKey);
+	info.entrysize = sizeof(PgLogDictEntry);
+	pg_log_dict_hash = ShmemInitHash("pg_log dictionary", PG_LOG_DICT_SIZE, PG_LOG_DICT_SIZE,
+					 &info, HASH_ELEM | HASH_BLOBS);
+	pg_log_dict_lock = &(GetNamedLWLockTranche("pg_log"))->lock;
+}
+
+static void pg_log_dict_xact_callback(XactEvent event, void *arg)
+{
+	ListCell	*cell;
+
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+			if (pending != NIL && pg_log_dict_hash != NULL)
+			{
+				LWLockAcquire(pg_log_dict_lock, LW_EXCLUSIVE);
+				foreach(cell, pending)
+				{
+					PgLogDictPending *found = (PgLogDictPending *) lfirst(cell);
+					PgLogDictEntry	*entry;
+
+					/* cache is full: names not cached are found by SPI */
+					entry = hash_search(pg_log_dict_hash, &found->entry.key, HASH_ENTER_NULL, NULL);
+					if (entry != NULL)
+						entry->id = found->entry.id;
+				}
+				LWLockRelease(pg_log_dict_lock);
+			}
+			pending = NIL;
+			break;
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PREPARE:
+			/* list was allocated in TopTransactionContext */
+			pending = NIL;
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * ids found by a subtransaction belong to its parent when it commits and
+ * are forgotten when it aborts
+ */
+static void pg_log_dict_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+					 SubTransactionId parentSubid, void *arg)
+{
+	List		*kept = NIL;
+	ListCell	*cell;
+	MemoryContext	oldcontext;
+
+	if (event != SUBXACT_EVENT_COMMIT_SUB && event != SUBXACT_EVENT_ABORT_SUB)
+		return;
+
+	oldcontext = MemoryContextSwitchTo(TopTransactionContext);
+	foreach(cell, pending)
+	{
+		PgLogDictPending *found = (PgLogDictPending *) lfirst(cell);
+
+		if (found->subid == mySubid)
+		{
+			if (event == SUBXACT_EVENT_ABORT_SUB)
+			{
+				pfree(found);
+				continue;
+			}
+			found->subid = parentSubid;
+		}
+		kept = lappend(kept, found);
+	}
+	list_free(pending);
+	pending = kept;
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * prepare dimension statements, called by pg_log_writer_begin()
+ */
+void pg_log_dict_begin(PgLogDict *dict)
+{
+	Oid	argtypes[1] = { TEXTOID };
+	int	i;
+
+	memset(dict, 0, sizeof(PgLogDict));
+	for (i = 0; i < PG_LOG_NDIMENSIONS; i++)
+	{
+		const char	*table = pg_log_dimensions[i].table;
+		char		*sql;
+
+		dict->relids[i] = RangeVarGetRelid(makeRangeVar(NULL, (char *) table, -1), NoLock, true);
+		if (!OidIsValid(dict->relids[i]))
+			elog(ERROR, "pg_log: dimension table %s does not exist", table);
+
+		sql = psprintf("with ins as (insert into %s(name) values ($1) on conflict (name) do nothing returning id) "
+			       "select id from ins union all select id from %s where name = $1",
+			       table, table);
+		dict->plans[i] = SPI_prepare(sql, 1, argtypes);
+		if (dict->plans[i] == NULL)
+			elog(ERROR, "pg_log: SPI_prepare failed for %s", table);
+		pfree(sql);
+	}
+
+	if (!xact_callback_registered)
+	{
+		RegisterXactCallback(pg_log_dict_xact_callback, NULL);
+		RegisterSubXactCallback(pg_log_dict_subxact_callback, NULL);
+		xact_callback_registered = true;
+	}
+}
+
+/*
+ * id of name in dimension table, created if needed
+ */
+static int32 pg_log_dict_lookup(PgLogDict *dict, int dimension, text *name)
+{
+	Datum	values[1];
+	bool	isnull;
+	int32	id;
+
+	values[0] = PointerGetDatum(name);
+	for (;;)
+	{
+		int	ret_code = SPI_execute_plan(dict->plans[dimension], values, NULL, false, 1);
+
+		if (ret_code != SPI_OK_SELECT)
+			elog(ERROR, "pg_log: SPI_execute_plan failed on %s: %d", pg_log_dimensions[dimension].table, ret_code);
+		/*
+		 * row inserted by a concurrent transaction after statement
+		 * snapshot: not visible yet, next statement sees it
+		 */
+		if (SPI_processed > 0)
+			break;
+		CHECK_FOR_INTERRUPTS();
+	}
+	id = DatumGetInt32(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull));
+	SPI_freetuptable(SPI_tuptable);
+
+	return id;
+}
+
+int32 pg_log_dict_intern(PgLogDict *dict, int dimension, text *name)
+{
+	int		len = VARSIZE_ANY_EXHDR(name);
+	PgLogDictKey	key;
+	PgLogDictEntry	*entry;
+	int32		id;
+
+	if (len >= PG_LOG_DICT_NAME_LEN)
+		return pg_log_dict_lookup(dict, dimension, name);
+
+	/* consecutive entries often have the same values */
+	if (dict->last_id[dimension] != 0 && strlen(dict->last[dimension]) == len &&
+	    memcmp(dict->last[dimension], VARDATA_ANY(name), len) == 0)
+		return dict->last_id[dimension];
+
+	memset(&key, 0, sizeof(key));
+	key.dbid = MyDatabaseId;
+	key.relid = dict->relids[dimension];
+	memcpy(key.name, VARDATA_ANY(name), len);
+
+	entry = NULL;
+	if (pg_log_dict_hash != NULL)
+	{
+		LWLockAcquire(pg_log_dict_lock, LW_SHARED);
+		entry = hash_search(pg_log_dict_hash, &key, HASH_FIND, NULL);
+		id = (entry != NULL) ? entry->id : 0;
+		LWLockRelease(pg_log_dict_lock);
+	}
+	if (entry == NULL)
+	{
+		MemoryContext	oldcontext;
+		PgLogDictPending *found;
+
+		id = pg_log_dict_lookup(dict, dimension, name);
+
+		oldcontext = MemoryContextSwitchTo(TopTransactionContext);
+		found = palloc(sizeof(PgLogDictPending));
+		found->entry.key = key;
+		found->entry.id = id;
+		found->subid = GetCurrentSubTransactionId();
+		pending = lappend(pending, found);
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	memcpy(dict->last[dimension], key.name, PG_LOG_DICT_NAME_LEN);
+	dict->last_id[dimension] = id;
+
+	return id;
+}
@@ -0,0 +1,1001 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_log_events.c
+ *	  typed event tables filled from log entries.
+ *
+ * Some server messages have a fixed format with numbers which are worth
+ * keeping as columns: such entries are recognized by the beginning of
+ * their message while the writer builds pglog rows, parsed into rows of
+ * an event table and inserted with the batch, with one
+ * INSERT ... SELECT FROM unnest() per event table.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (c) 2022, Pierre Forstmann.
+ *
+ *-------------------------------------------------------------------------
+*/
+#include "postgres.h"
+
+#include "catalog/pg_type.h"
+#include "lib/stringinfo.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/pg_lsn.h"
+
+#include "pg_log.h"
+
+typedef struct
+{
+	const char	*table;
+	int		ncolumns;
+	const char	*columns[PG_LOG_EVENT_MAX_COLUMNS];
+	Oid		types[PG_LOG_EVENT_MAX_COLUMNS];
+	/*
+	 * statement updating an aggregate table from rows of batch, which are
+	 * in e, NULL if none
+	 */
+	const char	*aggregate;
+} PgLogEventTableDesc;
+
+static const PgLogEventTableDesc pg_log_event_tables[PG_LOG_NEVENT_TABLES] = {
+	{
+		"pglog_checkpoints", 18,
+		{"log_time", "kind", "flags", "buffers_written", "buffers_pct", "wal_added", "wal_removed",
+		 "wal_recycled", "write_s", "sync_s", "total_s", "sync_files", "longest_sync_s", "average_sync_s",
+		 "distance_kb", "estimate_kb", "lsn", "redo_lsn"},
+		{TIMESTAMPTZOID, TEXTOID, TEXTOID, INT4OID, FLOAT8OID, INT4OID, INT4OID,
+		 INT4OID, FLOAT8OID, FLOAT8OID, FLOAT8OID, INT4OID, FLOAT8OID, FLOAT8OID,
+		 INT8OID, INT8OID, LSNOID, LSNOID},
+		NULL
+	},
+	{
+		"pglog_autovacuum", 24,
+		{"log_time", "kind", "aggressive", "wraparound", "database", "relation", "index_scans",
+		 "pages_removed", "pages_remain", "tuples_removed", "tuples_remain", "buffer_hits", "buffer_misses",
+		 "buffer_dirtied", "read_ms", "write_ms", "read_rate_mbs", "write_rate_mbs", "wal_records", "wal_fpi",
+		 "wal_bytes", "cpu_user_s", "cpu_system_s", "elapsed_s"},
+		{TIMESTAMPTZOID, TEXTOID, BOOLOID, BOOLOID, TEXTOID, TEXTOID, INT4OID,
+		 INT8OID, INT8OID, INT8OID, INT8OID, INT8OID, INT8OID,
+		 INT8OID, FLOAT8OID, FLOAT8OID, FLOAT8OID, FLOAT8OID, INT8OID, INT8OID,
+		 INT8OID, FLOAT8OID, FLOAT8OID, FLOAT8OID},
+		"insert into pglog_autovacuum_tables as t(database, relation, kind, runs, elapsed_s, max_elapsed_s, "
+		"pages_removed, tuples_removed, wal_bytes, first_seen, last_seen) "
+		"select database, relation, kind, count(*), coalesce(sum(elapsed_s), 0), max(elapsed_s), "
+		"coalesce(sum(pages_removed), 0), coalesce(sum(tuples_removed), 0), coalesce(sum(wal_bytes), 0), "
+		"min(log_time), max(log_time) from e where database is not null and relation is not null "
+		"group by database, relation, kind "
+		"on conflict (database, relation, kind) do update set runs = t.runs + excluded.runs, "
+		"elapsed_s = t.elapsed_s + excluded.elapsed_s, "
+		"max_elapsed_s = greatest(t.max_elapsed_s, excluded.max_elapsed_s), "
+		"pages_removed = t.pages_removed + excluded.pages_removed, "
+		"tuples_removed = t.tuples_removed + excluded.tuples_removed, "
+		"wal_bytes = t.wal_bytes + excluded.wal_bytes, "
+		"first_seen = least(t.first_seen, excluded.first_seen), "
+		"last_seen = greatest(t.last_seen, excluded.last_seen)"
+	},
+	{
+		"pglog_lock_waits", 10,
+		{"log_time", "pid", "event", "lock_mode", "lock_object", "database", "relation", "wait_ms",
+		 "holders", "wait_queue"},
+		{TIMESTAMPTZOID, INT4OID, TEXTOID, TEXTOID, TEXTOID, OIDOID, OIDOID, FLOAT8OID,
+		 TEXTOID, TEXTOID},
+		NULL
+	},
+	{
+		"pglog_lock_edges", 10,
+		{"log_time", "pid", "event", "waiter", "blocker", "lock_mode", "lock_object", "database", "relation",
+		 "statement"},
+		{TIMESTAMPTZOID, INT4OID, TEXTOID, INT4OID, INT4OID, TEXTOID, TEXTOID, OIDOID, OIDOID,
+		 TEXTOID},
+		NULL
+	},
+	{
+		"pglog_temp_files", 6,
+		{"log_time", "pid", "path", "size_bytes", "fingerprint", "statement"},
+		{TIMESTAMPTZOID, INT4OID, TEXTOID, INT8OID, INT8OID, TEXTOID},
+		"insert into pglog_temp_files_hourly as t(fingerprint, hour, files, total_bytes, max_bytes, statement) "
+		"select coalesce(fingerprint, 0), date_trunc('hour', log_time), count(*), sum(size_bytes), "
+		"max(size_bytes), min(statement) from e where log_time is not null group by 1, 2 "
+		"on conflict (fingerprint, hour) do update set files = t.files + excluded.files, "
+		"total_bytes = t.total_bytes + excluded.total_bytes, "
+		"max_bytes = greatest(t.max_bytes, excluded.max_bytes), "
+		"statement = coalesce(t.statement, excluded.statement)"
+	},
+	{
+		"pglog_sessions", 9,
+		{"connected_at", "disconnected_at", "duration_s", "pid", "user_name", "database_name",
+		 "application_name", "client_host", "client_port"},
+		{TIMESTAMPTZOID, TIMESTAMPTZOID, FLOAT8OID, INT4OID, TEXTOID, TEXTOID,
+		 TEXTOID, TEXTOID, INT4OID},
+		NULL
+	}
+};
+
+void pg_log_events_begin(PgLogEvents *events, const char *target_table)
+{
+	int	i;
+	int	j;
+
+	memset(events, 0, sizeof(PgLogEvents));
+	events->target_table = target_table;
+	events->context = AllocSetContextCreate(CurrentMemoryContext,
+						"pg_log events",
+						ALLOCSET_DEFAULT_SIZES);
+
+	for (i = 0; i < PG_LOG_NEVENT_TABLES; i++)
+	{
+		PgLogEventRows	*rows = &events->tables[i];
+
+		rows->capacity = PG_LOG_BATCH_SIZE;
+		for (j = 0; j < pg_log_event_tables[i].ncolumns; j++)
+		{
+			rows->values[j] = MemoryContextAlloc(events->context, sizeof(Datum) * rows->capacity);
+			rows->nulls[j] = MemoryContextAlloc(events->context, sizeof(bool) * rows->capacity);
+		}
+	}
+}
+
+static void pg_log_event_append(PgLogEvents *events, int table, const Datum *values, const bool *nulls)
+{
+	PgLogEventRows	*rows = &events->tables[table];
+	int		j;
+
+	if (rows->nrows == rows->capacity)
+	{
+		rows->capacity *= 2;
+		for (j = 0; j < pg_log_event_tables[table].ncolumns; j++)
+		{
+			rows->values[j] = repalloc(rows->values[j], sizeof(Datum) * rows->capacity);
+			rows->nulls[j] = repalloc(rows->nulls[j], sizeof(bool) * rows->capacity);
+		}
+	}
+
+	for (j = 0; j < pg_log_event_tables[table].ncolumns; j++)
+	{
+		rows->values[j][rows->nrows] = values[j];
+		rows->nulls[j][rows->nrows] = nulls[j];
+	}
+	rows->nrows++;
+}
+
+static bool pg_log_event_prefix(const char *p, int len, const char *prefix)
+{
+	int	prefix_len = strlen(prefix);
+
+	return len >= prefix_len && memcmp(p, prefix, prefix_len) == 0;
+}
+
+/*
+ * flags of a start read by a previous writer: last checkpoint entry of the
+ * target table before completion at log_time, if it is a start
+ */
+static char *pg_log_event_checkpoint_start(PgLogEvents *events, const char *kind, Datum log_time)
+{
+	Oid	argtypes[1] = { TIMESTAMPTZOID };
+	char	*query;
+	char	*flags = NULL;
+	int	ret_code;
+
+	query = psprintf("select message from %s where log_time > $1 - interval '1 day' and log_time <= $1 "
+			 "and (message like '%s starting: %%' or message like '%s complete: %%') "
+			 "order by log_time desc, id desc limit 1",
+			 events->target_table, kind, kind);
+	ret_code = SPI_execute_with_args(query, 1, argtypes, &log_time, NULL, true, 1);
+	if (ret_code != SPI_OK_SELECT)
+		elog(ERROR, "pg_log: SELECT FROM %s failed: %d", events->target_table, ret_code);
+
+	if (SPI_processed == 1)
+	{
+		char	*message = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1);
+		int	len = strlen(kind);
+
+		if (strncmp(message, kind, len) == 0 && strncmp(message + len, " starting: ", 11) == 0)
+			flags = MemoryContextStrdup(events->context, message + len + 11);
+		pfree(message);
+	}
+	SPI_freetuptable(SPI_tuptable);
+	pfree(query);
+
+	return flags;
+}
+
+/*
+ * checkpoint and restartpoint written with log_checkpoints:
+ *
+ *	checkpoint starting: time
+ *	checkpoint complete: wrote 12 buffers (0.1%); 0 WAL file(s) added,
+ *	0 removed, 1 recycled; write=1.105 s, sync=0.003 s, total=1.120 s;
+ *	sync files=9, longest=0.002 s, average=0.001 s; distance=42 kB,
+ *	estimate=42 kB[; lsn=0/1A2B3C4, redo lsn=0/1A2B3B0]
+ *
+ * A completion row gets the flags of the previous start, looked up in the
+ * target table if it was read by a previous refresh.
+ */
+static void pg_log_event_checkpoint(PgLogEvents *events, const char *kind, const Datum *entry, const bool *entry_nulls,
+				    const char *message)
+{
+	const char	*p = message + strlen(kind);
+	Datum		values[18];
+	bool		nulls[18];
+	int		ints[7];
+	double		doubles[6];
+	int		n;
+	int		j;
+	const char	*lsn;
+
+	if (strncmp(p, " starting: ", 11) == 0)
+	{
+		if (events->checkpoint_flags != NULL)
+			pfree(events->checkpoint_flags);
+		events->checkpoint_flags = MemoryContextStrdup(events->context, p + 11);
+		events->checkpoint_read = true;
+		return;
+	}
+	if (strncmp(p, " complete: ", 11) != 0)
+		return;
+
+	/* first completion of this writer may follow a start already read */
+	if (!events->checkpoint_read && !entry_nulls[PG_LOG_COL_LOG_TIME])
+		events->checkpoint_flags = pg_log_event_checkpoint_start(events, kind, entry[PG_LOG_COL_LOG_TIME]);
+	events->checkpoint_read = true;
+
+	n = sscanf(p + 11, "wrote %d buffers (%lf%%); %d WAL file(s) added, %d removed, %d recycled; "
+		   "write=%lf s, sync=%lf s, total=%lf s; sync files=%d, longest=%lf s, average=%lf s; "
+		   "distance=%d kB, estimate=%d kB",
+		   &ints[0], &doubles[0], &ints[1], &ints[2], &ints[3], &doubles[1], &doubles[2], &doubles[3],
+		   &ints[4], &doubles[4], &doubles[5], &ints[5], &ints[6]);
+	if (n < 1)
+		return;
+
+	for (j = 0; j < 18; j++)
+		nulls[j] = true;
+
+	values[0] = entry[PG_LOG_COL_LOG_TIME];
+	nulls[0] = entry_nulls[PG_LOG_COL_LOG_TIME];
+	values[1] = CStringGetTextDatum(kind);
+	nulls[1] = false;
+	if (events->checkpoint_flags != NULL)
+	{
+		values[2] = CStringGetTextDatum(events->checkpoint_flags);
+		nulls[2] = false;
+		pfree(events->checkpoint_flags);
+		events->checkpoint_flags = NULL;
+	}
+
+	/* fields read by sscanf() are columns 3 to 3 + n - 1 */
+	for (j = 0; j < n; j++)
+	{
+		/* index in ints if >= 0, else in doubles: -1 - index */
+		static const int	fields[13] = { 0, -1, 1, 2, 3, -2, -3, -4, 4, -5, -6, 5, 6 };
+		int			column = 3 + j;
+		Oid			type = pg_log_event_tables[PG_LOG_EVENT_CHECKPOINTS].types[column];
+
+		if (type == INT8OID)
+			values[column] = Int64GetDatum((int64) ints[fields[j]]);
+		else if (type == INT4OID)
+			values[column] = Int32GetDatum(ints[fields[j]]);
+		else
+			values[column] = Float8GetDatum(doubles[-1 - fields[j]]);
+		nulls[column] = false;
+	}
+
+	/* PG 15+ */
+	lsn = strstr(p, "; lsn=");
+	if (lsn != NULL)
+	{
+		unsigned int	lsn_hi;
+		unsigned int	lsn_lo;
+		unsigned int	redo_hi;
+		unsigned int	redo_lo;
+
+		n = sscanf(lsn, "; lsn=%X/%X, redo lsn=%X/%X", &lsn_hi, &lsn_lo, &redo_hi, &redo_lo);
+		if (n >= 2)
+		{
+			values[16] = LSNGetDatum(((uint64) lsn_hi << 32) | lsn_lo);
+			nulls[16] = false;
+		}
+		if (n == 4)
+		{
+			values[17] = LSNGetDatum(((uint64) redo_hi << 32) | redo_lo);
+			nulls[17] = false;
+		}
+	}
+
+	pg_log_event_append(events, PG_LOG_EVENT_CHECKPOINTS, values, nulls);
+}
+
+/*
+ * position following key in message, NULL if not found
+ */
+static const char *pg_log_event_find(const char *message, const char *key)
+{
+	const char	*p = strstr(message, key);
+
+	return (p != NULL) ? p + strlen(key) : NULL;
+}
+
+static void pg_log_event_int8(Datum *values, bool *nulls, int column, long long value)
+{
+	values[column] = Int64GetDatum((int64) value);
+	nulls[column] = false;
+}
+
+static void pg_log_event_float8(Datum *values, bool *nulls, int column, double value)
+{
+	values[column] = Float8GetDatum(value);
+	nulls[column] = false;
+}
+
+/*
+ * vacuum and analyze written with log_autovacuum_min_duration:
+ *
+ *	automatic [aggressive ]vacuum[ to prevent wraparound] of table
+ *	"db.schema.table": index scans: 1
+ *	pages: 0 removed, 1234 remain, ...
+ *	tuples: 100 removed, 5000 remain, ...
+ *	I/O timings: read: 1.234 ms, write: 0.000 ms
+ *	avg read rate: 1.234 MB/s, avg write rate: 0.000 MB/s
+ *	buffer usage: 100 hits, 5 misses, 3 dirtied
+ *	WAL usage: 10 records, 2 full page images, 12345 bytes
+ *	system usage: CPU: user: 0.01 s, system: 0.00 s, elapsed: 0.05 s
+ *
+ * Lines depend on server version and on track_io_timing: missing ones
+ * give NULL columns. Analyze entries only have the last lines.
+ */
+static void pg_log_event_autovacuum(PgLogEvents *events, const Datum *entry, const bool *entry_nulls,
+				    const char *message)
+{
+	const char	*p = message + strlen("automatic ");
+	Datum		values[24];
+	bool		nulls[24];
+	bool		aggressive = false;
+	bool		wraparound = false;
+	const char	*kind;
+	const char	*name;
+	const char	*end;
+	const char	*dot;
+	const char	*q;
+	int		index_scans;
+	long long	l1;
+	long long	l2;
+	long long	l3;
+	double		d1;
+	double		d2;
+	double		d3;
+	int		j;
+
+	if (strncmp(p, "aggressive ", 11) == 0)
+	{
+		aggressive = true;
+		p += 11;
+	}
+	if (strncmp(p, "vacuum ", 7) == 0)
+	{
+		kind = "vacuum";
+		p += 7;
+	}
+	else if (strncmp(p, "analyze ", 8) == 0)
+	{
+		kind = "analyze";
+		p += 8;
+	}
+	else
+		return;
+	if (strncmp(p, "to prevent wraparound ", 22) == 0)
+	{
+		wraparound = true;
+		p += 22;
+	}
+	if (strncmp(p, "of table \"", 10) != 0)
+		return;
+	name = p + 10;
+	end = strchr(name, '"');
+	if (end == NULL)
+		return;
+
+	for (j = 0; j < 24; j++)
+		nulls[j] = true;
+
+	values[0] = entry[PG_LOG_COL_LOG_TIME];
+	nulls[0] = entry_nulls[PG_LOG_COL_LOG_TIME];
+	values[1] = CStringGetTextDatum(kind);
+	values[2] = BoolGetDatum(aggressive);
+	values[3] = BoolGetDatum(wraparound);
+	nulls[1] = nulls[2] = nulls[3] = false;
+
+	/* "db.schema.table": database is before first dot */
+	dot = memchr(name, '.', end - name);
+	if (dot != NULL)
+	{
+		values[4] = PointerGetDatum(cstring_to_text_with_len(name, dot - name));
+		values[5] = PointerGetDatum(cstring_to_text_with_len(dot + 1, end - dot - 1));
+		nulls[4] = nulls[5] = false;
+	}
+
+	if ((q = pg_log_event_find(end, "index scans: ")) != NULL && sscanf(q, "%d", &index_scans) == 1)
+	{
+		values[6] = Int32GetDatum(index_scans);
+		nulls[6] = false;
+	}
+	if ((q = pg_log_event_find(end, "pages: ")) != NULL && sscanf(q, "%lld removed, %lld remain", &l1, &l2) == 2)
+	{
+		pg_log_event_int8(values, nulls, 7, l1);
+		pg_log_event_int8(values, nulls, 8, l2);
+	}
+	if ((q = pg_log_event_find(end, "tuples: ")) != NULL && sscanf(q, "%lld removed, %lld remain", &l1, &l2) == 2)
+	{
+		pg_log_event_int8(values, nulls, 9, l1);
+		pg_log_event_int8(values, nulls, 10, l2);
+	}
+	if ((q = pg_log_event_find(end, "buffer usage: ")) != NULL &&
+	    sscanf(q, "%lld hits, %lld misses, %lld dirtied", &l1, &l2, &l3) == 3)
+	{
+		pg_log_event_int8(values, nulls, 11, l1);
+		pg_log_event_int8(values, nulls, 12, l2);
+		pg_log_event_int8(values, nulls, 13, l3);
+	}
+	if ((q = pg_log_event_find(end, "I/O timings: ")) != NULL && sscanf(q, "read: %lf ms, write: %lf ms", &d1, &d2) == 2)
+	{
+		pg_log_event_float8(values, nulls, 14, d1);
+		pg_log_event_float8(values, nulls, 15, d2);
+	}
+	if ((q = pg_log_event_find(end, "avg read rate: ")) != NULL &&
+	    sscanf(q, "%lf MB/s, avg write rate: %lf MB/s", &d1, &d2) == 2)
+	{
+		pg_log_event_float8(values, nulls, 16, d1);
+		pg_log_event_float8(values, nulls, 17, d2);
+	}
+	if ((q = pg_log_event_find(end, "WAL usage: ")) != NULL &&
+	    sscanf(q, "%lld records, %lld full page images, %lld bytes", &l1, &l2, &l3) == 3)
+	{
+		pg_log_event_int8(values, nulls, 18, l1);
+		pg_log_event_int8(values, nulls, 19, l2);
+		pg_log_event_int8(values, nulls, 20, l3);
+	}
+	if ((q = pg_log_event_find(end, "system usage: CPU: ")) != NULL &&
+	    sscanf(q, "user: %lf s, system: %lf s, elapsed: %lf s", &d1, &d2, &d3) == 3)
+	{
+		pg_log_event_float8(values, nulls, 21, d1);
+		pg_log_event_float8(values, nulls, 22, d2);
+		pg_log_event_float8(values, nulls, 23, d3);
+	}
+
+	pg_log_event_append(events, PG_LOG_EVENT_AUTOVACUUM, values, nulls);
+}
+
+/*
+ * lock mode and object of "<mode> on <object>" ending at end into 4
+ * columns from column: mode, object, database and relation oids
+ */
+static void pg_log_event_lock(const char *p, const char *end, Datum *values, bool *nulls, int column)
+{
+	const char	*on = strstr(p, " on ");
+	char		*object;
+	const char	*q;
+	unsigned int	oid;
+
+	if (on == NULL || on >= end)
+		return;
+	values[column] = PointerGetDatum(cstring_to_text_with_len(p, on - p));
+	nulls[column] = false;
+
+	/* relation 16384 of database 5, tuple (0,1) of relation ..., transaction 1234, ... */
+	object = pnstrdup(on + 4, end - on - 4);
+	values[column + 1] = CStringGetTextDatum(object);
+	nulls[column + 1] = false;
+	if ((q = pg_log_event_find(object, "of database ")) != NULL && sscanf(q, "%u", &oid) == 1)
+	{
+		values[column + 2] = ObjectIdGetDatum((Oid) oid);
+		nulls[column + 2] = false;
+	}
+	if ((q = pg_log_event_find(object, "relation ")) != NULL && sscanf(q, "%u", &oid) == 1)
+	{
+		values[column + 3] = ObjectIdGetDatum((Oid) oid);
+		nulls[column + 3] = false;
+	}
+	pfree(object);
+}
+
+static char *pg_log_event_part(const Datum *entry, const bool *entry_nulls, int tag)
+{
+	int	col = PG_LOG_COL_PART(tag);
+
+	return entry_nulls[col] ? NULL : text_to_cstring(DatumGetTextPP(entry[col]));
+}
+
+/*
+ * lock waits written with log_lock_waits:
+ *
+ *	process 1234 still waiting for ShareLock on transaction 5678 after
+ *	1000.123 ms
+ *	DETAIL:  Process holding the lock: 4321. Wait queue: 1234.
+ *
+ * and "acquired", "avoided deadlock for", "detected deadlock while
+ * waiting for" entries. A waiting entry also gives one edge per holder of
+ * the lock.
+ */
+static void pg_log_event_lock_wait(PgLogEvents *events, const Datum *entry, const bool *entry_nulls,
+				   const char *message)
+{
+	static const struct
+	{
+		const char	*prefix;
+		const char	*event;
+	} pg_log_lock_events[] = {
+		{"still waiting for ", "waiting"},
+		{"acquired ", "acquired"},
+		{"avoided deadlock for ", "avoided_deadlock"},
+		{"detected deadlock while waiting for ", "deadlock"},
+		{NULL, NULL}
+	};
+	Datum		values[10];
+	bool		nulls[10];
+	const char	*p;
+	const char	*end;
+	const char	*event = NULL;
+	char		*detail;
+	int		pid;
+	int		n;
+	int		j;
+	double		ms;
+
+	if (sscanf(message, "process %d %n", &pid, &n) != 1)
+		return;
+	p = message + n;
+	for (j = 0; pg_log_lock_events[j].prefix != NULL; j++)
+		if (strncmp(p, pg_log_lock_events[j].prefix, strlen(pg_log_lock_events[j].prefix)) == 0)
+		{
+			event = pg_log_lock_events[j].event;
+			p += strlen(pg_log_lock_events[j].prefix);
+			break;
+		}
+	if (event == NULL)
+		return;
+
+	for (j = 0; j < 10; j++)
+		nulls[j] = true;
+
+	values[0] = entry[PG_LOG_COL_LOG_TIME];
+	nulls[0] = entry_nulls[PG_LOG_COL_LOG_TIME];
+	values[1] = Int32GetDatum(pid);
+	values[2] = CStringGetTextDatum(event);
+	nulls[1] = nulls[2] = false;
+
+	end = strstr(p, " by rearranging queue order");
+	if (end == NULL)
+		end = strstr(p, " after ");
+	if (end != NULL)
+		pg_log_event_lock(p, end, values, nulls, 3);
+	if ((p = pg_log_event_find(p, " after ")) != NULL && sscanf(p, "%lf ms", &ms) == 1)
+		pg_log_event_float8(values, nulls, 7, ms);
+
+	/* Process(es) holding the lock: 4321, 4322. Wait queue: 1234. */
+	detail = pg_log_event_part(entry, entry_nulls, PG_LOG_TAG_DETAIL);
+	if (detail != NULL)
+	{
+		const char	*holders = pg_log_event_find(detail, "holding the lock: ");
+		const char	*queue = pg_log_event_find(detail, "Wait queue: ");
+
+		if (holders != NULL && (end = strchr(holders, '.')) != NULL)
+		{
+			values[8] = PointerGetDatum(cstring_to_text_with_len(holders, end - holders));
+			nulls[8] = false;
+		}
+		if (queue != NULL && (end = strchr(queue, '.')) != NULL)
+		{
+			values[9] = PointerGetDatum(cstring_to_text_with_len(queue, end - queue));
+			nulls[9] = false;
+		}
+
+		if (holders != NULL && strcmp(event, "waiting") == 0)
+		{
+			int		stmt_col = PG_LOG_COL_PART(PG_LOG_TAG_STATEMENT);
+			Datum		edge[10];
+			bool		edge_nulls[10];
+			int		blocker;
+
+			edge[0] = values[0];
+			edge_nulls[0] = nulls[0];
+			edge[1] = edge[3] = values[1];
+			edge_nulls[1] = edge_nulls[3] = false;
+			edge[2] = values[2];
+			edge_nulls[2] = false;
+			for (j = 0; j < 4; j++)
+			{
+				edge[5 + j] = values[3 + j];
+				edge_nulls[5 + j] = nulls[3 + j];
+			}
+			edge[9] = entry[stmt_col];
+			edge_nulls[9] = entry_nulls[stmt_col];
+
+			for (p = holders; sscanf(p, "%d%n", &blocker, &n) == 1; p += n)
+			{
+				edge[4] = Int32GetDatum(blocker);
+				edge_nulls[4] = false;
+				pg_log_event_append(events, PG_LOG_EVENT_LOCK_EDGES, edge, edge_nulls);
+				if (p[n] != ',')
+					break;
+				n++;
+			}
+		}
+	}
+
+	pg_log_event_append(events, PG_LOG_EVENT_LOCK_WAITS, values, nulls);
+}
+
+/*
+ * deadlock report, one edge per process of the cycle:
+ *
+ *	ERROR:  deadlock detected
+ *	DETAIL:  Process 1234 waits for ShareLock on transaction 5678; blocked
+ *	by process 4321.
+ *	Process 4321 waits for ShareLock on transaction 1234; blocked by
+ *	process 1234.
+ *	Process 1234: update t set ...
+ *	Process 4321: update t set ...
+ */
+static void pg_log_event_deadlock(PgLogEvents *events, const Datum *entry, const bool *entry_nulls)
+{
+	char		*detail = pg_log_event_part(entry, entry_nulls, PG_LOG_TAG_DETAIL);
+	const char	*p;
+	Datum		values[10];
+	bool		nulls[10];
+	int		j;
+
+	if (detail == NULL)
+		return;
+
+	for (p = detail; (p = strstr(p, "Process ")) != NULL; p++)
+	{
+		const char	*end;
+		const char	*blocked;
+		int		waiter;
+		int		blocker;
+		int		n;
+
+		n = 0;
+		if (sscanf(p, "Process %d waits for %n", &waiter, &n) != 1 || n == 0)
+			continue;
+		blocked = strstr(p + n, "; blocked by process ");
+		if (blocked == NULL || sscanf(blocked, "; blocked by process %d", &blocker) != 1)
+			continue;
+
+		for (j = 0; j < 10; j++)
+			nulls[j] = true;
+		values[0] = entry[PG_LOG_COL_LOG_TIME];
+		nulls[0] = entry_nulls[PG_LOG_COL_LOG_TIME];
+		values[1] = entry[PG_LOG_COL_PID];
+		nulls[1] = entry_nulls[PG_LOG_COL_PID];
+		values[2] = CStringGetTextDatum("deadlock");
+		values[3] = Int32GetDatum(waiter);
+		values[4] = Int32GetDatum(blocker);
+		nulls[2] = nulls[3] = nulls[4] = false;
+		pg_log_event_lock(p + n, blocked, values, nulls, 5);
+
+		/* statement of waiter is on its own "Process 1234: " line */
+		{
+			char		key[32];
+			const char	*statement;
+
+			snprintf(key, sizeof(key), "Process %d: ", waiter);
+			if ((statement = pg_log_event_find(detail, key)) != NULL)
+			{
+				end = strstr(statement, "\nProcess ");
+				if (end == NULL)
+					end = strstr(statement, "\n\tProcess ");
+				if (end == NULL)
+					end = statement + strlen(statement);
+				/* stderr continuation lines start with a tab */
+				while (end > statement && (end[-1] == '\t' || end[-1] == '\n'))
+					end--;
+				values[9] = PointerGetDatum(cstring_to_text_with_len(statement, end - statement));
+				nulls[9] = false;
+			}
+		}
+
+		pg_log_event_append(events, PG_LOG_EVENT_LOCK_EDGES, values, nulls);
+	}
+}
+
+/*
+ * temporary file written with log_temp_files, with fingerprint and text
+ * of its STATEMENT part:
+ *
+ *	temporary file: path "base/pgsql_tmp/pgsql_tmp1234.0", size 12345678
+ */
+static void pg_log_event_temp_file(PgLogEvents *events, const Datum *entry, const bool *entry_nulls,
+				   const char *message)
+{
+	int		stmt_col = PG_LOG_COL_PART(PG_LOG_TAG_STATEMENT);
+	Datum		values[6];
+	bool		nulls[6];
+	const char	*path = message + strlen("temporary file: path \"");
+	const char	*end = strrchr(path, '"');
+	long long	size;
+
+	if (end == NULL || sscanf(end, "\", size %lld", &size) != 1)
+		return;
+
+	values[0] = entry[PG_LOG_COL_LOG_TIME];
+	nulls[0] = entry_nulls[PG_LOG_COL_LOG_TIME];
+	values[1] = entry[PG_LOG_COL_PID];
+	nulls[1] = entry_nulls[PG_LOG_COL_PID];
+	values[2] = PointerGetDatum(cstring_to_text_with_len(path, end - path));
+	nulls[2] = false;
+	values[3] = Int64GetDatum((int64) size);
+	nulls[3] = false;
+	values[4] = entry[PG_LOG_COL_FINGERPRINT];
+	nulls[4] = entry_nulls[PG_LOG_COL_FINGERPRINT];
+	values[5] = entry[stmt_col];
+	nulls[5] = entry_nulls[stmt_col];
+
+	pg_log_event_append(events, PG_LOG_EVENT_TEMP_FILES, values, nulls);
+}
+
+/*
+ * value of key=value in message, empty if not found
+ */
+static void pg_log_event_keyword(const char *message, const char *key, char *value)
+{
+	const char	*p = pg_log_event_find(message, key);
+	int		len = 0;
+
+	if (p != NULL)
+	{
+		while (p[len] != '\0' && p[len] != ' ' && p[len] != '\n' && len < PG_LOG_SESSION_NAME_LEN - 1)
+			len++;
+		memcpy(value, p, len);
+	}
+	value[len] = '\0';
+}
+
+static void pg_log_event_name(Datum *values, bool *nulls, int column, const char *name)
+{
+	if (name[0] != '\0')
+	{
+		values[column] = CStringGetTextDatum(name);
+		nulls[column] = false;
+	}
+}
+
+/*
+ * connections and disconnections written with log_connections and
+ * log_disconnections, a session row is added at disconnection:
+ *
+ *	connection received: host=10.0.0.1 port=50412
+ *	connection authorized: user=alice database=app application_name=psql
+ *	disconnection: session time: 0:01:02.345 user=alice database=app
+ *	host=10.0.0.1 port=50412
+ */
+static void pg_log_event_session(PgLogEvents *events, const Datum *entry, const bool *entry_nulls,
+				 const char *message)
+{
+	Datum		values[9];
+	bool		nulls[9];
+	PgLogSession	session;
+	int		pid;
+	int		hours;
+	int		minutes;
+	double		seconds;
+	double		duration;
+	char		port[PG_LOG_SESSION_NAME_LEN];
+	int		j;
+
+	if (entry_nulls[PG_LOG_COL_PID])
+		return;
+	pid = DatumGetInt32(entry[PG_LOG_COL_PID]);
+
+	if (strncmp(message, "connection received: ", 21) == 0)
+	{
+		char	host[PG_LOG_SESSION_NAME_LEN];
+
+		pg_log_event_keyword(message, "host=", host);
+		pg_log_event_keyword(message, "port=", port);
+		pg_log_session_connect(pid, entry_nulls[PG_LOG_COL_LOG_TIME] ? 0 : DatumGetTimestampTz(entry[PG_LOG_COL_LOG_TIME]),
+				       host, atoi(port));
+		return;
+	}
+	if (strncmp(message, "connection authorized: ", 23) == 0)
+	{
+		char	user[PG_LOG_SESSION_NAME_LEN];
+		char	database[PG_LOG_SESSION_NAME_LEN];
+		char	application[PG_LOG_SESSION_NAME_LEN];
+
+		pg_log_event_keyword(message, "user=", user);
+		pg_log_event_keyword(message, "database=", database);
+		pg_log_event_keyword(message, "application_name=", application);
+		pg_log_session_authorize(pid, user, database, application);
+		return;
+	}
+	if (sscanf(message, "disconnection: session time: %d:%d:%lf", &hours, &minutes, &seconds) != 3)
+		return;
+	duration = hours * 3600.0 + minutes * 60.0 + seconds;
+
+	for (j = 0; j < 9; j++)
+		nulls[j] = true;
+
+	if (!pg_log_session_disconnect(pid, &session))
+	{
+		memset(&session, 0, sizeof(PgLogSession));
+		pg_log_event_keyword(message, "host=", session.client_host);
+		pg_log_event_keyword(message, "port=", port);
+		session.client_port = atoi(port);
+	}
+	/* disconnection has user and database even if authorization was not read */
+	pg_log_event_keyword(message, "user=", session.user_name);
+	pg_log_event_keyword(message, "database=", session.database_name);
+
+	if (!entry_nulls[PG_LOG_COL_LOG_TIME])
+	{
+		TimestampTz	disconnected_at = DatumGetTimestampTz(entry[PG_LOG_COL_LOG_TIME]);
+
+		values[1] = entry[PG_LOG_COL_LOG_TIME];
+		nulls[1] = false;
+		if (session.connected_at == 0)
+			session.connected_at = disconnected_at - (TimestampTz) (duration * USECS_PER_SEC);
+	}
+	if (session.connected_at != 0)
+	{
+		values[0] = TimestampTzGetDatum(session.connected_at);
+		nulls[0] = false;
+	}
+	pg_log_event_float8(values, nulls, 2, duration);
+	values[3] = Int32GetDatum(pid);
+	nulls[3] = false;
+	pg_log_event_name(values, nulls, 4, session.user_name);
+	pg_log_event_name(values, nulls, 5, session.database_name);
+	pg_log_event_name(values, nulls, 6, session.application_name);
+	pg_log_event_name(values, nulls, 7, session.client_host);
+	if (session.client_port != 0)
+	{
+		values[8] = Int32GetDatum(session.client_port);
+		nulls[8] = false;
+	}
+
+	pg_log_event_append(events, PG_LOG_EVENT_SESSIONS, values, nulls);
+}
+
+/*
+ * add rows of event tables for log entry columns
+ */
+void pg_log_events_add(PgLogEvents *events, const Datum *values, const bool *nulls)
+{
+	text		*message;
+	const char	*p;
+	int		len;
+
+	if (events->context == NULL || nulls[PG_LOG_COL_MESSAGE])
+		return;
+
+	message = DatumGetTextPP(values[PG_LOG_COL_MESSAGE]);
+	p = VARDATA_ANY(message);
+	len = VARSIZE_ANY_EXHDR(message);
+
+	if (pg_log_event_prefix(p, len, "checkpoint "))
+		pg_log_event_checkpoint(events, "checkpoint", values, nulls, text_to_cstring(message));
+	else if (pg_log_event_prefix(p, len, "restartpoint "))
+		pg_log_event_checkpoint(events, "restartpoint", values, nulls, text_to_cstring(message));
+	else if (pg_log_event_prefix(p, len, "automatic "))
+		pg_log_event_autovacuum(events, values, nulls, text_to_cstring(message));
+	else if (pg_log_event_prefix(p, len, "process "))
+		pg_log_event_lock_wait(events, values, nulls, text_to_cstring(message));
+	else if (pg_log_event_prefix(p, len, "deadlock detected"))
+		pg_log_event_deadlock(events, values, nulls);
+	else if (pg_log_event_prefix(p, len, "temporary file: path \""))
+		pg_log_event_temp_file(events, values, nulls, text_to_cstring(message));
+	else if (pg_log_event_prefix(p, len, "connection ") || pg_log_event_prefix(p, len, "disconnection: "))
+		pg_log_event_session(events, values, nulls, text_to_cstring(message));
+}
+
+/*
+ * insert into event table, or update of its aggregate table from
+ *	with e(columns) as (select * from unnest($1, ...)) aggregate
+ */
+static SPIPlanPtr pg_log_event_prepare(int table, bool aggregate)
+{
+	const PgLogEventTableDesc *desc = &pg_log_event_tables[table];
+	Oid		argtypes[PG_LOG_EVENT_MAX_COLUMNS];
+	StringInfoData	buf;
+	SPIPlanPtr	plan;
+	int		j;
+
+	initStringInfo(&buf);
+	appendStringInfoString(&buf, aggregate ? "with e(" : "insert into ");
+	if (!aggregate)
+		appendStringInfo(&buf, "%s(", desc->table);
+	for (j = 0; j < desc->ncolumns; j++)
+	{
+		appendStringInfo(&buf, "%s%s", j > 0 ? ", " : "", desc->columns[j]);
+		argtypes[j] = get_array_type(desc->types[j]);
+	}
+	appendStringInfoString(&buf, aggregate ? ") as (select * from unnest(" : ") select * from unnest(");
+	for (j = 0; j < desc->ncolumns; j++)
+		appendStringInfo(&buf, "%s$%d", j > 0 ? ", " : "", j + 1);
+	appendStringInfoChar(&buf, ')');
+	if (aggregate)
+		appendStringInfo(&buf, ") %s", desc->aggregate);
+
+	plan = SPI_prepare(buf.data, desc->ncolumns, argtypes);
+	if (plan == NULL)
+		elog(ERROR, "pg_log: SPI_prepare failed for %s of %s", aggregate ? "aggregate" : "INSERT INTO", desc->table);
+	pfree(buf.data);
+
+	return plan;
+}
+
+/*
+ * insert event rows of batch, called before batch memory is reset
+ */
+void pg_log_events_flush(PgLogEvents *events)
+{
+	int	i;
+	int	j;
+
+	if (events->context == NULL)
+		return;
+
+	for (i = 0; i < PG_LOG_NEVENT_TABLES; i++)
+	{
+		const PgLogEventTableDesc *desc = &pg_log_event_tables[i];
+		PgLogEventRows	*rows = &events->tables[i];
+		Datum		arrays[PG_LOG_EVENT_MAX_COLUMNS];
+		int		dims[1];
+		int		lbs[1];
+		int		ret_code;
+
+		if (rows->nrows == 0)
+			continue;
+
+		if (rows->plan == NULL)
+			rows->plan = pg_log_event_prepare(i, false);
+		if (rows->aggregate_plan == NULL && desc->aggregate != NULL)
+			rows->aggregate_plan = pg_log_event_prepare(i, true);
+
+		dims[0] = rows->nrows;
+		lbs[0] = 1;
+		for (j = 0; j < desc->ncolumns; j++)
+		{
+			int16	typlen;
+			bool	typbyval;
+			char	typalign;
+
+			get_typlenbyvalalign(desc->types[j], &typlen, &typbyval, &typalign);
+			arrays[j] = PointerGetDatum(construct_md_array(rows->values[j], rows->nulls[j], 1, dims, lbs,
+								       desc->types[j], typlen, typbyval, typalign));
+		}
+
+		ret_code = SPI_execute_plan(rows->plan, arrays, NULL, false, 0);
+		if (ret_code != SPI_OK_INSERT)
+			elog(ERROR, "pg_log: INSERT INTO %s failed: %d", desc->table, ret_code);
+		if (rows->aggregate_plan != NULL)
+		{
+			ret_code = SPI_execute_plan(rows->aggregate_plan, arrays, NULL, false, 0);
+			if (ret_code != SPI_OK_INSERT)
+				elog(ERROR, "pg_log: aggregate of %s failed: %d", desc->table, ret_code);
+		}
+		elog(DEBUG1, "pg_log: inserted %d rows into %s", rows->nrows, desc->table);
+		rows->nrows = 0;
+	}
+}
+
+void pg_log_events_end(PgLogEvents *events)
+{
+	int	i;
+
+	if (events->context == NULL)
+		return;
+
+	for (i = 0; i < PG_LOG_NEVENT_TABLES; i++)
+	{
+		if (events->tables[i].plan != NULL)
+			SPI_freeplan(events->tables[i].plan);
+		if (events->tables[i].aggregate_plan != NULL)
+			SPI_freeplan(events->tables[i].aggregate_plan);
+	}
+	MemoryContextDelete(events->context);
+	events->context = NULL;
+}
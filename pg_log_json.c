@@ -0,0 +1,281 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_log_json.c
+ *	  jsonlog record parser.
+ *
+ * jsonlog (PG 15+) writes one flat JSON object per line. Values are copied
+ * into pglog columns without building a jsonb value:
+ *
+ * 1. the line is classified by 64 byte blocks into masks of quotes,
+ *    backslashes and ':' ',' '}' characters. Quotes escaped by an odd
+ *    number of backslashes are removed, strings are given by the prefix xor
+ *    of the remaining quotes, and the structural index lists the position
+ *    of each quote and of each ':' ',' '}' outside strings.
+ *
+ * 2. the index is walked as "key" : value pairs: values of known keys go to
+ *    their column, other keys are skipped without looking at their value.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (c) 2022, Pierre Forstmann.
+ *
+ *-------------------------------------------------------------------------
+*/
+#include "postgres.h"
+
+#include "catalog/pg_type.h"
+#include "lib/stringinfo.h"
+#include "utils/builtins.h"
+
+#include <ctype.h>
+
+#include "pg_log.h"
+
+/*
+ * jsonlog keys kept, LOCATION is built from three keys like in stderr
+ * format
+ */
+#define PG_LOG_JSON_FUNC_NAME	-2
+#define PG_LOG_JSON_FILE_NAME	-3
+#define PG_LOG_JSON_FILE_LINE	-4
+
+typedef struct
+{
+	const char	*key;
+	int		column;
+} PgLogJsonKey;
+
+static const PgLogJsonKey pg_log_json_keys[] = {
+	{"timestamp", PG_LOG_COL_LOG_TIME},
+	{"user", PG_LOG_COL_USER},
+	{"dbname", PG_LOG_COL_DATABASE},
+	{"pid", PG_LOG_COL_PID},
+	{"error_severity", PG_LOG_COL_SEVERITY},
+	{"state_code", PG_LOG_COL_SQLSTATE},
+	{"message", PG_LOG_COL_MESSAGE},
+	{"detail", PG_LOG_COL_PART(PG_LOG_TAG_DETAIL)},
+	{"hint", PG_LOG_COL_PART(PG_LOG_TAG_HINT)},
+	{"internal_query", PG_LOG_COL_PART(PG_LOG_TAG_QUERY)},
+	{"context", PG_LOG_COL_PART(PG_LOG_TAG_CONTEXT)},
+	{"statement", PG_LOG_COL_PART(PG_LOG_TAG_STATEMENT)},
+	{"application_name", PG_LOG_COL_APPLICATION},
+	{"remote_host", PG_LOG_COL_CLIENT_HOST},
+	{"query_id", PG_LOG_COL_QUERY_ID},
+	{"func_name", PG_LOG_JSON_FUNC_NAME},
+	{"file_name", PG_LOG_JSON_FILE_NAME},
+	{"file_line_num", PG_LOG_JSON_FILE_LINE},
+	{NULL, 0}
+};
+
+/*
+ * stage 1: structural index of line, return number of positions
+ */
+static int pg_log_json_index(const char *data, int len, int *index)
+{
+	static const char chars[5] = { '"', '\\', ':', ',', '}' };
+	uint64		instring = 0;
+	uint64		escape_next = 0;
+	int		n = 0;
+	int		pos;
+
+	for (pos = 0; pos < len; pos += PG_LOG_BLOCK)
+	{
+		uint64	masks[5];
+		uint64	backslashes;
+		uint64	escaped = escape_next;
+		uint64	quotes;
+		uint64	inside;
+		uint64	structural;
+
+		pg_log_block_masks(data + pos, Min(PG_LOG_BLOCK, len - pos), chars, 5, masks);
+
+		/* a backslash escapes next byte unless it is escaped itself */
+		escape_next = 0;
+		backslashes = masks[1] & ~escaped;
+		while (backslashes != 0)
+		{
+			int	bit = pg_log_rightmost_one64(backslashes);
+
+			if (bit == 63)
+				escape_next = 1;
+			else
+			{
+				escaped |= UINT64CONST(1) << (bit + 1);
+				backslashes &= ~(UINT64CONST(1) << (bit + 1));
+			}
+			backslashes &= backslashes - 1;
+		}
+
+		quotes = masks[0] & ~escaped;
+		inside = pg_log_prefix_xor(quotes) ^ instring;
+		instring = (uint64) 0 - (inside >> 63);
+
+		structural = quotes | ((masks[2] | masks[3] | masks[4]) & ~inside);
+		while (structural != 0)
+		{
+			index[n++] = pos + pg_log_rightmost_one64(structural);
+			structural &= structural - 1;
+		}
+	}
+
+	return n;
+}
+
+/*
+ * text of JSON string contents with escapes decoded
+ *
+ * jsonlog only escapes control characters with \u, other \u escapes are
+ * kept as is.
+ */
+text *pg_log_json_text(const char *p, int len)
+{
+	text		*result;
+	char		*dst;
+	const char	*end = p + len;
+
+	if (memchr(p, '\\', len) == NULL)
+		return cstring_to_text_with_len(p, len);
+
+	result = (text *) palloc(len + VARHDRSZ);
+	dst = VARDATA(result);
+	while (p < end)
+	{
+		if (*p != '\\' || p + 1 == end)
+		{
+			*dst++ = *p++;
+			continue;
+		}
+		p++;
+		switch (*p)
+		{
+			case 'b': *dst++ = '\b'; break;
+			case 'f': *dst++ = '\f'; break;
+			case 'n': *dst++ = '\n'; break;
+			case 'r': *dst++ = '\r'; break;
+			case 't': *dst++ = '\t'; break;
+			case 'u':
+				if (end - p >= 5 && p[1] == '0' && p[2] == '0' && isxdigit((unsigned char) p[3]) &&
+				    isxdigit((unsigned char) p[4]) && (p[3] != '0' || p[4] != '0'))
+				{
+					char	hex[3] = { p[3], p[4], '\0' };
+
+					*dst++ = (char) strtol(hex, NULL, 16);
+					p += 4;
+				}
+				else
+				{
+					*dst++ = '\\';
+					*dst++ = 'u';
+				}
+				break;
+			default:
+				*dst++ = *p;
+				break;
+		}
+		p++;
+	}
+	SET_VARSIZE(result, dst - VARDATA(result) + VARHDRSZ);
+
+	return result;
+}
+
+static int pg_log_json_column(const char *key, int len)
+{
+	int	i;
+
+	for (i = 0; pg_log_json_keys[i].key != NULL; i++)
+		if (strlen(pg_log_json_keys[i].key) == len && memcmp(pg_log_json_keys[i].key, key, len) == 0)
+			return pg_log_json_keys[i].column;
+	return -1;
+}
+
+/*
+ * Datums of pglog columns from jsonlog record
+ */
+void pg_log_json_record_values(const PgLogLine *line, Datum *values, bool *nulls)
+{
+	const char	*data = line->data;
+	int		*index = palloc(sizeof(int) * (line->len + 1));
+	int		n = pg_log_json_index(data, line->len, index);
+	PgLogSlice	location[3];
+	int		i = 0;
+	int		j;
+
+	for (j = 0; j < PG_LOG_NCOLUMNS; j++)
+		nulls[j] = true;
+	memset(location, 0, sizeof(location));
+
+	/* stage 2: "key" : value , ... } */
+	while (i + 3 < n)
+	{
+		PgLogSlice	value;
+		bool		quoted;
+		int		column;
+
+		if (data[index[i]] != '"' || data[index[i + 2]] != ':')
+			break;
+		column = pg_log_json_column(data + index[i] + 1, index[i + 1] - index[i] - 1);
+		i += 3;
+
+		quoted = data[index[i]] == '"';
+		if (quoted)
+		{
+			if (i + 2 >= n)
+				break;
+			value.data = data + index[i] + 1;
+			value.len = index[i + 1] - index[i] - 1;
+			i += 2;
+		}
+		else
+		{
+			/* number, true, false or null */
+			value.data = data + index[i - 1] + 1;
+			value.len = index[i] - index[i - 1] - 1;
+			while (value.len > 0 && *value.data == ' ')
+			{
+				value.data++;
+				value.len--;
+			}
+		}
+		/* ',' or '}' */
+		i++;
+
+		if (column == -1 || (!quoted && value.len == 4 && memcmp(value.data, "null", 4) == 0))
+			continue;
+
+		if (column < -1)
+		{
+			location[PG_LOG_JSON_FUNC_NAME - column] = value;
+			continue;
+		}
+
+		if (pg_log_columns[column].type != TEXTOID)
+			values[column] = pg_log_field_value('m', pg_log_columns[column].field, &value, &nulls[column]);
+		else
+		{
+			values[column] = PointerGetDatum(pg_log_json_text(value.data, value.len));
+			nulls[column] = false;
+		}
+	}
+
+	/* "func, file:line" */
+	if (location[0].data != NULL || location[1].data != NULL)
+	{
+		StringInfoData	buf;
+
+		initStringInfo(&buf);
+		if (location[0].data != NULL)
+			appendStringInfo(&buf, "%.*s, ", location[0].len, location[0].data);
+		if (location[1].data != NULL)
+			appendStringInfo(&buf, "%.*s:%.*s", location[1].len, location[1].data, location[2].len,
+					 location[2].data != NULL ? location[2].data : "");
+		values[PG_LOG_COL_PART(PG_LOG_TAG_LOCATION)] = PointerGetDatum(cstring_to_text_with_len(buf.data, buf.len));
+		nulls[PG_LOG_COL_PART(PG_LOG_TAG_LOCATION)] = false;
+		pfree(buf.data);
+	}
+
+	pg_log_fingerprint_values(values, nulls);
+	pg_log_duration_values(values, nulls);
+	pfree(index);
+}
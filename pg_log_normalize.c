@@ -0,0 +1,365 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_log_normalize.c
+ *	  normalized statement text and fingerprint.
+ *
+ * Statements of log entries differ by their constants: they are grouped
+ * by the 64 bit hash of their normalized text, where
+ *
+ * - string, numeric and bit string constants, dollar quoted strings and
+ *   $n parameters are replaced with ?,
+ * - lists of constants following IN or ARRAY are collapsed to (?) or [?],
+ * - comments are removed, keywords and identifiers not double quoted are
+ *   lower case and tokens are separated by a single space, except after
+ *   ( [ . :: and before ) [ ] , ; . :: and before ( following a keyword or
+ *   identifier, whatever the spaces of the statement are.
+ *
+ * Text is normalized in one pass by a small lexer which does not allocate
+ * memory: output is written into a buffer given by the caller.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (c) 2022, Pierre Forstmann.
+ *
+ *-------------------------------------------------------------------------
+*/
+#include "postgres.h"
+
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+
+#include "pg_log.h"
+
+/* maximum nesting of parentheses and brackets followed for lists */
+#define PG_LOG_NORMALIZE_DEPTH	32
+
+typedef enum
+{
+	PG_LOG_TOKEN_WORD,
+	PG_LOG_TOKEN_CONST,
+	PG_LOG_TOKEN_OPEN,
+	PG_LOG_TOKEN_CLOSE,
+	PG_LOG_TOKEN_OTHER
+} PgLogToken;
+
+typedef struct
+{
+	/* output position of ( or [ */
+	int		open;
+	/* list only has constants and commas so far */
+	bool		constants;
+} PgLogList;
+
+/* normalization buffer of pg_log_fingerprint() */
+static char *normalize_buf = NULL;
+static int normalize_size = 0;
+
+static inline bool pg_log_ident_start(unsigned char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || IS_HIGHBIT_SET(c);
+}
+
+static inline bool pg_log_ident_char(unsigned char c)
+{
+	return pg_log_ident_start(c) || (c >= '0' && c <= '9') || c == '$';
+}
+
+static inline bool pg_log_op_char(unsigned char c)
+{
+	return strchr("+-*/<>=~!@#%^&|`?", c) != NULL && c != '\0';
+}
+
+/*
+ * end of quoted string starting at src[i], with '' escapes and backslash
+ * escapes if backslash is true
+ */
+static int pg_log_skip_quoted(const char *src, int len, int i, char quote, bool backslash)
+{
+	for (i++; i < len; i++)
+	{
+		if (backslash && src[i] == '\\')
+			i++;
+		else if (src[i] == quote)
+		{
+			if (i + 1 < len && src[i + 1] == quote)
+				i++;
+			else
+				return i + 1;
+		}
+	}
+	return len;
+}
+
+/*
+ * end of dollar quoted string starting at src[i], i if src[i] does not
+ * start a dollar quote
+ */
+static int pg_log_skip_dollar_quoted(const char *src, int len, int i)
+{
+	int	tag_len;
+	int	j;
+
+	for (j = i + 1; j < len && pg_log_ident_char((unsigned char) src[j]) && src[j] != '$'; j++)
+		;
+	if (j >= len || src[j] != '$' || (j > i + 1 && src[i + 1] >= '0' && src[i + 1] <= '9'))
+		return i;
+	tag_len = j + 1 - i;
+
+	for (j = j + 1; j + tag_len <= len; j++)
+		if (src[j] == '$' && memcmp(src + j, src + i, tag_len) == 0)
+			return j + tag_len;
+	return len;
+}
+
+/*
+ * write normalized statement into dst, which must have room for 2 * len + 1
+ * bytes, and return its length
+ */
+int pg_log_normalize(const char *src, int len, char *dst)
+{
+	PgLogList	lists[PG_LOG_NORMALIZE_DEPTH];
+	int		depth = 0;
+	int		n = 0;
+	int		i = 0;
+	/* previous token was IN or ARRAY */
+	bool		list_keyword = false;
+	bool		no_space_after = true;
+	/* previous token was a keyword or identifier */
+	bool		after_word = false;
+
+	while (i < len)
+	{
+		unsigned char	c = src[i];
+		int		start;
+		int		end;
+		PgLogToken	token;
+		bool		no_space_before = false;
+		bool		is_list_keyword = false;
+
+		/* white space and comments */
+		if (c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v')
+		{
+			i++;
+			continue;
+		}
+		if (c == '-' && i + 1 < len && src[i + 1] == '-')
+		{
+			while (i < len && src[i] != '\n')
+				i++;
+			continue;
+		}
+		if (c == '/' && i + 1 < len && src[i + 1] == '*')
+		{
+			int	nesting = 1;
+
+			for (i += 2; i < len && nesting > 0; i++)
+			{
+				if (src[i] == '*' && i + 1 < len && src[i + 1] == '/')
+				{
+					nesting--;
+					i++;
+				}
+				else if (src[i] == '/' && i + 1 < len && src[i + 1] == '*')
+				{
+					nesting++;
+					i++;
+				}
+			}
+			continue;
+		}
+
+		/* separator, written before token */
+		if (c == ')' || c == ']' || c == '[' || c == ',' || c == ';' || c == '.' ||
+		    (c == ':' && i + 1 < len && src[i + 1] == ':') || (c == '(' && after_word))
+			no_space_before = true;
+		if (n > 0 && !no_space_after && !no_space_before)
+			dst[n++] = ' ';
+		start = n;
+
+		if (c == '\'' ||
+		    ((c == 'e' || c == 'E' || c == 'b' || c == 'B' || c == 'x' || c == 'X' || c == 'n' || c == 'N') &&
+		     i + 1 < len && src[i + 1] == '\''))
+		{
+			/* string or bit string constant */
+			bool	backslash = (c == 'e' || c == 'E');
+
+			if (c != '\'')
+				i++;
+			i = pg_log_skip_quoted(src, len, i, '\'', backslash);
+			dst[n++] = '?';
+			token = PG_LOG_TOKEN_CONST;
+		}
+		else if (c == '"')
+		{
+			/* quoted identifier is kept as is */
+			end = pg_log_skip_quoted(src, len, i, '"', false);
+			memcpy(dst + n, src + i, end - i);
+			n += end - i;
+			i = end;
+			token = PG_LOG_TOKEN_WORD;
+		}
+		else if (c == '$' && i + 1 < len && src[i + 1] >= '0' && src[i + 1] <= '9')
+		{
+			/* parameter */
+			for (i++; i < len && src[i] >= '0' && src[i] <= '9'; i++)
+				;
+			dst[n++] = '?';
+			token = PG_LOG_TOKEN_CONST;
+		}
+		else if (c == '$' && (end = pg_log_skip_dollar_quoted(src, len, i)) > i)
+		{
+			i = end;
+			dst[n++] = '?';
+			token = PG_LOG_TOKEN_CONST;
+		}
+		else if ((c >= '0' && c <= '9') || (c == '.' && i + 1 < len && src[i + 1] >= '0' && src[i + 1] <= '9'))
+		{
+			/* number, with exponent, or hexadecimal, octal, binary */
+			for (i++; i < len; i++)
+			{
+				if ((src[i] == '+' || src[i] == '-') && (src[i - 1] == 'e' || src[i - 1] == 'E'))
+					continue;
+				if (!pg_log_ident_char((unsigned char) src[i]) && src[i] != '.')
+					break;
+			}
+			dst[n++] = '?';
+			token = PG_LOG_TOKEN_CONST;
+		}
+		else if (pg_log_ident_start(c))
+		{
+			/* keyword or identifier */
+			for (; i < len && pg_log_ident_char((unsigned char) src[i]); i++)
+				dst[n++] = (src[i] >= 'A' && src[i] <= 'Z') ? src[i] + ('a' - 'A') : src[i];
+			is_list_keyword = (n - start == 2 && memcmp(dst + start, "in", 2) == 0) ||
+					  (n - start == 5 && memcmp(dst + start, "array", 5) == 0);
+			token = PG_LOG_TOKEN_WORD;
+		}
+		else if (c == '(' || c == '[')
+		{
+			if (depth > 0 && depth <= PG_LOG_NORMALIZE_DEPTH)
+				lists[depth - 1].constants = false;
+			if (depth < PG_LOG_NORMALIZE_DEPTH)
+			{
+				lists[depth].open = n;
+				lists[depth].constants = list_keyword;
+			}
+			depth++;
+			dst[n++] = c;
+			i++;
+			token = PG_LOG_TOKEN_OPEN;
+		}
+		else if (c == ')' || c == ']')
+		{
+			if (depth > 0 && --depth < PG_LOG_NORMALIZE_DEPTH && lists[depth].constants &&
+			    n > lists[depth].open + 1)
+			{
+				/* list of constants */
+				n = lists[depth].open + 1;
+				dst[n++] = '?';
+			}
+			dst[n++] = c;
+			i++;
+			token = PG_LOG_TOKEN_CLOSE;
+		}
+		else if (c == ':' && i + 1 < len && src[i + 1] == ':')
+		{
+			dst[n++] = ':';
+			dst[n++] = ':';
+			i += 2;
+			token = PG_LOG_TOKEN_OTHER;
+		}
+		else if (pg_log_op_char(c))
+		{
+			for (; i < len && pg_log_op_char((unsigned char) src[i]); i++)
+				dst[n++] = src[i];
+			token = PG_LOG_TOKEN_OTHER;
+		}
+		else
+		{
+			/* , ; . and other characters */
+			dst[n++] = c;
+			i++;
+			token = PG_LOG_TOKEN_OTHER;
+		}
+
+		if (depth > 0 && depth <= PG_LOG_NORMALIZE_DEPTH && token != PG_LOG_TOKEN_OPEN &&
+		    token != PG_LOG_TOKEN_CONST && !(token == PG_LOG_TOKEN_OTHER && c == ','))
+			lists[depth - 1].constants = false;
+
+		no_space_after = (token == PG_LOG_TOKEN_OPEN || c == '.' || (token == PG_LOG_TOKEN_OTHER && c == ':'));
+		list_keyword = is_list_keyword;
+		after_word = (token == PG_LOG_TOKEN_WORD);
+	}
+
+	dst[n] = '\0';
+
+	return n;
+}
+
+/*
+ * fingerprint of statement: hash of its normalized text
+ */
+uint64 pg_log_fingerprint(const char *statement, int len)
+{
+	int	n;
+
+	if (normalize_size < 2 * len + 1)
+	{
+		if (normalize_buf != NULL)
+			pfree(normalize_buf);
+		normalize_size = Max(2 * len + 1, 1024);
+		normalize_buf = MemoryContextAlloc(TopMemoryContext, normalize_size);
+	}
+
+	n = pg_log_normalize(statement, len, normalize_buf);
+
+	return pg_log_hash64(normalize_buf, n);
+}
+
+/*
+ * fingerprint column of log entry: normalized STATEMENT part, or statement
+ * of a "duration:" entry, or query text of an auto_explain plan
+ */
+void pg_log_fingerprint_values(Datum *values, bool *nulls)
+{
+	int	col = PG_LOG_COL_PART(PG_LOG_TAG_STATEMENT);
+
+	nulls[PG_LOG_COL_FINGERPRINT] = true;
+	if (!nulls[col])
+	{
+		text	*statement = DatumGetTextPP(values[col]);
+
+		values[PG_LOG_COL_FINGERPRINT] = Int64GetDatum((int64) pg_log_fingerprint(VARDATA_ANY(statement),
+											   VARSIZE_ANY_EXHDR(statement)));
+		nulls[PG_LOG_COL_FINGERPRINT] = false;
+	}
+	else if (!nulls[PG_LOG_COL_MESSAGE])
+	{
+		text		*message = DatumGetTextPP(values[PG_LOG_COL_MESSAGE]);
+		double		ms;
+		const char	*kind;
+		int		kind_len;
+		const char	*statement;
+		int		statement_len;
+
+		if (!pg_log_parse_duration(VARDATA_ANY(message), VARSIZE_ANY_EXHDR(message), &ms, &kind, &kind_len,
+					   &statement, &statement_len))
+			return;
+
+		if (kind_len == 4 && memcmp(kind, "plan", 4) == 0)
+		{
+			/* auto_explain plan */
+			text	*query = pg_log_plan_query_text(statement, statement_len);
+
+			if (query == NULL)
+				return;
+			values[PG_LOG_COL_FINGERPRINT] = Int64GetDatum((int64) pg_log_fingerprint(VARDATA_ANY(query),
+												   VARSIZE_ANY_EXHDR(query)));
+			pfree(query);
+		}
+		else
+			values[PG_LOG_COL_FINGERPRINT] = Int64GetDatum((int64) pg_log_fingerprint(statement, statement_len));
+		nulls[PG_LOG_COL_FINGERPRINT] = false;
+	}
+}
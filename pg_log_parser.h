@@ -0,0 +1,77 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_log_parser.h
+ *	  Interface of pg_log parser plugins.
+ *
+ * A parser plugin is a shared library exporting an initialization function,
+ * by default pg_log_parser_init, that returns a PgLogParser. A log source
+ * uses it when the parser column of pg_log_sources is set to the library
+ * name, or to "library:function".
+ *
+ * The parser is called once for a batch of lines: it receives slices of the
+ * read buffer, which are not null-terminated and only valid during the call,
+ * and fills the output arrays column by column. Pass-by-reference values
+ * must be allocated in CurrentMemoryContext, which is reset after each batch.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PG_LOG_PARSER_H
+#define PG_LOG_PARSER_H
+
+#define PG_LOG_PARSER_ABI_VERSION	1
+#define PG_LOG_PARSER_INIT_FUNCTION	"pg_log_parser_init"
+
+/*
+ * log line: data is not null-terminated and has no trailing newline
+ */
+typedef struct PgLogLine
+{
+	const char	*data;
+	int		len;
+	/* line number in log file, starting at 1 */
+	int64		lineno;
+} PgLogLine;
+
+/*
+ * column of target table filled by the parser
+ */
+typedef struct PgLogParserColumn
+{
+	const char	*name;
+	Oid		type;
+} PgLogParserColumn;
+
+/*
+ * output of one batch: values[column][row] and nulls[column][row], nulls
+ * are initialized to false
+ */
+typedef struct PgLogParserOutput
+{
+	int		ncolumns;
+	/* maximum number of rows */
+	int		capacity;
+	Datum		**values;
+	bool		**nulls;
+} PgLogParserOutput;
+
+typedef struct PgLogParser
+{
+	/* must be PG_LOG_PARSER_ABI_VERSION */
+	int		abi_version;
+	const char	*name;
+	int		ncolumns;
+	const PgLogParserColumn *columns;
+
+	/*
+	 * parse nlines lines, return number of rows filled in output which
+	 * must not exceed output capacity
+	 */
+	int		(*parse_batch) (const PgLogLine *lines, int nlines, PgLogParserOutput *output);
+} PgLogParser;
+
+typedef const PgLogParser *(*pg_log_parser_init_function) (void);
+
+#endif							/* PG_LOG_PARSER_H */
@@ -0,0 +1,574 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_log_pipeline.c
+ *	  log file reading pipeline: scan -> split -> verify -> filter -> parse
+ *	  -> sink.
+ *
+ * Stages pass batches of up to PG_LOG_BATCH_SIZE line descriptors which
+ * point into the scan buffer. The sink pulls batches with
+ * pg_log_pipeline_next(): a batch stays valid until the next call, so the
+ * scan stage only reuses its buffer once all lines of the buffer have been
+ * consumed. This is the back-pressure between the stages.
+ *
+ * Lines are never copied by the pipeline and have no maximum length: the
+ * scan buffer grows when a line does not fit in it.
+ *
+ * Log files are written by backends of all databases and by clients: they
+ * can contain byte sequences which are not valid in the database encoding.
+ * The verify stage checks each batch as a whole and replaces invalid bytes
+ * with '?' in the scan buffer, so that line lengths do not change.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (c) 2022, Pierre Forstmann.
+ *
+ *-------------------------------------------------------------------------
+*/
+#include "postgres.h"
+
+#include "catalog/pg_type.h"
+#include "mb/pg_wchar.h"
+#include "storage/fd.h"
+#include "utils/builtins.h"
+
+#include "pg_log.h"
+
+static void pg_log_split(PgLogPipeline *pipeline, PgLogBatch *batch);
+static void pg_log_split_records(PgLogPipeline *pipeline, PgLogBatch *batch);
+static void pg_log_split_csv(PgLogPipeline *pipeline, PgLogBatch *batch);
+
+/*
+ * open file and position pipeline at offset
+ *
+ * lineno is the number of the line before offset. Return NULL if file
+ * cannot be read.
+ */
+PgLogPipeline *pg_log_pipeline_begin(const char *file, int64 offset, int64 lineno, int flags)
+{
+	PgLogPipeline	*pipeline;
+	FILE		*fp;
+
+	fp = AllocateFile(file, PG_BINARY_R);
+	if (fp == NULL)
+	{
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("pg_log: could not open file \"%s\": %m", file)));
+		return NULL;
+	}
+	if (fseeko(fp, (off_t) offset, SEEK_SET) != 0)
+	{
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("pg_log: could not seek in file \"%s\": %m", file)));
+		FreeFile(fp);
+		return NULL;
+	}
+
+	pipeline = palloc0(sizeof(PgLogPipeline));
+	pipeline->flags = flags;
+	if (flags & PG_LOG_PIPELINE_GROUP)
+		pipeline->split = pg_log_split_records;
+	else if (flags & PG_LOG_PIPELINE_CSV)
+		pipeline->split = pg_log_split_csv;
+	else
+		pipeline->split = pg_log_split;
+	pipeline->file = pstrdup(file);
+	pipeline->fp = fp;
+	pipeline->size = PG_LOG_READ_CHUNK;
+	pipeline->buf = palloc(pipeline->size);
+	pipeline->offset = offset;
+	pipeline->lineno = lineno;
+	pipeline->encoding = GetDatabaseEncoding();
+	if (flags & (PG_LOG_PIPELINE_PARSE_PREFIX | PG_LOG_PIPELINE_GROUP))
+		pipeline->prefix = pg_log_get_prefix();
+
+	return pipeline;
+}
+
+/*
+ * scan stage: read next chunk after the bytes not consumed by split stage
+ *
+ * Return false at end of file.
+ */
+static bool pg_log_scan(PgLogPipeline *pipeline)
+{
+	size_t	n;
+
+	/* keep incomplete line */
+	pipeline->used -= pipeline->pos;
+	if (pipeline->used > 0)
+		memmove(pipeline->buf, pipeline->buf + pipeline->pos, pipeline->used);
+	pipeline->pos = 0;
+	/* match slices pointed into moved data */
+	pipeline->record_matched = false;
+
+	/* line longer than buffer */
+	if (pipeline->used == pipeline->size)
+	{
+		pipeline->size *= 2;
+		pipeline->buf = repalloc(pipeline->buf, pipeline->size);
+	}
+
+	n = fread(pipeline->buf + pipeline->used, 1, pipeline->size - pipeline->used, pipeline->fp);
+	if (n == 0)
+	{
+		if (ferror(pipeline->fp))
+			ereport(WARNING,
+					(errcode_for_file_access(),
+					 errmsg("pg_log: could not read file \"%s\": %m", pipeline->file)));
+		return false;
+	}
+	pipeline->used += n;
+	pipeline->read_bytes += n;
+
+	return true;
+}
+
+/*
+ * split stage: cut complete lines of scan buffer until batch is full
+ */
+static void pg_log_split(PgLogPipeline *pipeline, PgLogBatch *batch)
+{
+	char	*start = pipeline->buf + pipeline->pos;
+	char	*end = pipeline->buf + pipeline->used;
+	char	*nl;
+
+	while (batch->nlines < PG_LOG_BATCH_SIZE &&
+	       (nl = memchr(start, '\n', end - start)) != NULL)
+	{
+		PgLogLine	*line = &batch->lines[batch->nlines++];
+
+		line->data = start;
+		line->len = nl - start;
+		line->lineno = 0;
+		start = nl + 1;
+	}
+	pipeline->pos = start - pipeline->buf;
+	pipeline->split_lines += batch->nlines;
+}
+
+/*
+ * line starts a new log entry: it has log_line_prefix followed by a
+ * severity
+ */
+static bool pg_log_starts_record(const PgLogPrefix *prefix, const char *line, int len, PgLogPrefixMatch *match)
+{
+	if (len == 0 || line[0] == '\t')
+		return false;
+	return pg_log_match_prefix(prefix, line, len, match) && !PG_LOG_TAG_IS_PART(match->tag);
+}
+
+/*
+ * add log entry from record to p to batch, with the prefix match of its
+ * first line if split stage has it
+ */
+static void pg_log_split_record(PgLogPipeline *pipeline, PgLogBatch *batch, char *record, char *p, int nlines)
+{
+	PgLogLine	*line = &batch->lines[batch->nlines];
+
+	line->data = record;
+	line->len = p - 1 - record;
+	line->lineno = 0;
+	batch->records[batch->nlines].nlines = nlines;
+	batch->records[batch->nlines].matched = pipeline->record_matched;
+	if (pipeline->record_matched)
+		batch->matches[batch->nlines] = pipeline->record_match;
+	batch->nlines++;
+}
+
+/*
+ * split stage with PG_LOG_PIPELINE_GROUP: cut complete log entries
+ *
+ * An entry is only complete when next entry has started or at end of file,
+ * otherwise it stays in scan buffer for the next call. With
+ * PG_LOG_PIPELINE_TAIL, the last entry is not complete at end of file
+ * either: its next lines may not be written yet.
+ */
+static void pg_log_split_records(PgLogPipeline *pipeline, PgLogBatch *batch)
+{
+	char	*start = pipeline->buf + pipeline->pos;
+	char	*end = pipeline->buf + pipeline->used;
+	char	*record = start;
+	char	*p = start;
+	char	*nl;
+	int	nlines = 0;
+	PgLogPrefixMatch match;
+
+	while (batch->nlines < PG_LOG_BATCH_SIZE &&
+	       (nl = memchr(p, '\n', end - p)) != NULL)
+	{
+		if (p != record && pg_log_starts_record(pipeline->prefix, p, nl - p, &match))
+		{
+			pg_log_split_record(pipeline, batch, record, p, nlines);
+			/* parse stage does not match first line of next entry again */
+			pipeline->record_match = match;
+			pipeline->record_matched = true;
+			record = p;
+			nlines = 0;
+		}
+		nlines++;
+		p = nl + 1;
+	}
+
+	if (pipeline->eof && !(pipeline->flags & PG_LOG_PIPELINE_TAIL) && p != record &&
+	    batch->nlines < PG_LOG_BATCH_SIZE)
+	{
+		pg_log_split_record(pipeline, batch, record, p, nlines);
+		pipeline->record_matched = false;
+		record = p;
+	}
+
+	pipeline->pos = record - pipeline->buf;
+	pipeline->split_lines += batch->nlines;
+}
+
+/*
+ * split stage with PG_LOG_PIPELINE_CSV: cut complete csvlog records
+ */
+static void pg_log_split_csv(PgLogPipeline *pipeline, PgLogBatch *batch)
+{
+	int	nlines = batch->nlines;
+
+	pipeline->pos += pg_log_csv_split(pipeline->buf + pipeline->pos, pipeline->used - pipeline->pos,
+					  (pipeline->flags & PG_LOG_PIPELINE_ALIGN) != 0, batch);
+	pipeline->split_lines += batch->nlines - nlines;
+}
+
+/*
+ * length of leading ASCII bytes of data without NUL byte, checked by words
+ */
+static int pg_log_ascii_length(const char *data, int len)
+{
+	const char	*p = data;
+	const char	*end = data + len;
+
+	while (end - p >= sizeof(uint64))
+	{
+		uint64		word;
+
+		memcpy(&word, p, sizeof(uint64));
+		/* high bit set or zero byte */
+		if (((word | (word - UINT64CONST(0x0101010101010101))) & UINT64CONST(0x8080808080808080)) != 0)
+			break;
+		p += sizeof(uint64);
+	}
+	while (p < end && !IS_HIGHBIT_SET(*p) && *p != '\0')
+		p++;
+
+	return p - data;
+}
+
+/*
+ * replace bytes of data which are not valid in encoding with '?'
+ *
+ * ASCII runs are skipped by words, other bytes are checked by the
+ * encoding verifier. Return number of replaced bytes.
+ */
+int pg_log_verify_bytes(char *data, int len, int encoding)
+{
+	char	*p = data;
+	char	*end = data + len;
+	int	invalid = 0;
+
+	while (p < end)
+	{
+		p += pg_log_ascii_length(p, end - p);
+		if (p == end)
+			break;
+
+		p += pg_encoding_verifymbstr(encoding, p, end - p);
+		if (p == end)
+			break;
+
+		/* resync on next byte */
+		*p++ = '?';
+		invalid++;
+	}
+
+	return invalid;
+}
+
+/*
+ * verify stage: check encoding of batch lines, which are contiguous in scan
+ * buffer
+ */
+static void pg_log_verify(PgLogPipeline *pipeline, PgLogBatch *batch)
+{
+	char	*start = (char *) batch->lines[0].data;
+	char	*end = (char *) batch->lines[batch->nlines - 1].data + batch->lines[batch->nlines - 1].len;
+
+	pipeline->invalid_bytes += pg_log_verify_bytes(start, end - start, pipeline->encoding);
+}
+
+/*
+ * filter stage: drop broken first line and number kept lines
+ */
+static void pg_log_filter(PgLogPipeline *pipeline, PgLogBatch *batch)
+{
+	int	i;
+	int	n = 0;
+
+	for (i = 0; i < batch->nlines; i++)
+	{
+		PgLogLine	*line = &batch->lines[i];
+
+		pipeline->offset += line->len + 1;
+		if (line->len > pipeline->longest_line)
+			pipeline->longest_line = line->len;
+
+		if (pipeline->flags & PG_LOG_PIPELINE_ALIGN)
+		{
+			pipeline->flags &= ~PG_LOG_PIPELINE_ALIGN;
+			pipeline->filtered_lines++;
+			/* only the broken line is not numbered */
+			if (pipeline->flags & (PG_LOG_PIPELINE_GROUP | PG_LOG_PIPELINE_CSV))
+				pipeline->lineno += batch->records[i].nlines - 1;
+			continue;
+		}
+
+		line->lineno = pipeline->lineno + 1;
+		if (pipeline->flags & (PG_LOG_PIPELINE_GROUP | PG_LOG_PIPELINE_CSV))
+		{
+			pipeline->lineno += batch->records[i].nlines;
+			if (n != i)
+			{
+				batch->records[n] = batch->records[i];
+				batch->matches[n] = batch->matches[i];
+			}
+		}
+		else
+			pipeline->lineno++;
+		if (n != i)
+			batch->lines[n] = *line;
+		n++;
+	}
+	batch->nlines = n;
+}
+
+/*
+ * parse log entries of batch: prefix of first line in batch matches, other
+ * lines are continuation lines or DETAIL, HINT, ... parts
+ *
+ * First lines already matched by the split stage are not matched again.
+ */
+void pg_log_parse_records(const PgLogPrefix *prefix, PgLogBatch *batch)
+{
+	int	i;
+
+	for (i = 0; i < batch->nlines; i++)
+	{
+		PgLogLine	*line = &batch->lines[i];
+		PgLogRecord	*record = &batch->records[i];
+		PgLogPrefixMatch *match = &batch->matches[i];
+		const char	*p = line->data;
+		const char	*end = line->data + line->len;
+		const char	*nl;
+		PgLogSlice	*part;
+		int		len;
+
+		memset(record->parts, 0, sizeof(record->parts));
+
+		nl = memchr(p, '\n', end - p);
+		len = (nl != NULL) ? nl - p : end - p;
+		if (record->matched ||
+		    (pg_log_match_prefix(prefix, p, len, match) && !PG_LOG_TAG_IS_PART(match->tag)))
+		{
+			record->severity = match->tag;
+			record->message.data = p + match->length;
+		}
+		else
+		{
+			match->length = 0;
+			record->severity = -1;
+			record->message.data = p;
+		}
+		part = &record->message;
+		part->len = p + len - part->data;
+		p += len;
+
+		while (p < end)
+		{
+			PgLogPrefixMatch part_match;
+
+			/* skip newline */
+			p++;
+			nl = memchr(p, '\n', end - p);
+			len = (nl != NULL) ? nl - p : end - p;
+
+			if (len > 0 && p[0] != '\t' &&
+			    pg_log_match_prefix(prefix, p, len, &part_match) && PG_LOG_TAG_IS_PART(part_match.tag))
+			{
+				part = &record->parts[part_match.tag - PG_LOG_TAG_DETAIL];
+				part->data = p + part_match.length;
+				part->len = len - part_match.length;
+			}
+			else
+			{
+				/* continuation line */
+				part->len = p + len - part->data;
+			}
+			p += len;
+		}
+	}
+}
+
+/*
+ * text value of slice without the tab added by the server after each
+ * newline
+ */
+text *pg_log_slice_to_text(const char *data, int len)
+{
+	text		*result = (text *) palloc(len + VARHDRSZ);
+	char		*dst = VARDATA(result);
+	const char	*p = data;
+	const char	*end = data + len;
+
+	while (p < end)
+	{
+		const char	*nl = memchr(p, '\n', end - p);
+
+		if (nl == NULL)
+		{
+			memcpy(dst, p, end - p);
+			dst += end - p;
+			break;
+		}
+		memcpy(dst, p, nl - p + 1);
+		dst += nl - p + 1;
+		p = nl + 1;
+		if (p < end && *p == '\t')
+			p++;
+	}
+	SET_VARSIZE(result, dst - VARDATA(result) + VARHDRSZ);
+
+	return result;
+}
+
+const PgLogColumnDesc pg_log_columns[PG_LOG_NCOLUMNS] = {
+	{"message", TEXTOID, -1, -1},
+	{"severity", TEXTOID, -1, PG_LOG_DIM_SEVERITY},
+	{"detail", TEXTOID, -1, -1},
+	{"hint", TEXTOID, -1, -1},
+	{"query", TEXTOID, -1, -1},
+	{"context", TEXTOID, -1, -1},
+	{"location", TEXTOID, -1, -1},
+	{"statement", TEXTOID, -1, -1},
+	{"log_time", TIMESTAMPTZOID, PG_LOG_FIELD_TIME, -1},
+	{"pid", INT4OID, PG_LOG_FIELD_PID, -1},
+	{"user_name", TEXTOID, PG_LOG_FIELD_USER, PG_LOG_DIM_USER},
+	{"database_name", TEXTOID, PG_LOG_FIELD_DATABASE, PG_LOG_DIM_DATABASE},
+	{"application_name", TEXTOID, PG_LOG_FIELD_APPLICATION, PG_LOG_DIM_APPLICATION},
+	{"sqlstate", TEXTOID, PG_LOG_FIELD_SQLSTATE, -1},
+	{"client_host", TEXTOID, PG_LOG_FIELD_HOST, PG_LOG_DIM_CLIENT_HOST},
+	{"fingerprint", INT8OID, -1, -1},
+	{"query_id", INT8OID, PG_LOG_FIELD_QUERY_ID, -1},
+	{"template_id", INT8OID, -1, -1},
+	{"duration_ms", FLOAT8OID, -1, -1}
+};
+
+/*
+ * Datums of log entry columns, built from slices without input function
+ * calls
+ */
+void pg_log_record_values(const PgLogPrefix *prefix, const PgLogLine *line, const PgLogRecord *record,
+			  const PgLogPrefixMatch *match, Datum *values, bool *nulls)
+{
+	int	j;
+
+	memset(nulls, 0, sizeof(bool) * PG_LOG_NCOLUMNS);
+
+	values[PG_LOG_COL_MESSAGE] = PointerGetDatum(pg_log_slice_to_text(record->message.data, record->message.len));
+	if (record->severity >= 0)
+		values[PG_LOG_COL_SEVERITY] = CStringGetTextDatum(pg_log_tags[record->severity]);
+	else
+		nulls[PG_LOG_COL_SEVERITY] = true;
+	for (j = 0; j < PG_LOG_NPARTS; j++)
+	{
+		if (record->parts[j].data != NULL)
+			values[PG_LOG_COL_DETAIL + j] = PointerGetDatum(pg_log_slice_to_text(record->parts[j].data, record->parts[j].len));
+		else
+			nulls[PG_LOG_COL_DETAIL + j] = true;
+	}
+	for (j = PG_LOG_COL_LOG_TIME; j < PG_LOG_NCOLUMNS; j++)
+	{
+		int	field = pg_log_columns[j].field;
+
+		if (field >= 0)
+			values[j] = pg_log_field_value(prefix->time_escape, field, &match->fields[field], &nulls[j]);
+		else
+			nulls[j] = true;
+	}
+	pg_log_fingerprint_values(values, nulls);
+	pg_log_duration_values(values, nulls);
+}
+
+/*
+ * parse stage: match log_line_prefix
+ */
+static void pg_log_parse(PgLogPipeline *pipeline, PgLogBatch *batch)
+{
+	int	i;
+
+	if (pipeline->prefix == NULL)
+		return;
+
+	if (pipeline->flags & PG_LOG_PIPELINE_GROUP)
+	{
+		pg_log_parse_records(pipeline->prefix, batch);
+		return;
+	}
+
+	for (i = 0; i < batch->nlines; i++)
+		pg_log_match_prefix(pipeline->prefix, batch->lines[i].data, batch->lines[i].len, &batch->matches[i]);
+}
+
+/*
+ * next batch for the sink, NULL at end of file
+ *
+ * An incomplete last line is not returned: pipeline offset stays at its
+ * beginning.
+ */
+PgLogBatch *pg_log_pipeline_next(PgLogPipeline *pipeline)
+{
+	PgLogBatch	*batch = &pipeline->batch;
+
+	for (;;)
+	{
+		batch->nlines = 0;
+		pipeline->split(pipeline, batch);
+		if (batch->nlines == 0)
+		{
+			if (pipeline->eof)
+				return NULL;
+			/* at end of file, split stage gets last log entry */
+			if (!pg_log_scan(pipeline))
+				pipeline->eof = true;
+			continue;
+		}
+
+		pg_log_verify(pipeline, batch);
+		pg_log_filter(pipeline, batch);
+		if (batch->nlines == 0)
+			continue;
+
+		pg_log_parse(pipeline, batch);
+
+		return batch;
+	}
+}
+
+void pg_log_pipeline_end(PgLogPipeline *pipeline)
+{
+	elog(DEBUG1, "pg_log: read " INT64_FORMAT " bytes of %s, " INT64_FORMAT " lines, " INT64_FORMAT " filtered (longest=%d)",
+	     pipeline->read_bytes, pipeline->file, pipeline->split_lines, pipeline->filtered_lines, pipeline->longest_line);
+	if (pipeline->invalid_bytes > 0)
+		elog(WARNING, "pg_log: replaced " INT64_FORMAT " bytes of %s not valid in encoding %s",
+		     pipeline->invalid_bytes, pipeline->file, pg_encoding_to_char(pipeline->encoding));
+
+	FreeFile(pipeline->fp);
+	pfree(pipeline->buf);
+	pfree(pipeline->file);
+	pfree(pipeline);
+}
@@ -0,0 +1,224 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_log_plan.c
+ *	  auto_explain plans in JSON format.
+ *
+ * With auto_explain.log_format = json, auto_explain writes entries like
+ *
+ *	duration: 12.345 ms  plan:
+ *	{
+ *	  "Query Text": "select ...",
+ *	  "Plan": {
+ *	    "Node Type": "Seq Scan",
+ *	    ...
+ *
+ * The plan is stored as jsonb and identified by the hash of its shape:
+ * node types, strategies and relation, index and join names of the plan
+ * tree, without costs, row counts or timings.
+ *
+ * Text following "plan:" is not always a valid document: RAISE LOG output
+ * or a plan truncated by the server. jsonb input must not throw an error,
+ * which would abort the refresh before the read position is saved, so
+ * before PG 16 it runs in a subtransaction.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (c) 2022, Pierre Forstmann.
+ *
+ *-------------------------------------------------------------------------
+*/
+#include "postgres.h"
+
+#include "catalog/pg_type.h"
+#include "lib/stringinfo.h"
+#include "utils/builtins.h"
+#include "utils/fmgrprotos.h"
+#include "utils/jsonb.h"
+
+#if PG_VERSION_NUM >= 160000
+#include "nodes/miscnodes.h"
+#else
+#include "access/xact.h"
+#include "utils/resowner.h"
+#endif
+
+#include "pg_log.h"
+
+#if PG_VERSION_NUM < 110000
+#define DatumGetJsonbP(d)	DatumGetJsonb(d)
+#endif
+
+/* keys of plan nodes which make the plan shape */
+static const char *const pg_log_plan_shape_keys[] = {
+	"Node Type", "Strategy", "Partial Mode", "Parent Relationship", "Join Type", "Operation",
+	"Relation Name", "Schema", "Index Name", "Scan Direction", "CTE Name", "Subplan Name",
+	"Function Name", NULL
+};
+
+/*
+ * start of JSON document following "plan:", NULL if plan is not in JSON
+ * format
+ */
+static const char *pg_log_plan_json(const char *p, int len)
+{
+	const char	*end = p + len;
+
+	while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t'))
+		p++;
+	return (p < end && *p == '{') ? p : NULL;
+}
+
+/*
+ * unescaped "Query Text" of plan, NULL if not found
+ *
+ * auto_explain writes it first: it is found without parsing the plan.
+ */
+text *pg_log_plan_query_text(const char *p, int len)
+{
+	static const char key[] = "\"Query Text\": \"";
+	const char	*end = p + len;
+	const char	*json = pg_log_plan_json(p, len);
+	const char	*start;
+	const char	*q;
+
+	if (json == NULL)
+		return NULL;
+	for (q = json + 1; q < end && (*q == ' ' || *q == '\n' || *q == '\r' || *q == '\t'); q++)
+		;
+	if (end - q < sizeof(key) - 1 || memcmp(q, key, sizeof(key) - 1) != 0)
+		return NULL;
+
+	start = q + sizeof(key) - 1;
+	for (q = start; q < end && *q != '"'; q++)
+		if (*q == '\\')
+			q++;
+	if (q >= end)
+		return NULL;
+
+	return pg_log_json_text(start, q - start);
+}
+
+static bool pg_log_plan_shape_key(const char *key, int len)
+{
+	int	i;
+
+	for (i = 0; pg_log_plan_shape_keys[i] != NULL; i++)
+		if (strlen(pg_log_plan_shape_keys[i]) == len && memcmp(pg_log_plan_shape_keys[i], key, len) == 0)
+			return true;
+	return false;
+}
+
+/*
+ * hash of plan shape
+ *
+ * jsonb object keys are sorted: the same plan gives the same walk.
+ */
+static uint64 pg_log_plan_shape(Jsonb *plan)
+{
+	JsonbIterator	*it = JsonbIteratorInit(&plan->root);
+	JsonbIteratorToken token;
+	JsonbValue	v;
+	StringInfoData	buf;
+	bool		shape_value = false;
+	uint64		hash;
+
+	initStringInfo(&buf);
+	while ((token = JsonbIteratorNext(&it, &v, false)) != WJB_DONE)
+	{
+		switch (token)
+		{
+			case WJB_BEGIN_OBJECT:
+				appendStringInfoChar(&buf, '{');
+				shape_value = false;
+				break;
+			case WJB_END_OBJECT:
+				appendStringInfoChar(&buf, '}');
+				break;
+			case WJB_BEGIN_ARRAY:
+				shape_value = false;
+				break;
+			case WJB_KEY:
+				shape_value = pg_log_plan_shape_key(v.val.string.val, v.val.string.len);
+				break;
+			case WJB_VALUE:
+				if (shape_value && v.type == jbvString)
+				{
+					appendBinaryStringInfo(&buf, v.val.string.val, v.val.string.len);
+					appendStringInfoChar(&buf, ';');
+				}
+				shape_value = false;
+				break;
+			default:
+				break;
+		}
+	}
+
+	hash = pg_log_hash64(buf.data, buf.len);
+	pfree(buf.data);
+
+	return hash;
+}
+
+/*
+ * plan following "plan:" as jsonb and hash of its shape, NULL if plan is
+ * not valid JSON
+ */
+Jsonb *pg_log_plan_parse(const char *p, int len, uint64 *shape)
+{
+	const char	*json = pg_log_plan_json(p, len);
+	char		*str;
+	Datum		value;
+#if PG_VERSION_NUM < 160000
+	MemoryContext	oldcontext = CurrentMemoryContext;
+	ResourceOwner	oldowner = CurrentResourceOwner;
+	volatile bool	valid = true;
+#endif
+
+	if (json == NULL)
+		return NULL;
+	str = pnstrdup(json, p + len - json);
+
+#if PG_VERSION_NUM >= 160000
+	{
+		ErrorSaveContext escontext = {T_ErrorSaveContext};
+
+		if (!DirectInputFunctionCallSafe(jsonb_in, str, JSONBOID, -1, (Node *) &escontext, &value))
+		{
+			pfree(str);
+			return NULL;
+		}
+	}
+#else
+	BeginInternalSubTransaction(NULL);
+	MemoryContextSwitchTo(oldcontext);
+	PG_TRY();
+	{
+		value = DirectFunctionCall1(jsonb_in, CStringGetDatum(str));
+		ReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(oldcontext);
+		CurrentResourceOwner = oldowner;
+	}
+	PG_CATCH();
+	{
+		MemoryContextSwitchTo(oldcontext);
+		FlushErrorState();
+		RollbackAndReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(oldcontext);
+		CurrentResourceOwner = oldowner;
+		valid = false;
+	}
+	PG_END_TRY();
+	if (!valid)
+	{
+		elog(DEBUG1, "pg_log: plan is not valid JSON");
+		pfree(str);
+		return NULL;
+	}
+#endif
+	pfree(str);
+
+	*shape = pg_log_plan_shape(DatumGetJsonbP(value));
+
+	return DatumGetJsonbP(value);
+}
@@ -0,0 +1,582 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_log_prefix.c
+ *	  log_line_prefix template compiler and matcher.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (c) 2022, Pierre Forstmann.
+ *
+ *-------------------------------------------------------------------------
+*/
+#include "postgres.h"
+
+#include "datatype/timestamp.h"
+#include "pgtime.h"
+#include "utils/builtins.h"
+#include "utils/datetime.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+#if PG_VERSION_NUM >= 160000
+#include "nodes/miscnodes.h"
+#endif
+
+#include "pg_log.h"
+
+/*
+ * log_line_prefix template
+ *
+ * log_line_prefix is compiled once into a list of literal and escape items.
+ * Matching a log line against the template gives the position of each escape
+ * value in the line: escape values are delimited by the literal that follows
+ * them, except timestamps which have a fixed layout and may contain spaces.
+ */
+
+/*
+ * tags written by the server after log_line_prefix
+ */
+const char *const pg_log_tags[] = {
+	"LOG", "ERROR", "WARNING", "FATAL", "PANIC", "NOTICE", "INFO", "DEBUG",
+	"DETAIL", "HINT", "QUERY", "CONTEXT", "LOCATION", "STATEMENT", NULL
+};
+
+static PgLogPrefix *g_prefix = NULL;
+
+static int pg_log_prefix_field(char escape)
+{
+	switch (escape)
+	{
+		case 't':
+		case 'm':
+		case 'n':
+			return PG_LOG_FIELD_TIME;
+		case 'p':
+			return PG_LOG_FIELD_PID;
+		case 'u':
+			return PG_LOG_FIELD_USER;
+		case 'd':
+			return PG_LOG_FIELD_DATABASE;
+		case 'a':
+			return PG_LOG_FIELD_APPLICATION;
+		case 'e':
+			return PG_LOG_FIELD_SQLSTATE;
+		case 'h':
+			return PG_LOG_FIELD_HOST;
+		case 'Q':
+			return PG_LOG_FIELD_QUERY_ID;
+		default:
+			return -1;
+	}
+}
+
+static bool pg_log_match_generic(const PgLogPrefix *prefix, const char *line, int len, PgLogPrefixMatch *match);
+static PgLogPrefixMatchFunction pg_log_prefix_matcher(const char *log_line_prefix);
+
+static PgLogPrefix *pg_log_compile_prefix(const char *log_line_prefix)
+{
+	MemoryContext	oldcontext;
+	PgLogPrefix	*prefix;
+	const char	*p;
+	char		*lit;
+	int		n = 0;
+
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+	prefix = palloc0(sizeof(PgLogPrefix));
+	prefix->source = pstrdup(log_line_prefix);
+	prefix->literals = palloc0(strlen(log_line_prefix) + 1);
+	prefix->items = palloc0(sizeof(PgLogPrefixItem) * (strlen(log_line_prefix) + 1));
+	prefix->q_item = -1;
+	lit = prefix->literals;
+
+	for (p = log_line_prefix; *p != '\0'; p++)
+	{
+		char	c = *p;
+
+		if (c == '%' && p[1] != '\0')
+		{
+			/* skip padding as done by process_log_prefix_padding */
+			p++;
+			if (*p == '-')
+				p++;
+			while (*p >= '0' && *p <= '9')
+				p++;
+			if (*p == '\0')
+				break;
+			if (*p != '%')
+			{
+				if (*p == 'q')
+					prefix->q_item = n;
+				if (pg_log_prefix_field(*p) == PG_LOG_FIELD_TIME)
+					prefix->time_escape = *p;
+				prefix->items[n].escape = *p;
+				prefix->items[n].field = pg_log_prefix_field(*p);
+				n++;
+				continue;
+			}
+			c = '%';
+		}
+
+		/* literal character, merged with previous literal item if any */
+		if (n == 0 || prefix->items[n - 1].escape != '\0')
+		{
+			prefix->items[n].escape = '\0';
+			prefix->items[n].field = -1;
+			prefix->items[n].literal = lit;
+			n++;
+		}
+		*lit++ = c;
+		prefix->items[n - 1].literal_len++;
+	}
+	prefix->nitems = n;
+	prefix->match = pg_log_prefix_matcher(log_line_prefix);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	return prefix;
+}
+
+/*
+ * return log_line_prefix template, compiled again if the setting has changed
+ */
+PgLogPrefix *pg_log_get_prefix()
+{
+	const char	*log_line_prefix;
+
+	log_line_prefix = GetConfigOption("log_line_prefix", true, false);
+	if (log_line_prefix == NULL)
+		log_line_prefix = "";
+
+	if (g_prefix != NULL && strcmp(g_prefix->source, log_line_prefix) == 0)
+		return g_prefix;
+
+	if (g_prefix != NULL)
+	{
+		pfree(g_prefix->source);
+		pfree(g_prefix->literals);
+		pfree(g_prefix->items);
+		pfree(g_prefix);
+	}
+	g_prefix = pg_log_compile_prefix(log_line_prefix);
+
+	elog(DEBUG1, "pg_log: compiled log_line_prefix '%s' in %d items%s", g_prefix->source, g_prefix->nitems,
+	     g_prefix->match != pg_log_match_generic ? " (specialized matcher)" : "");
+
+	return g_prefix;
+}
+
+/*
+ * length of escape value starting at p, -1 if it does not match
+ */
+static int pg_log_match_escape(const PgLogPrefixItem *item, const PgLogPrefixItem *next, const char *p, int avail)
+{
+	int	len = 0;
+
+	switch (item->escape)
+	{
+		case 't':
+		case 's':
+		case 'm':
+			/* "YYYY-MM-DD HH:MI:SS[.mmm] TZ" */
+			len = (item->escape == 'm') ? 23 : 19;
+			if (avail <= len || p[4] != '-' || p[7] != '-' || p[10] != ' ' || p[13] != ':' || p[len] != ' ')
+				return -1;
+			len++;
+			while (len < avail && p[len] != ' ')
+				len++;
+			return len;
+
+		case 'n':
+			while (len < avail && ((p[len] >= '0' && p[len] <= '9') || p[len] == '.'))
+				len++;
+			return len > 0 ? len : -1;
+
+		case 'q':
+			return 0;
+	}
+
+	if (next != NULL && next->escape == '\0')
+	{
+		/* value ends where next literal starts */
+		for (len = 0; len + next->literal_len <= avail; len++)
+			if (p[len] == next->literal[0] && memcmp(p + len, next->literal, next->literal_len) == 0)
+				return len;
+		return -1;
+	}
+
+	while (len < avail && p[len] != ' ')
+		len++;
+	return len;
+}
+
+/*
+ * match "TAG:  " at p, return tag length or -1
+ */
+static int pg_log_match_tag(const char *p, int avail, int *tag)
+{
+	int	i;
+
+	for (i = 0; pg_log_tags[i] != NULL; i++)
+	{
+		int	len = strlen(pg_log_tags[i]);
+
+		if (avail >= len + 3 && memcmp(p, pg_log_tags[i], len) == 0 &&
+		    p[len] == ':' && p[len + 1] == ' ' && p[len + 2] == ' ')
+		{
+			*tag = i;
+			return len + 3;
+		}
+	}
+	return -1;
+}
+
+static bool pg_log_match_items(const PgLogPrefix *prefix, int nitems, const char *line, int len, PgLogPrefixMatch *match)
+{
+	int	pos = 0;
+	int	i;
+	int	taglen;
+
+	memset(match, 0, sizeof(PgLogPrefixMatch));
+
+	for (i = 0; i < nitems; i++)
+	{
+		const PgLogPrefixItem *item = &prefix->items[i];
+
+		if (item->escape == '\0')
+		{
+			if (len - pos < item->literal_len || memcmp(line + pos, item->literal, item->literal_len) != 0)
+				return false;
+			pos += item->literal_len;
+		}
+		else
+		{
+			const PgLogPrefixItem *next = (i + 1 < nitems) ? &prefix->items[i + 1] : NULL;
+			int	vlen = pg_log_match_escape(item, next, line + pos, len - pos);
+
+			if (vlen < 0)
+				return false;
+			if (item->field >= 0)
+			{
+				match->fields[item->field].data = line + pos;
+				match->fields[item->field].len = vlen;
+			}
+			pos += vlen;
+		}
+	}
+
+	taglen = pg_log_match_tag(line + pos, len - pos, &match->tag);
+	if (taglen < 0)
+		return false;
+	match->length = pos + taglen;
+
+	return true;
+}
+
+/*
+ * generic matcher of log line against log_line_prefix template
+ *
+ * Non-session processes stop prefix output at %q so a line that does not
+ * match the whole template is matched again up to %q.
+ */
+static bool pg_log_match_generic(const PgLogPrefix *prefix, const char *line, int len, PgLogPrefixMatch *match)
+{
+	if (pg_log_match_items(prefix, prefix->nitems, line, len, match))
+		return true;
+	if (prefix->q_item >= 0)
+		return pg_log_match_items(prefix, prefix->q_item, line, len, match);
+	return false;
+}
+
+/*
+ * matchers specialized for common log_line_prefix values
+ */
+#define PG_LOG_KERNEL_NAME	pg_log_match_m_p
+#define PG_LOG_KERNEL_TIME_LEN	23
+#define PG_LOG_KERNEL_USER_DB	0
+#include "pg_log_prefix_kernel.h"
+
+#define PG_LOG_KERNEL_NAME	pg_log_match_t_p
+#define PG_LOG_KERNEL_TIME_LEN	19
+#define PG_LOG_KERNEL_USER_DB	0
+#include "pg_log_prefix_kernel.h"
+
+#define PG_LOG_KERNEL_NAME	pg_log_match_m_p_u_d
+#define PG_LOG_KERNEL_TIME_LEN	23
+#define PG_LOG_KERNEL_USER_DB	1
+#include "pg_log_prefix_kernel.h"
+
+#define PG_LOG_KERNEL_NAME	pg_log_match_t_p_u_d
+#define PG_LOG_KERNEL_TIME_LEN	19
+#define PG_LOG_KERNEL_USER_DB	1
+#include "pg_log_prefix_kernel.h"
+
+static const struct
+{
+	const char	*source;
+	PgLogPrefixMatchFunction match;
+} pg_log_prefix_kernels[] = {
+	{"%m [%p] ", pg_log_match_m_p},
+	{"%t [%p] ", pg_log_match_t_p},
+	{"%m [%p] %q%u@%d ", pg_log_match_m_p_u_d},
+	{"%t [%p] %q%u@%d ", pg_log_match_t_p_u_d},
+	{NULL, NULL}
+};
+
+static PgLogPrefixMatchFunction pg_log_prefix_matcher(const char *log_line_prefix)
+{
+	int	i;
+
+	for (i = 0; pg_log_prefix_kernels[i].source != NULL; i++)
+		if (strcmp(pg_log_prefix_kernels[i].source, log_line_prefix) == 0)
+			return pg_log_prefix_kernels[i].match;
+	return pg_log_match_generic;
+}
+
+/*
+ * match log line against log_line_prefix template
+ */
+bool pg_log_match_prefix(const PgLogPrefix *prefix, const char *line, int len, PgLogPrefixMatch *match)
+{
+	return prefix->match(prefix, line, len, match);
+}
+
+/*
+ * value of n digits at p, -1 if not digits
+ */
+static int pg_log_digits(const char *p, int n)
+{
+	int	value = 0;
+	int	i;
+
+	for (i = 0; i < n; i++)
+	{
+		if (p[i] < '0' || p[i] > '9')
+			return -1;
+		value = value * 10 + p[i] - '0';
+	}
+	return value;
+}
+
+/*
+ * timestamp cache
+ *
+ * Consecutive log lines are written within the same minute: the timestamp
+ * of "YYYY-MM-DD HH:MI" and time zone abbreviation is kept so that a line
+ * of the same minute only needs its seconds to be decoded.
+ */
+#define PG_LOG_TIME_KEY_LEN	16
+#define PG_LOG_TIME_ABBREV_LEN	32
+
+typedef struct
+{
+	/* "YYYY-MM-DD HH:MI" */
+	char		key[PG_LOG_TIME_KEY_LEN];
+	char		abbrev[PG_LOG_TIME_ABBREV_LEN];
+	pg_tz		*tz;
+	TimestampTz	minute;
+} PgLogTimeCache;
+
+static PgLogTimeCache g_time_cache;
+
+/*
+ * timestamp of "YYYY-MM-DD HH:MI" in log_timezone
+ *
+ * Time zone abbreviation chooses between the two offsets of a time repeated
+ * by a daylight saving time change.
+ */
+static bool pg_log_minute(const char *p, const char *abbrev, TimestampTz *result)
+{
+	struct pg_tm	tm;
+	int		tz;
+
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = pg_log_digits(p, 4);
+	tm.tm_mon = pg_log_digits(p + 5, 2);
+	tm.tm_mday = pg_log_digits(p + 8, 2);
+	tm.tm_hour = pg_log_digits(p + 11, 2);
+	tm.tm_min = pg_log_digits(p + 14, 2);
+	if (tm.tm_year < 0 || tm.tm_mon < 1 || tm.tm_mon > 12 || tm.tm_mday < 1 || tm.tm_mday > 31 ||
+	    tm.tm_hour < 0 || tm.tm_hour > 23 || tm.tm_min < 0 || tm.tm_min > 59)
+		return false;
+
+	if (abbrev[0] != '\0')
+		tz = DetermineTimeZoneAbbrevOffset(&tm, abbrev, log_timezone);
+	else
+		tz = DetermineTimeZoneOffset(&tm, log_timezone);
+	return tm2timestamp(&tm, 0, &tz, result) == 0;
+}
+
+/*
+ * "YYYY-MM-DD HH:MI:SS[.mmm] TZ" written by %t or %m, csvlog or jsonlog
+ */
+static bool pg_log_parse_datetime(const char *p, int len, TimestampTz *result)
+{
+	const char	*abbrev;
+	int		abbrev_len;
+	int		sec;
+	int		msec = 0;
+	int		pos = 19;
+
+	if (len < 19 || p[4] != '-' || p[7] != '-' || p[10] != ' ' || p[13] != ':' || p[16] != ':')
+		return false;
+	sec = pg_log_digits(p + 17, 2);
+	if (sec < 0 || sec > 60)
+		return false;
+	if (len >= 23 && p[19] == '.')
+	{
+		msec = pg_log_digits(p + 20, 3);
+		if (msec < 0)
+			return false;
+		pos = 23;
+	}
+	if (pos < len && p[pos] != ' ')
+		return false;
+
+	abbrev = p + pos + (pos < len ? 1 : 0);
+	abbrev_len = p + len - abbrev;
+	if (abbrev_len >= PG_LOG_TIME_ABBREV_LEN)
+		return false;
+
+	if (g_time_cache.tz != log_timezone ||
+	    memcmp(g_time_cache.key, p, PG_LOG_TIME_KEY_LEN) != 0 ||
+	    strncmp(g_time_cache.abbrev, abbrev, abbrev_len) != 0 || g_time_cache.abbrev[abbrev_len] != '\0')
+	{
+		char	buf[PG_LOG_TIME_ABBREV_LEN];
+
+		memcpy(buf, abbrev, abbrev_len);
+		buf[abbrev_len] = '\0';
+		if (!pg_log_minute(p, buf, &g_time_cache.minute))
+		{
+			g_time_cache.tz = NULL;
+			return false;
+		}
+		memcpy(g_time_cache.key, p, PG_LOG_TIME_KEY_LEN);
+		memcpy(g_time_cache.abbrev, buf, abbrev_len + 1);
+		g_time_cache.tz = log_timezone;
+	}
+
+	*result = g_time_cache.minute + sec * USECS_PER_SEC + msec * INT64CONST(1000);
+	return true;
+}
+
+/*
+ * "seconds.milliseconds" since Unix epoch written by %n
+ */
+static bool pg_log_parse_epoch(const char *p, int len, TimestampTz *result)
+{
+	int64	sec = 0;
+	int	msec = 0;
+	int	i;
+
+	for (i = 0; i < len && p[i] >= '0' && p[i] <= '9'; i++)
+	{
+		if (i >= 12)
+			return false;
+		sec = sec * 10 + p[i] - '0';
+	}
+	if (i == 0)
+		return false;
+	if (i < len)
+	{
+		if (len - i != 4 || p[i] != '.' || (msec = pg_log_digits(p + i + 1, 3)) < 0)
+			return false;
+	}
+
+	*result = (sec - ((int64) (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * SECS_PER_DAY)) * USECS_PER_SEC +
+		  msec * INT64CONST(1000);
+	return true;
+}
+
+/*
+ * timestamp written by %t, %m or %n
+ *
+ * Fixed layouts are decoded without calling the datetime parser, which is
+ * only used for other input on PG 16+ where it does not throw errors.
+ * Return false if value is not a valid timestamp.
+ */
+static bool pg_log_parse_time(char escape, const char *p, int len, TimestampTz *result)
+{
+	if (escape == 'n' ? pg_log_parse_epoch(p, len, result) : pg_log_parse_datetime(p, len, result))
+		return true;
+
+#if PG_VERSION_NUM >= 160000
+	{
+		ErrorSaveContext escontext = {T_ErrorSaveContext};
+		char		*str = pnstrdup(p, len);
+		Datum		value;
+		bool		ok;
+
+		ok = DirectInputFunctionCallSafe(timestamptz_in, str, InvalidOid, -1, (Node *) &escontext, &value);
+		pfree(str);
+		if (ok)
+			*result = DatumGetTimestampTz(value);
+		return ok;
+	}
+#else
+	return false;
+#endif
+}
+
+/*
+ * typed value of log_line_prefix field
+ *
+ * Values which are missing, "[unknown]" or invalid are NULL.
+ */
+Datum pg_log_field_value(char time_escape, int field, const PgLogSlice *value, bool *isnull)
+{
+	*isnull = true;
+	if (value->data == NULL || value->len == 0)
+		return (Datum) 0;
+
+	switch (field)
+	{
+		case PG_LOG_FIELD_TIME:
+		{
+			TimestampTz	ts;
+
+			if (!pg_log_parse_time(time_escape, value->data, value->len, &ts))
+				return (Datum) 0;
+			*isnull = false;
+			return TimestampTzGetDatum(ts);
+		}
+
+		case PG_LOG_FIELD_PID:
+		{
+			int	pid;
+
+			if (value->len > 9 || (pid = pg_log_digits(value->data, value->len)) < 0)
+				return (Datum) 0;
+			*isnull = false;
+			return Int32GetDatum(pid);
+		}
+
+		case PG_LOG_FIELD_QUERY_ID:
+		{
+			/* signed 64 bit, 0 if not computed */
+			bool	negative = (value->data[0] == '-');
+			uint64	id = 0;
+			int	i;
+
+			if (value->len - negative > 20 || value->len == negative)
+				return (Datum) 0;
+			for (i = negative; i < value->len; i++)
+			{
+				if (value->data[i] < '0' || value->data[i] > '9')
+					return (Datum) 0;
+				id = id * 10 + (value->data[i] - '0');
+			}
+			if (id == 0)
+				return (Datum) 0;
+			*isnull = false;
+			return Int64GetDatum(negative ? (int64) (0 - id) : (int64) id);
+		}
+
+		default:
+			if (value->len == 9 && memcmp(value->data, "[unknown]", 9) == 0)
+				return (Datum) 0;
+			*isnull = false;
+			return PointerGetDatum(cstring_to_text_with_len(value->data, value->len));
+	}
+}
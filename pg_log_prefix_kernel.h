@@ -0,0 +1,87 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_log_prefix_kernel.h
+ *	  log_line_prefix matcher specialized for one prefix shape.
+ *
+ * This file is included by pg_log_prefix.c once per kernel, after the
+ * following macros have been defined:
+ *
+ *	PG_LOG_KERNEL_NAME	name of the generated function
+ *	PG_LOG_KERNEL_TIME_LEN	19 for %t, 23 for %m
+ *	PG_LOG_KERNEL_USER_DB	1 if the prefix goes on with "%q%u@%d ", 0 if not
+ *
+ * The generated function matches "<time> [%p] " with the same result as the
+ * generic matcher, but without going through the template items: literals
+ * and field layouts are constants of the kernel.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (c) 2022, Pierre Forstmann.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static bool
+PG_LOG_KERNEL_NAME(const PgLogPrefix *prefix, const char *line, int len, PgLogPrefixMatch *match)
+{
+	const char	*end = line + len;
+	const char	*p = line;
+	const char	*q;
+	int		taglen;
+
+	memset(match, 0, sizeof(PgLogPrefixMatch));
+
+	/* "YYYY-MM-DD HH:MI:SS[.mmm] TZ " */
+	if (len <= PG_LOG_KERNEL_TIME_LEN + 1 || p[4] != '-' || p[7] != '-' || p[10] != ' ' || p[13] != ':' ||
+	    p[PG_LOG_KERNEL_TIME_LEN] != ' ')
+		return false;
+	q = memchr(p + PG_LOG_KERNEL_TIME_LEN + 1, ' ', end - p - PG_LOG_KERNEL_TIME_LEN - 1);
+	if (q == NULL)
+		return false;
+	match->fields[PG_LOG_FIELD_TIME].data = p;
+	match->fields[PG_LOG_FIELD_TIME].len = q - p;
+	p = q + 1;
+
+	/* "[pid] " */
+	if (end - p < 4 || *p != '[')
+		return false;
+	q = ++p;
+	while (q < end && *q >= '0' && *q <= '9')
+		q++;
+	if (end - q < 2 || q[0] != ']' || q[1] != ' ')
+		return false;
+	match->fields[PG_LOG_FIELD_PID].data = p;
+	match->fields[PG_LOG_FIELD_PID].len = q - p;
+	p = q + 2;
+
+#if PG_LOG_KERNEL_USER_DB
+	/* "user@database " of session processes */
+	{
+		const char	*at = memchr(p, '@', end - p);
+		const char	*space = (at != NULL) ? memchr(at + 1, ' ', end - at - 1) : NULL;
+
+		if (space != NULL && (taglen = pg_log_match_tag(space + 1, end - space - 1, &match->tag)) >= 0)
+		{
+			match->fields[PG_LOG_FIELD_USER].data = p;
+			match->fields[PG_LOG_FIELD_USER].len = at - p;
+			match->fields[PG_LOG_FIELD_DATABASE].data = at + 1;
+			match->fields[PG_LOG_FIELD_DATABASE].len = space - at - 1;
+			match->length = space + 1 - line + taglen;
+			return true;
+		}
+	}
+	/* other processes stop at %q */
+#endif
+
+	taglen = pg_log_match_tag(p, end - p, &match->tag);
+	if (taglen < 0)
+		return false;
+	match->length = p - line + taglen;
+
+	return true;
+}
+
+#undef PG_LOG_KERNEL_NAME
+#undef PG_LOG_KERNEL_TIME_LEN
+#undef PG_LOG_KERNEL_USER_DB
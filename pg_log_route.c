@@ -0,0 +1,478 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_log_route.c
+ *	  per-database routing of server log lines.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (c) 2022, Pierre Forstmann.
+ *
+ *-------------------------------------------------------------------------
+*/
+#include "postgres.h"
+
+#include "miscadmin.h"
+#include "postmaster/bgworker.h"
+#include "storage/ipc.h"
+#include "storage/dsm.h"
+#include "executor/spi.h"
+#include "access/xact.h"
+#include "catalog/pg_type.h"
+#include "utils/snapmgr.h"
+#include "pgstat.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "mb/pg_wchar.h"
+
+#include "pg_log.h"
+
+/*
+ * per-database routing
+ *
+ * The worker connected to pg_log.datname is the coordinator: it groups
+ * lines by the %d value of log_line_prefix and hands each group to a
+ * dynamic background worker (the sink) connected to that database, which
+ * inserts them in its own pglog table. Each group is passed as one batch
+ * in a DSM segment.
+ *
+ * Sinks commit independently of the coordinator. Each sink saves, in the
+ * transaction inserting the lines, the file number of the source and the
+ * last line number in pglog_route_position and skips lines it has already
+ * inserted, so that a batch can be delivered again. Each line is inserted
+ * at most once in pglog of its database.
+ *
+ * Lines of a database which does not exist or does not accept connections
+ * are dropped. A sink which fails or cannot be started only loses the
+ * lines of its own database: the coordinator logs a warning and goes on,
+ * so one database cannot block the others.
+ */
+
+#define PG_LOG_SINK_MAGIC	0x50474c53
+
+/*
+ * sink status set by coordinator, overwritten by sink
+ */
+#define PG_LOG_SINK_NOT_RUN	-3
+#define PG_LOG_SINK_OLD_EXTENSION	-2
+#define PG_LOG_SINK_NO_EXTENSION	-1
+
+/*
+ * header of a line in sink batch
+ */
+typedef struct
+{
+	int64		lineno;
+	int32		len;
+} PgLogSinkLine;
+
+typedef struct
+{
+	uint32		magic;
+	/* truncate pglog before inserting, once per file */
+	bool		reset;
+	/* file number of source, changes when lines are numbered again */
+	int64		file_number;
+	/* encoding lines have been verified against */
+	int32		encoding;
+	int32		nlines;
+	/* number of inserted lines or PG_LOG_SINK_xxx */
+	int32		status;
+	Size		size;
+	/* nlines times: PgLogSinkLine, len bytes */
+	char		data[FLEXIBLE_ARRAY_MEMBER];
+} PgLogSinkBatch;
+
+typedef struct
+{
+	/* hash key */
+	char		datname[NAMEDATALEN];
+	StringInfoData	lines;
+	int		nlines;
+	/* database exists and accepts connections */
+	bool		valid;
+} PgLogRoute;
+
+typedef struct
+{
+	char		datname[NAMEDATALEN];
+	dsm_segment	*seg;
+	BackgroundWorkerHandle *handle;
+} PgLogSink;
+
+HTAB *pg_log_create_routes(MemoryContext cxt)
+{
+	HASHCTL		ctl;
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = NAMEDATALEN;
+	ctl.entrysize = sizeof(PgLogRoute);
+	ctl.hcxt = cxt;
+
+	return hash_create("pg_log routes", 16, &ctl, HASH_ELEM | PG_LOG_HASH_STRINGS | HASH_CONTEXT);
+}
+
+void pg_log_route_line(HTAB *routes, MemoryContext cxt, const PgLogLine *line, const PgLogPrefixMatch *match)
+{
+	const PgLogSlice *datname;
+	char		key[NAMEDATALEN];
+	PgLogRoute	*route;
+	bool		found;
+	PgLogSinkLine	hdr;
+	MemoryContext	oldcontext;
+
+	if (match->length == 0)
+		return;
+
+	/*
+	 * skip lines without database, lines of the coordinator database which
+	 * already has all lines and placeholders like "[unknown]"
+	 */
+	datname = &match->fields[PG_LOG_FIELD_DATABASE];
+	if (datname->len == 0 || datname->len >= NAMEDATALEN || datname->data[0] == '[')
+		return;
+	if (datname->len == strlen(pg_log_datname) && strncmp(datname->data, pg_log_datname, datname->len) == 0)
+		return;
+
+	memset(key, 0, NAMEDATALEN);
+	memcpy(key, datname->data, datname->len);
+
+	oldcontext = MemoryContextSwitchTo(cxt);
+	route = (PgLogRoute *) hash_search(routes, key, HASH_ENTER, &found);
+	if (!found)
+	{
+		initStringInfo(&route->lines);
+		route->nlines = 0;
+		route->valid = false;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.lineno = line->lineno;
+	hdr.len = line->len;
+	appendBinaryStringInfo(&route->lines, (char *) &hdr, sizeof(hdr));
+	appendBinaryStringInfo(&route->lines, line->data, line->len);
+	route->nlines++;
+	MemoryContextSwitchTo(oldcontext);
+}
+
+static bool pg_log_launch_sink(PgLogSink *sink)
+{
+	BackgroundWorker worker;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+		BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	sprintf(worker.bgw_library_name, "pg_log");
+	sprintf(worker.bgw_function_name, "pg_log_sink_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "pg_log_sink %s", sink->datname);
+#if PG_VERSION_NUM >= 110000
+	snprintf(worker.bgw_type, BGW_MAXLEN, "pg_log_sink");
+#endif
+	worker.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(sink->seg));
+	memcpy(worker.bgw_extra, sink->datname, NAMEDATALEN);
+	worker.bgw_notify_pid = MyProcPid;
+
+	return RegisterDynamicBackgroundWorker(&worker, &sink->handle);
+}
+
+/*
+ * wait for sink to complete
+ */
+static void pg_log_wait_sink(PgLogSink *sink)
+{
+	PgLogSinkBatch	*batch = (PgLogSinkBatch *) dsm_segment_address(sink->seg);
+	BgwHandleStatus	status;
+
+	status = WaitForBackgroundWorkerShutdown(sink->handle);
+	if (status == BGWH_POSTMASTER_DIED)
+		proc_exit(1);
+
+	if (batch->status == PG_LOG_SINK_NO_EXTENSION)
+		elog(DEBUG1, "pg_log: database %s has no pg_log extension", sink->datname);
+	else if (batch->status == PG_LOG_SINK_OLD_EXTENSION)
+		ereport(WARNING,
+				(errmsg("pg_log: log lines of database %s were not inserted", sink->datname),
+				 errhint("Update the pg_log extension of this database with ALTER EXTENSION pg_log UPDATE.")));
+	else if (batch->status == PG_LOG_SINK_NOT_RUN)
+		elog(WARNING, "pg_log: sink for database %s failed, %d log lines were not inserted",
+		     sink->datname, batch->nlines);
+	else
+		elog(DEBUG1, "pg_log: sink for database %s inserted %d lines", sink->datname, batch->status);
+
+	dsm_detach(sink->seg);
+	pfree(sink);
+}
+
+/*
+ * mark routes to databases which accept connections, add empty routes to
+ * those without lines if they must be reset
+ */
+static void pg_log_route_databases(HTAB *routes, bool reset)
+{
+	int		ret_code;
+	uint64		i;
+
+	ret_code = SPI_execute("select datname from pg_database where datallowconn and not datistemplate", true, 0);
+	if (ret_code != SPI_OK_SELECT)
+		elog(ERROR, "pg_log: SELECT FROM pg_database failed");
+
+	for (i = 0; i < SPI_processed; i++)
+	{
+		char		*datname = SPI_getvalue(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1);
+		char		key[NAMEDATALEN];
+		PgLogRoute	*route;
+		bool		found;
+
+		if (strcmp(datname, pg_log_datname) == 0)
+			continue;
+		memset(key, 0, NAMEDATALEN);
+		strlcpy(key, datname, NAMEDATALEN);
+		route = (PgLogRoute *) hash_search(routes, key, reset ? HASH_ENTER : HASH_FIND, &found);
+		if (route == NULL)
+			continue;
+		if (!found)
+		{
+			initStringInfo(&route->lines);
+			route->nlines = 0;
+		}
+		route->valid = true;
+	}
+	SPI_freetuptable(SPI_tuptable);
+}
+
+/*
+ * hand each route to a sink and wait for all sinks to complete
+ *
+ * file_number identifies the file of the lines. If reset is true, pglog of
+ * all databases is truncated before inserting lines of this file.
+ */
+void pg_log_dispatch_routes(HTAB *routes, int64 file_number, bool reset)
+{
+	HASH_SEQ_STATUS	hash_seq;
+	PgLogRoute	*route;
+	List		*running = NIL;
+	ListCell	*lc;
+
+	pg_log_route_databases(routes, reset);
+
+	hash_seq_init(&hash_seq, routes);
+	while ((route = (PgLogRoute *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		PgLogSink	*sink;
+		PgLogSinkBatch	*batch;
+
+		if (!route->valid)
+		{
+			elog(WARNING, "pg_log: database %s does not exist or does not allow connections, %d log lines dropped",
+			     route->datname, route->nlines);
+			continue;
+		}
+
+		sink = palloc0(sizeof(PgLogSink));
+		strlcpy(sink->datname, route->datname, NAMEDATALEN);
+		sink->seg = dsm_create(offsetof(PgLogSinkBatch, data) + route->lines.len, 0);
+
+		batch = (PgLogSinkBatch *) dsm_segment_address(sink->seg);
+		batch->magic = PG_LOG_SINK_MAGIC;
+		batch->reset = reset;
+		batch->file_number = file_number;
+		batch->encoding = GetDatabaseEncoding();
+		batch->nlines = route->nlines;
+		batch->status = PG_LOG_SINK_NOT_RUN;
+		batch->size = route->lines.len;
+		memcpy(batch->data, route->lines.data, route->lines.len);
+
+		if (!pg_log_launch_sink(sink))
+		{
+			/* no free worker slot: wait for running sinks and try again */
+			foreach(lc, running)
+				pg_log_wait_sink((PgLogSink *) lfirst(lc));
+			list_free(running);
+			running = NIL;
+
+			if (!pg_log_launch_sink(sink))
+			{
+				elog(WARNING, "pg_log: could not start sink for database %s (max_worker_processes too low ?), %d log lines were not inserted",
+				     sink->datname, route->nlines);
+				dsm_detach(sink->seg);
+				pfree(sink);
+				continue;
+			}
+		}
+		running = lappend(running, sink);
+	}
+
+	foreach(lc, running)
+		pg_log_wait_sink((PgLogSink *) lfirst(lc));
+	list_free(running);
+}
+
+/*
+ * last line of file inserted by a previous batch, 0 if lines of file have
+ * not been inserted yet
+ */
+static int64 pg_log_sink_position(int64 file_number, bool *same_file)
+{
+	int64		line = 0;
+	int		ret_code;
+	bool		isnull;
+
+	ret_code = SPI_execute("select file_number, line from pglog_route_position", true, 1);
+	if (ret_code != SPI_OK_SELECT)
+		elog(ERROR, "pg_log: SELECT FROM pglog_route_position failed");
+
+	*same_file = false;
+	if (SPI_processed > 0 &&
+	    DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull)) == file_number)
+	{
+		*same_file = true;
+		line = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 2, &isnull));
+	}
+	SPI_freetuptable(SPI_tuptable);
+
+	return line;
+}
+
+static void pg_log_sink_save_position(int64 file_number, int64 line)
+{
+	Oid		argtypes[2] = { INT8OID, INT8OID };
+	Datum		values[2];
+
+	if (SPI_execute("delete from pglog_route_position", false, 0) != SPI_OK_DELETE)
+		elog(ERROR, "pg_log: DELETE FROM pglog_route_position failed");
+
+	values[0] = Int64GetDatum(file_number);
+	values[1] = Int64GetDatum(line);
+	if (SPI_execute_with_args("insert into pglog_route_position(file_number, line) values ($1, $2)",
+				  2, argtypes, values, NULL, false, 0) != SPI_OK_INSERT)
+		elog(ERROR, "pg_log: INSERT INTO pglog_route_position failed");
+}
+
+/*
+ * insert batch log entries in pglog by pipeline batches pointing to DSM
+ * segment, without lines inserted by a previous delivery of the batch
+ */
+static int pg_log_sink_insert(PgLogSinkBatch *batch)
+{
+	PgLogWriter	writer;
+	PgLogBatch	*lines;
+	const char	*p = batch->data;
+	bool		same_file;
+	int64		position;
+	int		inserted = 0;
+	int		i;
+
+	position = pg_log_sink_position(batch->file_number, &same_file);
+	/* pglog was reset by a previous delivery of this file */
+	if (batch->reset && !same_file)
+		pg_log_truncate("pglog");
+
+	lines = palloc(sizeof(PgLogBatch));
+	lines->nlines = 0;
+
+	pg_log_writer_begin(&writer, "pglog", NULL, PG_LOG_FORMAT_STDERR);
+	for (i = 0; i < batch->nlines; i++)
+	{
+		PgLogSinkLine	hdr;
+		PgLogLine	*line;
+
+		memcpy(&hdr, p, sizeof(hdr));
+		p += sizeof(hdr);
+		if (hdr.lineno <= position)
+		{
+			p += hdr.len;
+			continue;
+		}
+		line = &lines->lines[lines->nlines++];
+		line->lineno = hdr.lineno;
+		line->len = hdr.len;
+		line->data = p;
+		lines->records[lines->nlines - 1].matched = false;
+		/* lines are only valid in coordinator database encoding */
+		if (batch->encoding != GetDatabaseEncoding())
+			pg_log_verify_bytes((char *) p, hdr.len, GetDatabaseEncoding());
+		p += hdr.len;
+		position = hdr.lineno;
+		inserted++;
+
+		if (lines->nlines == PG_LOG_BATCH_SIZE)
+		{
+			pg_log_parse_records(pg_log_get_prefix(), lines);
+			pg_log_writer_write(&writer, lines);
+			lines->nlines = 0;
+		}
+	}
+	if (lines->nlines > 0)
+	{
+		pg_log_parse_records(pg_log_get_prefix(), lines);
+		pg_log_writer_write(&writer, lines);
+	}
+	pg_log_writer_end(&writer);
+
+	if (inserted > 0 || !same_file)
+		pg_log_sink_save_position(batch->file_number, position);
+
+	pfree(lines);
+
+	return inserted;
+}
+
+/*
+ * sink background worker: insert one batch in pglog of database bgw_extra
+ */
+void
+pg_log_sink_main(Datum main_arg)
+{
+	char		datname[NAMEDATALEN];
+	dsm_segment	*seg;
+	PgLogSinkBatch	*batch;
+	int		ret_code;
+	int		status;
+	bool		isnull;
+
+	BackgroundWorkerUnblockSignals();
+
+	memcpy(datname, MyBgworkerEntry->bgw_extra, NAMEDATALEN);
+#if PG_VERSION_NUM >=110000
+	BackgroundWorkerInitializeConnection(datname, NULL, 0);
+#else
+	BackgroundWorkerInitializeConnection(datname, NULL);
+#endif
+
+	seg = dsm_attach(DatumGetUInt32(main_arg));
+	if (seg == NULL)
+		elog(ERROR, "pg_log: sink could not map dynamic shared memory segment");
+	batch = (PgLogSinkBatch *) dsm_segment_address(seg);
+	if (batch->magic != PG_LOG_SINK_MAGIC)
+		elog(ERROR, "pg_log: sink got bad magic number in dynamic shared memory segment");
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	SPI_connect();
+	PushActiveSnapshot(GetTransactionSnapshot());
+
+	/* pglog_route_position does not exist if the extension was not updated */
+	ret_code = SPI_execute("select to_regclass('pglog_route_position') is not null from pg_extension where extname = 'pg_log'",
+			       true, 1);
+	if (ret_code != SPI_OK_SELECT)
+		elog(ERROR, "pg_log: SELECT FROM pg_extension failed");
+
+	if (SPI_processed == 0)
+		status = PG_LOG_SINK_NO_EXTENSION;
+	else if (!DatumGetBool(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull)))
+		status = PG_LOG_SINK_OLD_EXTENSION;
+	else
+		status = pg_log_sink_insert(batch);
+
+	SPI_finish();
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	batch->status = status;
+
+	dsm_detach(seg);
+
+	proc_exit(0);
+}
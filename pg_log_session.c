@@ -0,0 +1,155 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_log_session.c
+ *	  sessions connected and not yet disconnected.
+ *
+ * With log_connections and log_disconnections, a session is written as
+ *
+ *	connection received: host=10.0.0.1 port=50412
+ *	connection authorized: user=alice database=app application_name=psql
+ *	...
+ *	disconnection: session time: 0:01:02.345 user=alice database=app
+ *	host=10.0.0.1 port=50412
+ *
+ * by the same pid. Connections are kept by pid in a shared memory hash
+ * table until their disconnection is read, by the worker or by any
+ * backend running pg_log_refresh().
+ *
+ * A refresh which aborts is read again: connections are entered again
+ * and a disconnection without connection gets its connection time from
+ * its session time.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (c) 2022, Pierre Forstmann.
+ *
+ *-------------------------------------------------------------------------
+*/
+#include "postgres.h"
+
+#include "miscadmin.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+
+#include "pg_log.h"
+
+/* maximum number of sessions kept in shared memory */
+#define PG_LOG_SESSION_SIZE	4096
+
+typedef struct
+{
+	/* sessions of each database have their own pids */
+	Oid		dbid;
+	int		pid;
+} PgLogSessionKey;
+
+typedef struct
+{
+	PgLogSessionKey	key;
+	PgLogSession	session;
+} PgLogSessionEntry;
+
+static HTAB *pg_log_session_hash = NULL;
+static LWLock *pg_log_session_lock = NULL;
+
+Size pg_log_session_shmem_size(void)
+{
+	return hash_estimate_size(PG_LOG_SESSION_SIZE, sizeof(PgLogSessionEntry));
+}
+
+/*
+ * called by shared memory startup hook with AddinShmemInitLock held
+ */
+void pg_log_session_shmem_startup(void)
+{
+	HASHCTL	info;
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(PgLogSessionKey);
+	info.entrysize = sizeof(PgLogSessionEntry);
+	pg_log_session_hash = ShmemInitHash("pg_log sessions", PG_LOG_SESSION_SIZE, PG_LOG_SESSION_SIZE,
+					    &info, HASH_ELEM | HASH_BLOBS);
+	/* second lock of tranche, first one is the dictionary lock */
+	pg_log_session_lock = &(GetNamedLWLockTranche("pg_log"))[1].lock;
+}
+
+static void pg_log_session_key(PgLogSessionKey *key, int pid)
+{
+	memset(key, 0, sizeof(PgLogSessionKey));
+	key->dbid = MyDatabaseId;
+	key->pid = pid;
+}
+
+/*
+ * "connection received:", replaces a session of a previous process with
+ * the same pid
+ */
+void pg_log_session_connect(int pid, TimestampTz connected_at, const char *host, int port)
+{
+	PgLogSessionKey		key;
+	PgLogSessionEntry	*entry;
+
+	if (pg_log_session_hash == NULL)
+		return;
+
+	pg_log_session_key(&key, pid);
+	LWLockAcquire(pg_log_session_lock, LW_EXCLUSIVE);
+	/* table is full: session only gets columns of its disconnection */
+	entry = hash_search(pg_log_session_hash, &key, HASH_ENTER_NULL, NULL);
+	if (entry != NULL)
+	{
+		memset(&entry->session, 0, sizeof(PgLogSession));
+		entry->session.connected_at = connected_at;
+		entry->session.client_port = port;
+		strlcpy(entry->session.client_host, host, PG_LOG_SESSION_NAME_LEN);
+	}
+	LWLockRelease(pg_log_session_lock);
+}
+
+/*
+ * "connection authorized:"
+ */
+void pg_log_session_authorize(int pid, const char *user, const char *database, const char *application)
+{
+	PgLogSessionKey		key;
+	PgLogSessionEntry	*entry;
+
+	if (pg_log_session_hash == NULL)
+		return;
+
+	pg_log_session_key(&key, pid);
+	LWLockAcquire(pg_log_session_lock, LW_EXCLUSIVE);
+	entry = hash_search(pg_log_session_hash, &key, HASH_FIND, NULL);
+	if (entry != NULL)
+	{
+		strlcpy(entry->session.user_name, user, PG_LOG_SESSION_NAME_LEN);
+		strlcpy(entry->session.database_name, database, PG_LOG_SESSION_NAME_LEN);
+		strlcpy(entry->session.application_name, application, PG_LOG_SESSION_NAME_LEN);
+	}
+	LWLockRelease(pg_log_session_lock);
+}
+
+/*
+ * "disconnection:", copy and remove session of pid, false if not found
+ */
+bool pg_log_session_disconnect(int pid, PgLogSession *session)
+{
+	PgLogSessionKey		key;
+	PgLogSessionEntry	*entry;
+
+	if (pg_log_session_hash == NULL)
+		return false;
+
+	pg_log_session_key(&key, pid);
+	LWLockAcquire(pg_log_session_lock, LW_EXCLUSIVE);
+	entry = hash_search(pg_log_session_hash, &key, HASH_FIND, NULL);
+	if (entry != NULL)
+	{
+		*session = entry->session;
+		hash_search(pg_log_session_hash, &key, HASH_REMOVE, NULL);
+	}
+	LWLockRelease(pg_log_session_lock);
+
+	return entry != NULL;
+}
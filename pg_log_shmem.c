@@ -0,0 +1,254 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_log_shmem.c
+ *	  shared memory state of the worker and pg_log_sync().
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (c) 2022, Pierre Forstmann.
+ *
+ *-------------------------------------------------------------------------
+*/
+#include "postgres.h"
+
+#include "fmgr.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "storage/condition_variable.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/timestamp.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "pg_log.h"
+
+/*
+ * flush barrier
+ *
+ * pg_log_sync() takes a ticket and wakes the worker up. The worker reads
+ * the last ticket before each refresh and publishes it with the read
+ * position of the server log once the refresh is committed: a backend
+ * holding a served ticket sees all lines written before it took the
+ * ticket.
+ */
+typedef struct
+{
+	slock_t		mutex;
+	Latch		*worker_latch;
+	/* last ticket taken by pg_log_sync(), last ticket served by worker */
+	uint64		sync_requested;
+	uint64		sync_served;
+	/* committed read position of server log */
+	char		file[MAXPGPATH];
+	int64		offset;
+	ConditionVariable cv;
+} PgLogShared;
+
+static PgLogShared *pg_log_shared = NULL;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+
+/* read position of server log set by current refresh, not yet committed */
+static char pending_file[MAXPGPATH];
+static int64 pending_offset = -1;
+
+PG_FUNCTION_INFO_V1(pg_log_sync);
+
+static Size pg_log_shmem_size(void)
+{
+	return add_size(add_size(MAXALIGN(sizeof(PgLogShared)), pg_log_dict_shmem_size()),
+			add_size(pg_log_session_shmem_size(), pg_log_template_shmem_size()));
+}
+
+#if PG_VERSION_NUM >= 150000
+static void pg_log_shmem_request(void)
+{
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+
+	RequestAddinShmemSpace(pg_log_shmem_size());
+	/* locks of dictionary, session and template hash tables */
+	RequestNamedLWLockTranche("pg_log", 3);
+}
+#endif
+
+static void pg_log_shmem_startup(void)
+{
+	bool	found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	pg_log_shared = ShmemInitStruct("pg_log", sizeof(PgLogShared), &found);
+	if (!found)
+	{
+		memset(pg_log_shared, 0, sizeof(PgLogShared));
+		SpinLockInit(&pg_log_shared->mutex);
+		ConditionVariableInit(&pg_log_shared->cv);
+	}
+	pg_log_dict_shmem_startup();
+	pg_log_session_shmem_startup();
+	pg_log_template_shmem_startup();
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * called by _PG_init when loaded with shared_preload_libraries
+ */
+void pg_log_shmem_init(void)
+{
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = pg_log_shmem_request;
+#else
+	RequestAddinShmemSpace(pg_log_shmem_size());
+	/* locks of dictionary, session and template hash tables */
+	RequestNamedLWLockTranche("pg_log", 3);
+#endif
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = pg_log_shmem_startup;
+}
+
+/*
+ * worker: register latch woken up by pg_log_sync()
+ */
+void pg_log_sync_attach(void)
+{
+	SpinLockAcquire(&pg_log_shared->mutex);
+	pg_log_shared->worker_latch = MyLatch;
+	SpinLockRelease(&pg_log_shared->mutex);
+}
+
+/*
+ * worker: last ticket before refresh
+ */
+uint64 pg_log_sync_begin(void)
+{
+	uint64	ticket;
+
+	pending_offset = -1;
+
+	SpinLockAcquire(&pg_log_shared->mutex);
+	ticket = pg_log_shared->sync_requested;
+	SpinLockRelease(&pg_log_shared->mutex);
+
+	return ticket;
+}
+
+/*
+ * read position of server log reached by current refresh
+ */
+void pg_log_sync_set_position(const char *file, int64 offset)
+{
+	strlcpy(pending_file, file, MAXPGPATH);
+	pending_offset = offset;
+}
+
+/*
+ * worker: publish committed refresh and wake up waiting backends
+ *
+ * Ticket is only served if server log has been read: its source may be
+ * disabled or locked by pg_log_refresh().
+ */
+void pg_log_sync_end(uint64 ticket)
+{
+	if (pending_offset < 0)
+		return;
+
+	SpinLockAcquire(&pg_log_shared->mutex);
+	strlcpy(pg_log_shared->file, pending_file, MAXPGPATH);
+	pg_log_shared->offset = pending_offset;
+	pg_log_shared->sync_served = ticket;
+	SpinLockRelease(&pg_log_shared->mutex);
+
+	ConditionVariableBroadcast(&pg_log_shared->cv);
+}
+
+static uint64 pg_log_sync_request(void)
+{
+	uint64	ticket;
+	Latch	*latch;
+
+	SpinLockAcquire(&pg_log_shared->mutex);
+	ticket = ++pg_log_shared->sync_requested;
+	latch = pg_log_shared->worker_latch;
+	SpinLockRelease(&pg_log_shared->mutex);
+
+	if (latch != NULL)
+		SetLatch(latch);
+
+	return ticket;
+}
+
+/*
+ * wait until lines written to server log before the call are in pglog
+ *
+ * Return false if timeout (in milliseconds) expires first.
+ */
+Datum pg_log_sync(PG_FUNCTION_ARGS)
+{
+	int		timeout = PG_GETARG_INT32(0);
+	char		*file;
+	struct stat	stat_buf;
+	TimestampTz	start;
+	uint64		ticket;
+	bool		done = false;
+
+	if (pg_log_shared == NULL)
+		elog(ERROR, "pg_log: pg_log must be loaded with shared_preload_libraries");
+
+	file = pg_log_server_file();
+	if (stat(file, &stat_buf) != 0)
+		elog(ERROR, "pg_log: stat failed on %s", file);
+
+	start = GetCurrentTimestamp();
+	ticket = pg_log_sync_request();
+
+	ConditionVariablePrepareToSleep(&pg_log_shared->cv);
+	for (;;)
+	{
+		long	remaining;
+		bool	served;
+
+		SpinLockAcquire(&pg_log_shared->mutex);
+		served = pg_log_shared->sync_served >= ticket;
+		/* a different file has been started after the call */
+		done = served && (strcmp(pg_log_shared->file, file) != 0 || pg_log_shared->offset >= stat_buf.st_size);
+		SpinLockRelease(&pg_log_shared->mutex);
+
+		if (done)
+			break;
+
+		/* refresh stopped before our last line: ask for another one */
+		if (served)
+			ticket = pg_log_sync_request();
+
+		remaining = timeout - (long) ((GetCurrentTimestamp() - start) / 1000);
+		if (remaining <= 0)
+			break;
+
+#if PG_VERSION_NUM >= 130000
+		ConditionVariableTimedSleep(&pg_log_shared->cv, remaining, PG_WAIT_EXTENSION);
+#else
+		/* broadcast sets our latch */
+		WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH, remaining, PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+		/* broadcast removed us from the wait list: join it before next check */
+		ConditionVariablePrepareToSleep(&pg_log_shared->cv);
+#endif
+	}
+	ConditionVariableCancelSleep();
+
+	PG_RETURN_BOOL(done);
+}
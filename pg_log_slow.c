@@ -0,0 +1,431 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_log_slow.c
+ *	  slow query statistics of "duration:" log entries.
+ *
+ * log_min_duration_statement writes entries like
+ *
+ *	duration: 1234.567 ms  statement: select ...
+ *	duration: 12.345 ms  execute S_1: select ...
+ *
+ * Such entries are aggregated by statement fingerprint while the writer
+ * inserts them and the statistics of the refresh are merged into
+ * pglog_slow_queries when the writer ends: number of calls, total, min and
+ * max duration and a histogram of durations in power of 2 buckets.
+ *
+ * auto_explain entries ("duration: X ms  plan: ...") are aggregated in the
+ * same way by fingerprint and plan shape into pglog_plans.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (c) 2022, Pierre Forstmann.
+ *
+ *-------------------------------------------------------------------------
+*/
+#include "postgres.h"
+
+#include "catalog/pg_type.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+
+#include "pg_log.h"
+
+#define PG_LOG_SLOW_KIND_LEN	16
+
+typedef struct
+{
+	int64		calls;
+	double		total_ms;
+	double		min_ms;
+	double		max_ms;
+	bool		has_time;
+	TimestampTz	first_seen;
+	TimestampTz	last_seen;
+} PgLogSlowCounters;
+
+typedef struct
+{
+	uint64		fingerprint;
+	char		kind[PG_LOG_SLOW_KIND_LEN];
+	text		*statement;
+	PgLogSlowCounters counters;
+	int64		histogram[PG_LOG_SLOW_NBUCKETS];
+} PgLogSlowEntry;
+
+typedef struct
+{
+	uint64		fingerprint;
+	uint64		shape;
+} PgLogPlanKey;
+
+typedef struct
+{
+	PgLogPlanKey	key;
+	text		*statement;
+	/* first plan of shape */
+	Jsonb		*plan;
+	PgLogSlowCounters counters;
+} PgLogPlanEntry;
+
+static const char *pg_log_slow_upsert =
+	"insert into pglog_slow_queries as s(fingerprint, kind, statement, calls, total_ms, min_ms, max_ms, "
+	"first_seen, last_seen, histogram) values ($1, $2, $3, $4, $5, $6, $7, $8, $9, $10) "
+	"on conflict (fingerprint) do update set "
+	"calls = s.calls + excluded.calls, "
+	"total_ms = s.total_ms + excluded.total_ms, "
+	"min_ms = least(s.min_ms, excluded.min_ms), "
+	"max_ms = greatest(s.max_ms, excluded.max_ms), "
+	"first_seen = least(s.first_seen, excluded.first_seen), "
+	"last_seen = greatest(s.last_seen, excluded.last_seen), "
+	"histogram = array(select a + b from unnest(s.histogram, excluded.histogram) with ordinality t(a, b, n) order by n)";
+
+static const char *pg_log_plan_upsert =
+	"insert into pglog_plans as s(fingerprint, plan_hash, statement, calls, total_ms, min_ms, max_ms, "
+	"first_seen, last_seen, plan) values ($1, $2, $3, $4, $5, $6, $7, $8, $9, $10) "
+	"on conflict (fingerprint, plan_hash) do update set "
+	"calls = s.calls + excluded.calls, "
+	"total_ms = s.total_ms + excluded.total_ms, "
+	"min_ms = least(s.min_ms, excluded.min_ms), "
+	"max_ms = greatest(s.max_ms, excluded.max_ms), "
+	"first_seen = least(s.first_seen, excluded.first_seen), "
+	"last_seen = greatest(s.last_seen, excluded.last_seen)";
+
+void pg_log_slow_begin(PgLogSlowStats *stats)
+{
+	HASHCTL	ctl;
+
+	stats->context = AllocSetContextCreate(CurrentMemoryContext,
+					       "pg_log slow queries",
+					       ALLOCSET_DEFAULT_SIZES);
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(uint64);
+	ctl.entrysize = sizeof(PgLogSlowEntry);
+	ctl.hcxt = stats->context;
+	stats->statements = hash_create("pg_log slow queries", 256, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	ctl.keysize = sizeof(PgLogPlanKey);
+	ctl.entrysize = sizeof(PgLogPlanEntry);
+	stats->plans = hash_create("pg_log plans", 64, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+}
+
+/*
+ * parse "duration: X ms", return its length or 0 if message has another
+ * format
+ */
+static int pg_log_parse_duration_ms(const char *p, int len, double *ms)
+{
+	const char	*end = p + len;
+	const char	*q;
+	char		number[32];
+	char		*number_end;
+
+	if (len < 10 || memcmp(p, "duration: ", 10) != 0)
+		return 0;
+
+	for (q = p + 10; q < end && ((*q >= '0' && *q <= '9') || *q == '.'); q++)
+		;
+	if (q == p + 10 || q - p - 10 >= sizeof(number) || end - q < 3 || memcmp(q, " ms", 3) != 0)
+		return 0;
+	memcpy(number, p + 10, q - p - 10);
+	number[q - p - 10] = '\0';
+	*ms = strtod(number, &number_end);
+	if (*number_end != '\0')
+		return 0;
+
+	return q + 3 - p;
+}
+
+/*
+ * duration_ms column of log entry: time of a "duration:" entry, with or
+ * without statement (log_duration)
+ */
+void pg_log_duration_values(Datum *values, bool *nulls)
+{
+	text	*message;
+	double	ms;
+	int	n;
+
+	nulls[PG_LOG_COL_DURATION_MS] = true;
+	if (nulls[PG_LOG_COL_MESSAGE])
+		return;
+
+	message = DatumGetTextPP(values[PG_LOG_COL_MESSAGE]);
+	n = pg_log_parse_duration_ms(VARDATA_ANY(message), VARSIZE_ANY_EXHDR(message), &ms);
+	if (n > 0 && (n == VARSIZE_ANY_EXHDR(message) || VARDATA_ANY(message)[n] == ' '))
+	{
+		values[PG_LOG_COL_DURATION_MS] = Float8GetDatum(ms);
+		nulls[PG_LOG_COL_DURATION_MS] = false;
+	}
+}
+
+/*
+ * parse "duration: X ms  kind[ name]: statement", return false if message
+ * has another format or no statement. kind may be NULL.
+ */
+bool pg_log_parse_duration(const char *p, int len, double *ms, const char **kind, int *kind_len,
+			   const char **statement, int *statement_len)
+{
+	const char	*end = p + len;
+	const char	*q;
+	int		n = pg_log_parse_duration_ms(p, len, ms);
+
+	if (n == 0 || end - p - n < 2 || memcmp(p + n, "  ", 2) != 0)
+		return false;
+	p += n + 2;
+
+	/*
+	 * "statement: " or "execute <name>: ", "parse <name>: ", "bind <name>: ",
+	 * "plan:"
+	 */
+	for (q = p; q < end && *q != ' ' && *q != ':'; q++)
+		;
+	if (q == p || q == end || q - p >= PG_LOG_SLOW_KIND_LEN)
+		return false;
+	if (kind != NULL)
+	{
+		*kind = p;
+		*kind_len = q - p;
+	}
+	/* auto_explain writes "plan:" and the plan on next lines */
+	while (q + 1 < end && (q[0] != ':' || (q[1] != ' ' && q[1] != '\n')))
+		q++;
+	if (q + 1 >= end)
+		return false;
+
+	*statement = q + 2;
+	*statement_len = end - q - 2;
+	return *statement_len > 0;
+}
+
+static int pg_log_slow_bucket(double ms)
+{
+	int	bucket = 0;
+
+	while (ms >= 1.0 && bucket < PG_LOG_SLOW_NBUCKETS - 1)
+	{
+		ms /= 2;
+		bucket++;
+	}
+	return bucket;
+}
+
+static void pg_log_slow_count(PgLogSlowCounters *counters, double ms, const Datum *values, const bool *nulls)
+{
+	if (counters->calls == 0 || ms < counters->min_ms)
+		counters->min_ms = ms;
+	if (counters->calls == 0 || ms > counters->max_ms)
+		counters->max_ms = ms;
+	counters->calls++;
+	counters->total_ms += ms;
+	if (!nulls[PG_LOG_COL_LOG_TIME])
+	{
+		TimestampTz	log_time = DatumGetTimestampTz(values[PG_LOG_COL_LOG_TIME]);
+
+		if (!counters->has_time || log_time < counters->first_seen)
+			counters->first_seen = log_time;
+		if (!counters->has_time || log_time > counters->last_seen)
+			counters->last_seen = log_time;
+		counters->has_time = true;
+	}
+}
+
+/* normalized statement, shown for all statements of fingerprint */
+static text *pg_log_slow_statement(PgLogSlowStats *stats, const char *statement, int len)
+{
+	text	*result = (text *) MemoryContextAlloc(stats->context, 2 * len + 1 + VARHDRSZ);
+
+	SET_VARSIZE(result, pg_log_normalize(statement, len, VARDATA(result)) + VARHDRSZ);
+	return result;
+}
+
+/*
+ * auto_explain entry: first plan of each fingerprint and shape is kept
+ */
+static void pg_log_plan_add(PgLogSlowStats *stats, double ms, const char *json, int len, const Datum *values,
+			    const bool *nulls)
+{
+	PgLogPlanKey	key;
+	PgLogPlanEntry	*entry;
+	Jsonb		*plan;
+	bool		found;
+
+	/* fingerprint of "Query Text" */
+	if (nulls[PG_LOG_COL_FINGERPRINT])
+		return;
+
+	plan = pg_log_plan_parse(json, len, &key.shape);
+	if (plan == NULL)
+		return;
+
+	key.fingerprint = (uint64) DatumGetInt64(values[PG_LOG_COL_FINGERPRINT]);
+	entry = (PgLogPlanEntry *) hash_search(stats->plans, &key, HASH_ENTER, &found);
+	if (!found)
+	{
+		text	*query = pg_log_plan_query_text(json, len);
+
+		memset(&entry->counters, 0, sizeof(PgLogSlowCounters));
+		entry->plan = (Jsonb *) MemoryContextAlloc(stats->context, VARSIZE(plan));
+		memcpy(entry->plan, plan, VARSIZE(plan));
+		entry->statement = pg_log_slow_statement(stats, VARDATA_ANY(query), VARSIZE_ANY_EXHDR(query));
+		pfree(query);
+	}
+	pfree(plan);
+
+	pg_log_slow_count(&entry->counters, ms, values, nulls);
+}
+
+/*
+ * add log entry columns to statistics if it is a "duration:" entry
+ */
+void pg_log_slow_add(PgLogSlowStats *stats, const Datum *values, const bool *nulls)
+{
+	text		*message;
+	text		*severity;
+	double		ms;
+	const char	*kind;
+	int		kind_len;
+	const char	*statement;
+	int		statement_len;
+	uint64		fingerprint;
+	PgLogSlowEntry	*entry;
+	bool		found;
+
+	if (stats->statements == NULL || nulls[PG_LOG_COL_MESSAGE] || nulls[PG_LOG_COL_SEVERITY])
+		return;
+
+	severity = DatumGetTextPP(values[PG_LOG_COL_SEVERITY]);
+	if (VARSIZE_ANY_EXHDR(severity) != 3 || memcmp(VARDATA_ANY(severity), "LOG", 3) != 0)
+		return;
+
+	message = DatumGetTextPP(values[PG_LOG_COL_MESSAGE]);
+	if (!pg_log_parse_duration(VARDATA_ANY(message), VARSIZE_ANY_EXHDR(message), &ms, &kind, &kind_len,
+				   &statement, &statement_len))
+		return;
+
+	if (kind_len == 4 && memcmp(kind, "plan", 4) == 0)
+	{
+		pg_log_plan_add(stats, ms, statement, statement_len, values, nulls);
+		return;
+	}
+
+	if (!nulls[PG_LOG_COL_FINGERPRINT])
+		fingerprint = (uint64) DatumGetInt64(values[PG_LOG_COL_FINGERPRINT]);
+	else
+		fingerprint = pg_log_fingerprint(statement, statement_len);
+	entry = (PgLogSlowEntry *) hash_search(stats->statements, &fingerprint, HASH_ENTER, &found);
+	if (!found)
+	{
+		memset((char *) entry + sizeof(uint64), 0, sizeof(PgLogSlowEntry) - sizeof(uint64));
+		memcpy(entry->kind, kind, kind_len);
+		entry->statement = pg_log_slow_statement(stats, statement, statement_len);
+	}
+
+	pg_log_slow_count(&entry->counters, ms, values, nulls);
+	entry->histogram[pg_log_slow_bucket(ms)]++;
+}
+
+/*
+ * statement parameters $1 to $9 of counters
+ */
+static void pg_log_slow_counter_values(const PgLogSlowCounters *counters, Datum *values, char *nulls)
+{
+	values[3] = Int64GetDatum(counters->calls);
+	values[4] = Float8GetDatum(counters->total_ms);
+	values[5] = Float8GetDatum(counters->min_ms);
+	values[6] = Float8GetDatum(counters->max_ms);
+	values[7] = TimestampTzGetDatum(counters->first_seen);
+	values[8] = TimestampTzGetDatum(counters->last_seen);
+	nulls[7] = nulls[8] = counters->has_time ? ' ' : 'n';
+}
+
+static void pg_log_slow_execute(SPIPlanPtr plan, Datum *values, char *nulls, const char *table)
+{
+	int	ret_code = SPI_execute_plan(plan, values, nulls, false, 0);
+
+	if (ret_code != SPI_OK_INSERT)
+		elog(ERROR, "pg_log: INSERT INTO %s failed: %d", table, ret_code);
+}
+
+static SPIPlanPtr pg_log_slow_prepare(const char *sql, Oid *argtypes, const char *table)
+{
+	SPIPlanPtr	plan = SPI_prepare(sql, 10, argtypes);
+
+	if (plan == NULL)
+		elog(ERROR, "pg_log: SPI_prepare failed for INSERT INTO %s", table);
+	return plan;
+}
+
+/*
+ * merge statistics of refresh into pglog_slow_queries and pglog_plans
+ */
+void pg_log_slow_end(PgLogSlowStats *stats)
+{
+	Oid		argtypes[10] = { INT8OID, TEXTOID, TEXTOID, INT8OID, FLOAT8OID, FLOAT8OID, FLOAT8OID,
+					 TIMESTAMPTZOID, TIMESTAMPTZOID, INT8ARRAYOID };
+	HASH_SEQ_STATUS	hash_seq;
+	PgLogSlowEntry	*entry;
+	PgLogPlanEntry	*plan_entry;
+	SPIPlanPtr	plan = NULL;
+	Datum		values[10];
+	char		nulls[10];
+	int		nstatements = 0;
+	int		nplans = 0;
+
+	if (stats->statements == NULL)
+		return;
+
+	memset(nulls, ' ', sizeof(nulls));
+	hash_seq_init(&hash_seq, stats->statements);
+	while ((entry = (PgLogSlowEntry *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		Datum	buckets[PG_LOG_SLOW_NBUCKETS];
+		int	i;
+
+		if (plan == NULL)
+			plan = pg_log_slow_prepare(pg_log_slow_upsert, argtypes, "pglog_slow_queries");
+
+		for (i = 0; i < PG_LOG_SLOW_NBUCKETS; i++)
+			buckets[i] = Int64GetDatum(entry->histogram[i]);
+
+		values[0] = Int64GetDatum((int64) entry->fingerprint);
+		values[1] = CStringGetTextDatum(entry->kind);
+		values[2] = PointerGetDatum(entry->statement);
+		pg_log_slow_counter_values(&entry->counters, values, nulls);
+		values[9] = PointerGetDatum(construct_array(buckets, PG_LOG_SLOW_NBUCKETS, INT8OID, 8, FLOAT8PASSBYVAL, 'd'));
+		pg_log_slow_execute(plan, values, nulls, "pglog_slow_queries");
+		nstatements++;
+	}
+	if (plan != NULL)
+		SPI_freeplan(plan);
+
+	plan = NULL;
+	argtypes[1] = INT8OID;
+	argtypes[9] = JSONBOID;
+	hash_seq_init(&hash_seq, stats->plans);
+	while ((plan_entry = (PgLogPlanEntry *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (plan == NULL)
+			plan = pg_log_slow_prepare(pg_log_plan_upsert, argtypes, "pglog_plans");
+
+		values[0] = Int64GetDatum((int64) plan_entry->key.fingerprint);
+		values[1] = Int64GetDatum((int64) plan_entry->key.shape);
+		values[2] = PointerGetDatum(plan_entry->statement);
+		pg_log_slow_counter_values(&plan_entry->counters, values, nulls);
+		values[9] = PointerGetDatum(plan_entry->plan);
+		pg_log_slow_execute(plan, values, nulls, "pglog_plans");
+		nplans++;
+	}
+	if (plan != NULL)
+		SPI_freeplan(plan);
+
+	MemoryContextDelete(stats->context);
+	stats->statements = NULL;
+	stats->plans = NULL;
+
+	if (nstatements > 0 || nplans > 0)
+		elog(DEBUG1, "pg_log: merged statistics of %d slow statements and %d plans", nstatements, nplans);
+}
@@ -0,0 +1,744 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_log_source.c
+ *	  log sources and table writer.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (c) 2022, Pierre Forstmann.
+ *
+ *-------------------------------------------------------------------------
+*/
+#include "postgres.h"
+
+#include "executor/spi.h"
+#include "fmgr.h"
+#include "pgstat.h"
+#include "storage/fd.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fnmatch.h>
+
+#if PG_VERSION_NUM < 130000
+#include "catalog/pg_type.h"
+#endif
+
+#include "pg_log.h"
+
+/*
+ * log sources
+ *
+ * Each enabled row of pg_log_sources is a log file tailed incrementally:
+ * only complete lines written since previous refresh are read, by chunks,
+ * and inserted in the target table by batches. Read position is saved in
+ * the same row so that it survives worker restarts.
+ *
+ * Row with NULL path is PostgreSQL server log: its current file is the last
+ * modified file in log_directory.
+ */
+
+typedef struct
+{
+	char		*name;
+	/* file path, glob pattern allowed in last component */
+	char		*path;
+	char		*format;
+	/* glob pattern of renamed files for fixed path sources */
+	char		*rotation_pattern;
+	char		*target_table;
+	/* parser plugin library, NULL for (id, message) rows */
+	char		*parser;
+	/* truncate target table when a new file is started */
+	bool		reset_on_rotation;
+	/* read position */
+	char		*file;
+	int64		inode;
+	int64		offset;
+	int64		line;
+	/* incremented each time lines are numbered from the start again */
+	int64		file_number;
+} PgLogSource;
+
+/*
+ * loaded parser plugin
+ */
+struct PgLogParserEntry
+{
+	char		*name;
+	const PgLogParser *parser;
+	Oid		*array_types;
+	int16		*typlen;
+	bool		*typbyval;
+	char		*typalign;
+};
+
+static List *g_parsers = NIL;
+
+/*
+ * load parser plugin given as "library" or "library:function", plugins stay
+ * loaded for the life of the process
+ */
+static PgLogParserEntry *pg_log_load_parser(const char *name)
+{
+	ListCell	*lc;
+	PgLogParserEntry *entry;
+	const PgLogParser *parser;
+	pg_log_parser_init_function init;
+	MemoryContext	oldcontext;
+	char		*library;
+	char		*function;
+	char		*colon;
+	int		i;
+
+	foreach(lc, g_parsers)
+	{
+		entry = (PgLogParserEntry *) lfirst(lc);
+		if (strcmp(entry->name, name) == 0)
+			return entry;
+	}
+
+	library = pstrdup(name);
+	colon = strchr(library, ':');
+	if (colon != NULL)
+	{
+		*colon = '\0';
+		function = colon + 1;
+	}
+	else
+		function = PG_LOG_PARSER_INIT_FUNCTION;
+
+	init = (pg_log_parser_init_function) load_external_function(library, function, true, NULL);
+	parser = init();
+	if (parser == NULL || parser->abi_version != PG_LOG_PARSER_ABI_VERSION)
+		elog(ERROR, "pg_log: parser %s has incompatible ABI version", name);
+	if (parser->ncolumns <= 0 || parser->columns == NULL || parser->parse_batch == NULL)
+		elog(ERROR, "pg_log: parser %s is not valid", name);
+
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+	entry = palloc0(sizeof(PgLogParserEntry));
+	entry->name = pstrdup(name);
+	entry->parser = parser;
+	entry->array_types = palloc(sizeof(Oid) * parser->ncolumns);
+	entry->typlen = palloc(sizeof(int16) * parser->ncolumns);
+	entry->typbyval = palloc(sizeof(bool) * parser->ncolumns);
+	entry->typalign = palloc(sizeof(char) * parser->ncolumns);
+	for (i = 0; i < parser->ncolumns; i++)
+	{
+		entry->array_types[i] = get_array_type(parser->columns[i].type);
+		if (entry->array_types[i] == InvalidOid)
+			elog(ERROR, "pg_log: parser %s column %s has no array type", name, parser->columns[i].name);
+		get_typlenbyvalalign(parser->columns[i].type, &entry->typlen[i], &entry->typbyval[i], &entry->typalign[i]);
+	}
+	g_parsers = lappend(g_parsers, entry);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	elog(DEBUG1, "pg_log: loaded parser %s from %s", parser->name, name);
+
+	return entry;
+}
+
+void pg_log_writer_begin(PgLogWriter *writer, const char *target_table, const char *parser, PgLogFormat format)
+{
+	Oid		argtypes[1 + PG_LOG_NCOLUMNS];
+	int		i;
+
+	argtypes[0] = INT8ARRAYOID;
+	argtypes[1] = TEXTARRAYOID;
+
+	memset(writer, 0, sizeof(PgLogWriter));
+	writer->target_table = target_table;
+	writer->format = format;
+	if (parser != NULL)
+	{
+		StringInfoData	buf;
+
+		writer->parser = pg_log_load_parser(parser);
+
+		initStringInfo(&buf);
+		appendStringInfo(&buf, "insert into %s(", target_table);
+		for (i = 0; i < writer->parser->parser->ncolumns; i++)
+			appendStringInfo(&buf, "%s%s", i > 0 ? ", " : "", quote_identifier(writer->parser->parser->columns[i].name));
+		appendStringInfoString(&buf, ") select * from unnest(");
+		for (i = 0; i < writer->parser->parser->ncolumns; i++)
+			appendStringInfo(&buf, "%s$%d", i > 0 ? ", " : "", i + 1);
+		appendStringInfoChar(&buf, ')');
+
+		writer->insert = buf.data;
+		writer->plan = SPI_prepare(writer->insert, writer->parser->parser->ncolumns, writer->parser->array_types);
+	}
+	else if (format != PG_LOG_FORMAT_LINES)
+	{
+		StringInfoData	buf;
+
+		initStringInfo(&buf);
+		appendStringInfo(&buf, "insert into %s(id", target_table);
+		for (i = 0; i < PG_LOG_NCOLUMNS; i++)
+		{
+			int	dimension = pg_log_columns[i].dimension;
+
+			if (dimension >= 0)
+			{
+				appendStringInfo(&buf, ", %s", pg_log_dimensions[dimension].id_column);
+				argtypes[1 + i] = INT4ARRAYOID;
+			}
+			else
+			{
+				appendStringInfo(&buf, ", %s", pg_log_columns[i].name);
+				argtypes[1 + i] = get_array_type(pg_log_columns[i].type);
+			}
+		}
+		appendStringInfoString(&buf, ") select * from unnest($1");
+		for (i = 0; i < PG_LOG_NCOLUMNS; i++)
+			appendStringInfo(&buf, ", $%d", i + 2);
+		appendStringInfoChar(&buf, ')');
+
+		writer->insert = buf.data;
+		writer->plan = SPI_prepare(writer->insert, lengthof(argtypes), argtypes);
+		pg_log_dict_begin(&writer->dict);
+		pg_log_slow_begin(&writer->slow);
+		pg_log_events_begin(&writer->events, target_table);
+		pg_log_template_begin(&writer->templates);
+	}
+	else
+	{
+		writer->insert = psprintf("insert into %s(id, message) select * from unnest($1, $2)", target_table);
+		writer->plan = SPI_prepare(writer->insert, 2, argtypes);
+	}
+	if (writer->plan == NULL)
+		elog(ERROR, "pg_log: SPI_prepare failed for INSERT INTO %s", target_table);
+	writer->batch_context = AllocSetContextCreate(CurrentMemoryContext,
+						      "pg_log batch",
+						      ALLOCSET_DEFAULT_SIZES);
+}
+
+/*
+ * run parser plugin on batch lines and build one array per column
+ */
+static int pg_log_writer_parse(PgLogWriter *writer, PgLogBatch *batch, Datum *values)
+{
+	const PgLogParser *parser = writer->parser->parser;
+	PgLogParserOutput output;
+	int		nrows;
+	int		dims[1];
+	int		lbs[1];
+	int		i;
+
+	output.ncolumns = parser->ncolumns;
+	output.capacity = PG_LOG_BATCH_SIZE;
+	output.values = palloc(sizeof(Datum *) * parser->ncolumns);
+	output.nulls = palloc(sizeof(bool *) * parser->ncolumns);
+	for (i = 0; i < parser->ncolumns; i++)
+	{
+		output.values[i] = palloc(sizeof(Datum) * PG_LOG_BATCH_SIZE);
+		output.nulls[i] = palloc0(sizeof(bool) * PG_LOG_BATCH_SIZE);
+	}
+
+	nrows = parser->parse_batch(batch->lines, batch->nlines, &output);
+	if (nrows < 0 || nrows > PG_LOG_BATCH_SIZE)
+		elog(ERROR, "pg_log: parser %s returned %d rows", writer->parser->name, nrows);
+
+	dims[0] = nrows;
+	lbs[0] = 1;
+	for (i = 0; i < parser->ncolumns; i++)
+		values[i] = PointerGetDatum(construct_md_array(output.values[i], output.nulls[i], 1, dims, lbs,
+							       parser->columns[i].type,
+							       writer->parser->typlen[i],
+							       writer->parser->typbyval[i],
+							       writer->parser->typalign[i]));
+
+	return nrows;
+}
+
+/*
+ * build one array per log entry column
+ */
+static void pg_log_writer_records(PgLogWriter *writer, PgLogBatch *batch, Datum *values)
+{
+	const PgLogPrefix *prefix = pg_log_get_prefix();
+	int		dims[1];
+	int		lbs[1];
+	Datum		*ids = palloc(sizeof(Datum) * batch->nlines);
+	Datum		*columns[PG_LOG_NCOLUMNS];
+	bool		*nulls[PG_LOG_NCOLUMNS];
+	Datum		row[PG_LOG_NCOLUMNS];
+	bool		row_nulls[PG_LOG_NCOLUMNS];
+	int		i;
+	int		j;
+
+	for (j = 0; j < PG_LOG_NCOLUMNS; j++)
+	{
+		columns[j] = palloc(sizeof(Datum) * batch->nlines);
+		nulls[j] = palloc(sizeof(bool) * batch->nlines);
+	}
+
+	for (i = 0; i < batch->nlines; i++)
+	{
+		ids[i] = Int64GetDatum(batch->lines[i].lineno);
+		if (writer->format == PG_LOG_FORMAT_CSVLOG)
+			pg_log_csv_record_values(&batch->lines[i], row, row_nulls);
+		else if (writer->format == PG_LOG_FORMAT_JSONLOG)
+			pg_log_json_record_values(&batch->lines[i], row, row_nulls);
+		else
+			pg_log_record_values(prefix, &batch->lines[i], &batch->records[i], &batch->matches[i], row, row_nulls);
+		pg_log_slow_add(&writer->slow, row, row_nulls);
+		pg_log_events_add(&writer->events, row, row_nulls);
+		pg_log_template_add(&writer->templates, row, row_nulls);
+		for (j = 0; j < PG_LOG_NCOLUMNS; j++)
+		{
+			int	dimension = pg_log_columns[j].dimension;
+
+			if (dimension >= 0 && !row_nulls[j])
+				row[j] = Int32GetDatum(pg_log_dict_intern(&writer->dict, dimension, DatumGetTextPP(row[j])));
+			columns[j][i] = row[j];
+			nulls[j][i] = row_nulls[j];
+		}
+	}
+
+	dims[0] = batch->nlines;
+	lbs[0] = 1;
+	values[0] = PointerGetDatum(construct_array(ids, batch->nlines, INT8OID, 8, FLOAT8PASSBYVAL, 'd'));
+	for (j = 0; j < PG_LOG_NCOLUMNS; j++)
+	{
+		Oid	type = (pg_log_columns[j].dimension >= 0) ? INT4OID : pg_log_columns[j].type;
+		int16	typlen;
+		bool	typbyval;
+		char	typalign;
+
+		get_typlenbyvalalign(type, &typlen, &typbyval, &typalign);
+		values[1 + j] = PointerGetDatum(construct_md_array(columns[j], nulls[j], 1, dims, lbs,
+								   type, typlen, typbyval, typalign));
+	}
+}
+
+/*
+ * sink stage: insert batch with a single INSERT ... SELECT FROM unnest()
+ */
+void pg_log_writer_write(PgLogWriter *writer, PgLogBatch *batch)
+{
+	MemoryContext	oldcontext;
+	Datum		*values;
+	int		nrows;
+	int		ret_code;
+	int		i;
+
+	oldcontext = MemoryContextSwitchTo(writer->batch_context);
+	if (writer->parser != NULL)
+	{
+		values = palloc(sizeof(Datum) * writer->parser->parser->ncolumns);
+		nrows = pg_log_writer_parse(writer, batch, values);
+	}
+	else if (writer->format != PG_LOG_FORMAT_LINES)
+	{
+		values = palloc(sizeof(Datum) * (1 + PG_LOG_NCOLUMNS));
+		pg_log_writer_records(writer, batch, values);
+		nrows = batch->nlines;
+	}
+	else
+	{
+		Datum	*ids = palloc(sizeof(Datum) * batch->nlines);
+		Datum	*messages = palloc(sizeof(Datum) * batch->nlines);
+
+		for (i = 0; i < batch->nlines; i++)
+		{
+			ids[i] = Int64GetDatum(batch->lines[i].lineno);
+			messages[i] = PointerGetDatum(cstring_to_text_with_len(batch->lines[i].data, batch->lines[i].len));
+		}
+		values = palloc(sizeof(Datum) * 2);
+		values[0] = PointerGetDatum(construct_array(ids, batch->nlines, INT8OID, 8, FLOAT8PASSBYVAL, 'd'));
+		values[1] = PointerGetDatum(construct_array(messages, batch->nlines, TEXTOID, -1, false, 'i'));
+		nrows = batch->nlines;
+	}
+	MemoryContextSwitchTo(oldcontext);
+
+	if (nrows > 0)
+	{
+		pgstat_report_activity(STATE_RUNNING, writer->insert);
+		ret_code = SPI_execute_plan(writer->plan, values, NULL, false, 0);
+		pgstat_report_activity(STATE_IDLE, NULL);
+
+		if (ret_code != SPI_OK_INSERT)
+			elog(ERROR, "pg_log: INSERT INTO %s failed", writer->target_table);
+		if (SPI_processed != nrows)
+			elog(ERROR, "pg_log: INSERT INTO %s did not process %d rows", writer->target_table, nrows);
+	}
+
+	/* event rows point into batch memory */
+	oldcontext = MemoryContextSwitchTo(writer->batch_context);
+	pg_log_events_flush(&writer->events);
+	MemoryContextSwitchTo(oldcontext);
+
+	if (writer->routes != NULL)
+		for (i = 0; i < batch->nlines; i++)
+			pg_log_route_line(writer->routes, writer->routing_context, &batch->lines[i], &batch->matches[i]);
+
+	MemoryContextReset(writer->batch_context);
+}
+
+void pg_log_writer_end(PgLogWriter *writer)
+{
+	pg_log_slow_end(&writer->slow);
+	pg_log_events_end(&writer->events);
+	pg_log_template_end(&writer->templates);
+	SPI_freeplan(writer->plan);
+	MemoryContextDelete(writer->batch_context);
+	pfree(writer->insert);
+}
+
+/*
+ * load enabled sources, rows are locked until end of transaction
+ */
+static List *pg_log_load_sources()
+{
+	List		*sources = NIL;
+	int		ret_code;
+	uint64		i;
+
+	ret_code = SPI_execute("select name, path, format, rotation_pattern, target_table::text, reset_on_rotation, "
+			       "current_file, current_inode, current_offset, current_line, parser, current_file_number "
+			       "from pg_log_sources where enabled order by name for update skip locked", false, 0);
+	if (ret_code != SPI_OK_SELECT)
+		elog(ERROR, "pg_log: SELECT FROM pg_log_sources failed");
+
+	for (i = 0; i < SPI_processed; i++)
+	{
+		HeapTuple	tuple = SPI_tuptable->vals[i];
+		TupleDesc	tupdesc = SPI_tuptable->tupdesc;
+		PgLogSource	*source = palloc0(sizeof(PgLogSource));
+		bool		isnull;
+		Datum		value;
+
+		source->name = SPI_getvalue(tuple, tupdesc, 1);
+		source->path = SPI_getvalue(tuple, tupdesc, 2);
+		source->format = SPI_getvalue(tuple, tupdesc, 3);
+		source->rotation_pattern = SPI_getvalue(tuple, tupdesc, 4);
+		source->target_table = SPI_getvalue(tuple, tupdesc, 5);
+		value = SPI_getbinval(tuple, tupdesc, 6, &isnull);
+		source->reset_on_rotation = !isnull && DatumGetBool(value);
+		source->file = SPI_getvalue(tuple, tupdesc, 7);
+		value = SPI_getbinval(tuple, tupdesc, 8, &isnull);
+		source->inode = isnull ? 0 : DatumGetInt64(value);
+		value = SPI_getbinval(tuple, tupdesc, 9, &isnull);
+		source->offset = isnull ? 0 : DatumGetInt64(value);
+		value = SPI_getbinval(tuple, tupdesc, 10, &isnull);
+		source->line = isnull ? 0 : DatumGetInt64(value);
+		source->parser = SPI_getvalue(tuple, tupdesc, 11);
+		value = SPI_getbinval(tuple, tupdesc, 12, &isnull);
+		source->file_number = isnull ? 0 : DatumGetInt64(value);
+
+		if (strcmp(source->format, "stderr") != 0 && strcmp(source->format, "csvlog") != 0 &&
+		    strcmp(source->format, "jsonlog") != 0 && strcmp(source->format, "lines") != 0)
+		{
+			elog(WARNING, "pg_log: source %s has unsupported format %s", source->name, source->format);
+			continue;
+		}
+		sources = lappend(sources, source);
+	}
+
+	return sources;
+}
+
+static void pg_log_save_source(PgLogSource *source)
+{
+	Oid		argtypes[6] = { TEXTOID, TEXTOID, INT8OID, INT8OID, INT8OID, INT8OID };
+	Datum		values[6];
+	int		ret_code;
+
+	values[0] = CStringGetTextDatum(source->name);
+	values[1] = CStringGetTextDatum(source->file);
+	values[2] = Int64GetDatum(source->inode);
+	values[3] = Int64GetDatum(source->offset);
+	values[4] = Int64GetDatum(source->line);
+	values[5] = Int64GetDatum(source->file_number);
+
+	ret_code = SPI_execute_with_args("update pg_log_sources set current_file = $2, current_inode = $3, "
+					 "current_offset = $4, current_line = $5, current_file_number = $6 where name = $1",
+					 6, argtypes, values, NULL, false, 0);
+	if (ret_code != SPI_OK_UPDATE)
+		elog(ERROR, "pg_log: UPDATE pg_log_sources failed");
+}
+
+static void pg_log_split_path(const char *path, char **directory, char **pattern)
+{
+	const char	*slash = strrchr(path, '/');
+
+	if (slash == NULL)
+	{
+		*directory = pstrdup(".");
+		*pattern = pstrdup(path);
+	}
+	else
+	{
+		*directory = pnstrdup(path, slash == path ? 1 : slash - path);
+		*pattern = pstrdup(slash + 1);
+	}
+}
+
+/*
+ * last modified file matching path glob pattern, or file with given inode
+ * if inode is not 0
+ */
+static char *pg_log_match_file(const char *path, int64 inode)
+{
+	char		*directory;
+	char		*pattern;
+	DIR		*dir;
+	struct dirent	*de;
+	char		*found = NULL;
+	time_t		found_mtime = 0;
+
+	pg_log_split_path(path, &directory, &pattern);
+
+	dir = AllocateDir(directory);
+	if (dir == NULL)
+		return NULL;
+
+	while ((de = ReadDir(dir, directory)) != NULL)
+	{
+		char		*file;
+		struct stat	stat_buf;
+
+		if (fnmatch(pattern, de->d_name, 0) != 0)
+			continue;
+
+		file = psprintf("%s/%s", directory, de->d_name);
+		if (stat(file, &stat_buf) != 0 || !S_ISREG(stat_buf.st_mode))
+		{
+			pfree(file);
+			continue;
+		}
+
+		if (inode != 0 ? (int64) stat_buf.st_ino == inode :
+		    (found == NULL || stat_buf.st_mtime > found_mtime ||
+		     (stat_buf.st_mtime == found_mtime && strcmp(file, found) > 0)))
+		{
+			found = file;
+			found_mtime = stat_buf.st_mtime;
+			if (inode != 0)
+				break;
+		}
+		else
+			pfree(file);
+	}
+	FreeDir(dir);
+
+	return found;
+}
+
+static char *pg_log_current_file(PgLogSource *source)
+{
+	if (source->path == NULL)
+		return pg_log_server_file();
+
+	if (strpbrk(source->path, "*?[") != NULL)
+		return pg_log_match_file(source->path, 0);
+
+	return pstrdup(source->path);
+}
+
+/*
+ * read complete lines of file from source offset to end of file
+ *
+ * If align is true, data up to first newline is a broken line and skipped.
+ * If tail is true, file may still be written and its last log entry is
+ * read with the next lines. With per-database routing, lines of file are dispatched to the sinks
+ * before returning, reset tells sinks to truncate their pglog table.
+ */
+static bool pg_log_read_file(PgLogSource *source, const char *file, bool align, bool tail, bool reset,
+			     PgLogWriter *writer)
+{
+	PgLogPipeline	*pipeline;
+	PgLogBatch	*batch;
+	int		flags = 0;
+
+	if (writer->routing_context != NULL)
+		writer->routes = pg_log_create_routes(writer->routing_context);
+
+	if (align)
+		flags |= PG_LOG_PIPELINE_ALIGN;
+	if (tail)
+		flags |= PG_LOG_PIPELINE_TAIL;
+	if (writer->format == PG_LOG_FORMAT_STDERR)
+		flags |= PG_LOG_PIPELINE_GROUP;
+	else if (writer->format == PG_LOG_FORMAT_CSVLOG)
+		flags |= PG_LOG_PIPELINE_CSV;
+	else if (writer->routes != NULL)
+		flags |= PG_LOG_PIPELINE_PARSE_PREFIX;
+
+	pipeline = pg_log_pipeline_begin(file, source->offset, source->line, flags);
+	if (pipeline != NULL)
+	{
+		while ((batch = pg_log_pipeline_next(pipeline)) != NULL)
+			pg_log_writer_write(writer, batch);
+
+		source->offset = pipeline->offset;
+		source->line = pipeline->lineno;
+		pg_log_pipeline_end(pipeline);
+
+		if (writer->routes != NULL)
+			pg_log_dispatch_routes(writer->routes, source->file_number, reset);
+	}
+
+	if (writer->routes != NULL)
+	{
+		MemoryContextReset(writer->routing_context);
+		writer->routes = NULL;
+	}
+
+	return pipeline != NULL;
+}
+
+/*
+ * file of source before rotation: same path if not renamed, otherwise
+ * file matching rotation_pattern with the same inode
+ */
+static char *pg_log_rotated_file(PgLogSource *source)
+{
+	struct stat	stat_buf;
+
+	if (stat(source->file, &stat_buf) == 0 && (int64) stat_buf.st_ino == source->inode)
+		return source->file;
+
+	if (source->rotation_pattern != NULL)
+		return pg_log_match_file(source->rotation_pattern, source->inode);
+
+	return NULL;
+}
+
+void pg_log_truncate(const char *target_table)
+{
+	char	*truncate = psprintf("truncate table %s", target_table);
+
+	pgstat_report_activity(STATE_RUNNING, truncate);
+	if (SPI_execute(truncate, false, 0) != SPI_OK_UTILITY)
+		elog(ERROR, "pg_log: TRUNCATE %s failed", target_table);
+	pgstat_report_activity(STATE_IDLE, NULL);
+	pfree(truncate);
+}
+
+/*
+ * row format of source, parser plugins get lines
+ */
+static PgLogFormat pg_log_source_format(PgLogSource *source)
+{
+	if (source->parser != NULL || strcmp(source->format, "lines") == 0)
+		return PG_LOG_FORMAT_LINES;
+	if (strcmp(source->format, "csvlog") == 0)
+		return PG_LOG_FORMAT_CSVLOG;
+	if (strcmp(source->format, "jsonlog") == 0)
+		return PG_LOG_FORMAT_JSONLOG;
+	return PG_LOG_FORMAT_STDERR;
+}
+
+static void pg_log_ingest_source(PgLogSource *source)
+{
+	PgLogWriter	writer;
+	char		*file;
+	struct stat	stat_buf;
+	bool		reset = false;
+	bool		align = false;
+
+	file = pg_log_current_file(source);
+	if (file == NULL || stat(file, &stat_buf) != 0)
+	{
+		elog(DEBUG1, "pg_log: source %s has no current file", source->name);
+		return;
+	}
+
+	pg_log_writer_begin(&writer, source->target_table, source->parser, pg_log_source_format(source));
+
+	/* lines of previous file are routed too */
+	if (source->path == NULL && pg_log_route_by_database &&
+	    (writer.format == PG_LOG_FORMAT_STDERR || writer.format == PG_LOG_FORMAT_LINES) &&
+	    writer.parser == NULL)
+		writer.routing_context = AllocSetContextCreate(CurrentMemoryContext,
+							       "pg_log routing",
+							       ALLOCSET_DEFAULT_SIZES);
+
+	if (source->file == NULL)
+	{
+		/*
+		 * first refresh: server log starts with last lines corresponding to
+		 * pg_log.fraction, other sources with the whole file
+		 */
+		if (source->path == NULL && pg_log_fraction != 1)
+		{
+			source->offset = stat_buf.st_size * (1 - pg_log_fraction);
+			align = source->offset > 0;
+		}
+		else
+			source->offset = 0;
+		source->line = 0;
+		source->file_number++;
+		reset = source->reset_on_rotation;
+	}
+	else if (strcmp(file, source->file) != 0 || (int64) stat_buf.st_ino != source->inode)
+	{
+		/* rotation: finish previous file unless target table is reset */
+		if (!source->reset_on_rotation)
+		{
+			char	*previous = pg_log_rotated_file(source);
+
+			if (previous != NULL)
+				pg_log_read_file(source, previous, false, false, false, &writer);
+			else
+				elog(WARNING, "pg_log: source %s lost end of file %s", source->name, source->file);
+		}
+		source->offset = 0;
+		source->line = 0;
+		source->file_number++;
+		reset = source->reset_on_rotation;
+	}
+	else if (stat_buf.st_size < source->offset)
+	{
+		/* truncated in place: lines are numbered again like a new file */
+		source->offset = 0;
+		source->line = 0;
+		source->file_number++;
+	}
+
+	source->file = file;
+	source->inode = (int64) stat_buf.st_ino;
+
+	if (reset)
+		pg_log_truncate(source->target_table);
+
+	pg_log_read_file(source, file, align, true, reset, &writer);
+	pg_log_writer_end(&writer);
+
+	if (writer.routing_context != NULL)
+		MemoryContextDelete(writer.routing_context);
+
+	elog(DEBUG1, "pg_log: source %s read up to line " INT64_FORMAT " of %s", source->name, source->line, source->file);
+}
+
+/*
+ * read new lines of all enabled sources
+ */
+void pg_log_refresh_sources()
+{
+	List		*sources;
+	ListCell	*lc;
+
+	SPI_connect();
+
+	sources = pg_log_load_sources();
+	foreach(lc, sources)
+	{
+		PgLogSource	*source = (PgLogSource *) lfirst(lc);
+
+		pg_log_ingest_source(source);
+		pg_log_save_source(source);
+		if (source->path == NULL && source->file != NULL)
+			pg_log_sync_set_position(source->file, source->offset);
+	}
+
+	SPI_finish();
+}
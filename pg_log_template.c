@@ -0,0 +1,767 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_log_template.c
+ *	  message templates mined online, like Drain.
+ *
+ * Messages are split into space separated tokens and tokens with a digit
+ * are replaced with <*>. Messages with the same number of tokens and the
+ * same first two tokens make a group, a group has up to 16 templates:
+ * a message joins the template with most equal tokens if at least 40% of
+ * its tokens are equal, and tokens of the template which differ become
+ * <*>. Otherwise the message starts a new template.
+ *
+ * Groups and templates are kept in shared memory so that the worker and
+ * backends running pg_log_refresh() give the same template ids, with
+ * entries, first and last log time of each template. Counts of a refresh
+ * are merged into pglog_templates and pglog_template_hourly and published
+ * in shared memory at commit, like dimension ids: counts merged by a
+ * subtransaction which aborted or by a prepared transaction are not
+ * published. Templates are loaded from pglog_templates by the first
+ * refresh after server start.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (c) 2022, Pierre Forstmann.
+ *
+ *-------------------------------------------------------------------------
+*/
+#include "postgres.h"
+
+#include "access/xact.h"
+#include "catalog/pg_type.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+
+#include "pg_log.h"
+
+/* maximum number of templates and groups kept in shared memory */
+#define PG_LOG_TEMPLATE_SIZE		8192
+#define PG_LOG_TEMPLATE_NGROUPS		4096
+#define PG_LOG_TEMPLATE_GROUP_SIZE	16
+/* tokens after the first 64 ones are ignored */
+#define PG_LOG_TEMPLATE_MAX_TOKENS	64
+#define PG_LOG_TEMPLATE_LEN		512
+#define PG_LOG_TEMPLATE_SIMILARITY	0.4
+
+#define PG_LOG_TEMPLATE_WILDCARD	"<*>"
+#define PG_LOG_TEMPLATE_WILDCARD_LEN	3
+
+typedef struct
+{
+	Oid		dbid;
+	/* 0 for the entry marking templates of database as loaded */
+	uint64		group;
+} PgLogTemplateGroupKey;
+
+typedef struct
+{
+	PgLogTemplateGroupKey key;
+	int		ntemplates;
+	int64		ids[PG_LOG_TEMPLATE_GROUP_SIZE];
+} PgLogTemplateGroup;
+
+typedef struct
+{
+	Oid		dbid;
+	int64		id;
+} PgLogTemplateKey;
+
+typedef struct
+{
+	PgLogTemplateKey key;
+	int		ntokens;
+	int64		entries;
+	TimestampTz	first_seen;
+	TimestampTz	last_seen;
+	/* tokens separated by a space, last tokens are missing if too long */
+	char		text[PG_LOG_TEMPLATE_LEN];
+} PgLogTemplateEntry;
+
+/* counts of refresh */
+typedef struct
+{
+	int64		id;
+	int		ntokens;
+	int64		entries;
+	TimestampTz	first_seen;
+	TimestampTz	last_seen;
+} PgLogTemplateCounts;
+
+typedef struct
+{
+	PgLogTemplateCounts counts;
+	/* subtransaction which merged the counts */
+	SubTransactionId subid;
+} PgLogTemplatePending;
+
+typedef struct
+{
+	int64		id;
+	TimestampTz	hour;
+} PgLogTemplateHourKey;
+
+typedef struct
+{
+	PgLogTemplateHourKey key;
+	int64		entries;
+} PgLogTemplateHour;
+
+static HTAB *pg_log_template_groups = NULL;
+static HTAB *pg_log_template_hash = NULL;
+static LWLock *pg_log_template_lock = NULL;
+
+/* counts merged in current transaction, published at commit */
+static List *pending = NIL;
+static bool xact_callback_registered = false;
+
+static const char *pg_log_template_upsert =
+	"insert into pglog_templates as t(id, tokens, template, entries, first_seen, last_seen) "
+	"values ($1, $2, $3, $4, $5, $6) "
+	"on conflict (id) do update set "
+	"template = excluded.template, "
+	"entries = t.entries + excluded.entries, "
+	"first_seen = least(t.first_seen, excluded.first_seen), "
+	"last_seen = greatest(t.last_seen, excluded.last_seen)";
+
+static const char *pg_log_template_hour_upsert =
+	"insert into pglog_template_hourly as t(template_id, hour, entries) values ($1, $2, $3) "
+	"on conflict (template_id, hour) do update set entries = t.entries + excluded.entries";
+
+PG_FUNCTION_INFO_V1(pg_log_template_stats);
+
+Size pg_log_template_shmem_size(void)
+{
+	return add_size(hash_estimate_size(PG_LOG_TEMPLATE_NGROUPS, sizeof(PgLogTemplateGroup)),
+			hash_estimate_size(PG_LOG_TEMPLATE_SIZE, sizeof(PgLogTemplateEntry)));
+}
+
+/*
+ * called by shared memory startup hook with AddinShmemInitLock held
+ */
+void pg_log_template_shmem_startup(void)
+{
+	HASHCTL	info;
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(PgLogTemplateGroupKey);
+	info.entrysize = sizeof(PgLogTemplateGroup);
+	pg_log_template_groups = ShmemInitHash("pg_log template groups", PG_LOG_TEMPLATE_NGROUPS,
+					       PG_LOG_TEMPLATE_NGROUPS, &info, HASH_ELEM | HASH_BLOBS);
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(PgLogTemplateKey);
+	info.entrysize = sizeof(PgLogTemplateEntry);
+	pg_log_template_hash = ShmemInitHash("pg_log templates", PG_LOG_TEMPLATE_SIZE, PG_LOG_TEMPLATE_SIZE,
+					     &info, HASH_ELEM | HASH_BLOBS);
+
+	/* third lock of tranche */
+	pg_log_template_lock = &(GetNamedLWLockTranche("pg_log"))[2].lock;
+}
+
+/*
+ * split p into at most PG_LOG_TEMPLATE_MAX_TOKENS tokens, tokens with a
+ * digit are replaced with <*>
+ */
+static int pg_log_template_tokens(const char *p, int len, PgLogSlice *tokens)
+{
+	int	n = 0;
+	int	i = 0;
+
+	while (n < PG_LOG_TEMPLATE_MAX_TOKENS)
+	{
+		int	start;
+		bool	digit = false;
+
+		while (i < len && (p[i] == ' ' || p[i] == '\t' || p[i] == '\n' || p[i] == '\r'))
+			i++;
+		if (i >= len)
+			break;
+		for (start = i; i < len && p[i] != ' ' && p[i] != '\t' && p[i] != '\n' && p[i] != '\r'; i++)
+			if (p[i] >= '0' && p[i] <= '9')
+				digit = true;
+
+		if (digit)
+		{
+			tokens[n].data = PG_LOG_TEMPLATE_WILDCARD;
+			tokens[n].len = PG_LOG_TEMPLATE_WILDCARD_LEN;
+		}
+		else
+		{
+			tokens[n].data = p + start;
+			tokens[n].len = i - start;
+		}
+		n++;
+	}
+	return n;
+}
+
+static bool pg_log_template_wildcard(const PgLogSlice *token)
+{
+	return token->len == PG_LOG_TEMPLATE_WILDCARD_LEN && memcmp(token->data, PG_LOG_TEMPLATE_WILDCARD, 3) == 0;
+}
+
+static bool pg_log_template_equal(const PgLogSlice *a, const PgLogSlice *b)
+{
+	return a->len == b->len && memcmp(a->data, b->data, a->len) == 0;
+}
+
+/*
+ * group of tokens: their number and first two tokens, never 0
+ */
+static uint64 pg_log_template_group(const PgLogSlice *tokens, int n)
+{
+	uint64	group = (uint64) n * UINT64CONST(0x9E3779B97F4A7C15);
+
+	if (n > 0)
+		group ^= pg_log_hash64(tokens[0].data, tokens[0].len);
+	if (n > 1)
+		group ^= pg_log_hash64(tokens[1].data, tokens[1].len) * 31;
+
+	return group != 0 ? group : 1;
+}
+
+/*
+ * write tokens into text, without the last tokens which do not fit
+ */
+static void pg_log_template_text(const PgLogSlice *tokens, int n, char *text)
+{
+	int	len = 0;
+	int	i;
+
+	for (i = 0; i < n; i++)
+	{
+		if (len + (i > 0) + tokens[i].len >= PG_LOG_TEMPLATE_LEN)
+			break;
+		if (i > 0)
+			text[len++] = ' ';
+		memcpy(text + len, tokens[i].data, tokens[i].len);
+		len += tokens[i].len;
+	}
+	text[len] = '\0';
+}
+
+/*
+ * add template entry for tokens in group, called with lock held in
+ * exclusive mode, NULL if hash table is full
+ */
+static PgLogTemplateEntry *pg_log_template_create(PgLogTemplateGroup *group, const PgLogSlice *tokens, int n,
+						  const char *text, int64 id)
+{
+	PgLogTemplateKey	key;
+	PgLogTemplateEntry	*entry;
+	bool			found;
+
+	memset(&key, 0, sizeof(key));
+	key.dbid = MyDatabaseId;
+	key.id = id;
+	entry = hash_search(pg_log_template_hash, &key, HASH_ENTER_NULL, &found);
+	if (entry == NULL)
+		return NULL;
+	if (!found)
+	{
+		entry->ntokens = n;
+		entry->entries = 0;
+		entry->first_seen = 0;
+		entry->last_seen = 0;
+		if (text != NULL)
+			strlcpy(entry->text, text, PG_LOG_TEMPLATE_LEN);
+		else
+			pg_log_template_text(tokens, n, entry->text);
+		group->ids[group->ntemplates++] = id;
+	}
+	return entry;
+}
+
+/*
+ * template id of tokens, called with lock held in exclusive mode, 0 if
+ * shared memory is full
+ */
+static int64 pg_log_template_match(const PgLogSlice *tokens, int n)
+{
+	PgLogTemplateGroupKey	group_key;
+	PgLogTemplateGroup	*group;
+	PgLogTemplateEntry	*best = NULL;
+	PgLogSlice		best_tokens[PG_LOG_TEMPLATE_MAX_TOKENS];
+	int			best_stored = 0;
+	int			best_equal = -1;
+	int			best_wildcards = -1;
+	bool			found;
+	char			text[PG_LOG_TEMPLATE_LEN];
+	int			i;
+
+	memset(&group_key, 0, sizeof(group_key));
+	group_key.dbid = MyDatabaseId;
+	group_key.group = pg_log_template_group(tokens, n);
+	group = hash_search(pg_log_template_groups, &group_key, HASH_ENTER_NULL, &found);
+	if (group == NULL)
+		return 0;
+	if (!found)
+		group->ntemplates = 0;
+
+	for (i = 0; i < group->ntemplates; i++)
+	{
+		PgLogTemplateKey	key;
+		PgLogTemplateEntry	*entry;
+		PgLogSlice		template_tokens[PG_LOG_TEMPLATE_MAX_TOKENS];
+		int			stored;
+		int			equal = 0;
+		int			wildcards = 0;
+		int			j;
+
+		memset(&key, 0, sizeof(key));
+		key.dbid = MyDatabaseId;
+		key.id = group->ids[i];
+		entry = hash_search(pg_log_template_hash, &key, HASH_FIND, NULL);
+		if (entry == NULL)
+			continue;
+
+		stored = pg_log_template_tokens(entry->text, strlen(entry->text), template_tokens);
+		for (j = 0; j < stored && j < n; j++)
+		{
+			if (pg_log_template_wildcard(&template_tokens[j]))
+				wildcards++;
+			else if (pg_log_template_equal(&template_tokens[j], &tokens[j]))
+				equal++;
+		}
+		/* most equal tokens, then most wildcards */
+		if (equal > best_equal || (equal == best_equal && wildcards > best_wildcards))
+		{
+			best = entry;
+			best_equal = equal;
+			best_wildcards = wildcards;
+			best_stored = stored;
+			memcpy(best_tokens, template_tokens, sizeof(PgLogSlice) * stored);
+		}
+	}
+
+	if (best != NULL && (best_equal >= PG_LOG_TEMPLATE_SIMILARITY * n ||
+			     group->ntemplates == PG_LOG_TEMPLATE_GROUP_SIZE))
+	{
+		bool	changed = false;
+
+		/* tokens which differ become <*> */
+		for (i = 0; i < best_stored && i < n; i++)
+			if (!pg_log_template_wildcard(&best_tokens[i]) && !pg_log_template_equal(&best_tokens[i], &tokens[i]))
+			{
+				best_tokens[i].data = PG_LOG_TEMPLATE_WILDCARD;
+				best_tokens[i].len = PG_LOG_TEMPLATE_WILDCARD_LEN;
+				changed = true;
+			}
+		if (changed)
+		{
+			pg_log_template_text(best_tokens, best_stored, text);
+			strlcpy(best->text, text, PG_LOG_TEMPLATE_LEN);
+		}
+		return best->key.id;
+	}
+
+	if (group->ntemplates == PG_LOG_TEMPLATE_GROUP_SIZE)
+		return 0;
+
+	/* id of new template: hash of its first text in its group */
+	pg_log_template_text(tokens, n, text);
+	best = pg_log_template_create(group, tokens, n, NULL,
+				      (int64) (pg_log_hash64(text, strlen(text)) ^ group_key.group));
+	return (best != NULL) ? best->key.id : 0;
+}
+
+static void pg_log_template_xact_callback(XactEvent event, void *arg)
+{
+	ListCell	*cell;
+
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+			if (pending != NIL && pg_log_template_hash != NULL)
+			{
+				LWLockAcquire(pg_log_template_lock, LW_EXCLUSIVE);
+				foreach(cell, pending)
+				{
+					PgLogTemplateCounts	*counts = &((PgLogTemplatePending *) lfirst(cell))->counts;
+					PgLogTemplateKey	key;
+					PgLogTemplateEntry	*entry;
+
+					memset(&key, 0, sizeof(key));
+					key.dbid = MyDatabaseId;
+					key.id = counts->id;
+					entry = hash_search(pg_log_template_hash, &key, HASH_FIND, NULL);
+					if (entry == NULL)
+						continue;
+					if (entry->entries == 0 || counts->first_seen < entry->first_seen)
+						entry->first_seen = counts->first_seen;
+					if (entry->entries == 0 || counts->last_seen > entry->last_seen)
+						entry->last_seen = counts->last_seen;
+					entry->entries += counts->entries;
+				}
+				LWLockRelease(pg_log_template_lock);
+			}
+			pending = NIL;
+			break;
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PREPARE:
+			/* list was allocated in TopTransactionContext */
+			pending = NIL;
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * counts merged by a subtransaction belong to its parent when it commits
+ * and are forgotten when it aborts
+ */
+static void pg_log_template_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+					     SubTransactionId parentSubid, void *arg)
+{
+	List		*kept = NIL;
+	ListCell	*cell;
+	MemoryContext	oldcontext;
+
+	if (event != SUBXACT_EVENT_COMMIT_SUB && event != SUBXACT_EVENT_ABORT_SUB)
+		return;
+
+	oldcontext = MemoryContextSwitchTo(TopTransactionContext);
+	foreach(cell, pending)
+	{
+		PgLogTemplatePending *published = (PgLogTemplatePending *) lfirst(cell);
+
+		if (published->subid == mySubid)
+		{
+			if (event == SUBXACT_EVENT_ABORT_SUB)
+			{
+				pfree(published);
+				continue;
+			}
+			published->subid = parentSubid;
+		}
+		kept = lappend(kept, published);
+	}
+	list_free(pending);
+	pending = kept;
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * load templates of pglog_templates in shared memory, once per database
+ * after server start
+ */
+static void pg_log_template_load(void)
+{
+	PgLogTemplateGroupKey	marker;
+	bool			loaded;
+	uint64			i;
+	int			ret_code;
+
+	memset(&marker, 0, sizeof(marker));
+	marker.dbid = MyDatabaseId;
+	LWLockAcquire(pg_log_template_lock, LW_SHARED);
+	loaded = (hash_search(pg_log_template_groups, &marker, HASH_FIND, NULL) != NULL);
+	LWLockRelease(pg_log_template_lock);
+	if (loaded)
+		return;
+
+	ret_code = SPI_execute("select id, tokens, template, entries, first_seen, last_seen from pglog_templates",
+			       true, 0);
+	if (ret_code != SPI_OK_SELECT)
+		elog(ERROR, "pg_log: SELECT FROM pglog_templates failed: %d", ret_code);
+
+	LWLockAcquire(pg_log_template_lock, LW_EXCLUSIVE);
+	if (hash_search(pg_log_template_groups, &marker, HASH_FIND, NULL) == NULL)
+	{
+		for (i = 0; i < SPI_processed; i++)
+		{
+			HeapTuple		tuple = SPI_tuptable->vals[i];
+			TupleDesc		tupdesc = SPI_tuptable->tupdesc;
+			PgLogSlice		tokens[PG_LOG_TEMPLATE_MAX_TOKENS];
+			PgLogTemplateGroupKey	group_key;
+			PgLogTemplateGroup	*group;
+			PgLogTemplateEntry	*entry;
+			char			*text;
+			bool			isnull;
+			bool			found;
+			int64			id;
+			int			ntokens;
+
+			id = DatumGetInt64(SPI_getbinval(tuple, tupdesc, 1, &isnull));
+			ntokens = DatumGetInt32(SPI_getbinval(tuple, tupdesc, 2, &isnull));
+			text = SPI_getvalue(tuple, tupdesc, 3);
+			if (text == NULL)
+				continue;
+
+			/* stored tokens may be fewer than ntokens, group only uses the first two */
+			pg_log_template_tokens(text, strlen(text), tokens);
+			memset(&group_key, 0, sizeof(group_key));
+			group_key.dbid = MyDatabaseId;
+			group_key.group = pg_log_template_group(tokens, ntokens);
+			group = hash_search(pg_log_template_groups, &group_key, HASH_ENTER_NULL, &found);
+			if (group == NULL)
+				break;
+			if (!found)
+				group->ntemplates = 0;
+			if (group->ntemplates == PG_LOG_TEMPLATE_GROUP_SIZE)
+				continue;
+			entry = pg_log_template_create(group, tokens, ntokens, text, id);
+			if (entry == NULL)
+				break;
+			entry->entries = DatumGetInt64(SPI_getbinval(tuple, tupdesc, 4, &isnull));
+			entry->first_seen = DatumGetTimestampTz(SPI_getbinval(tuple, tupdesc, 5, &isnull));
+			entry->last_seen = DatumGetTimestampTz(SPI_getbinval(tuple, tupdesc, 6, &isnull));
+		}
+		hash_search(pg_log_template_groups, &marker, HASH_ENTER_NULL, NULL);
+	}
+	LWLockRelease(pg_log_template_lock);
+
+	elog(DEBUG1, "pg_log: loaded %d templates", (int) SPI_processed);
+	SPI_freetuptable(SPI_tuptable);
+}
+
+void pg_log_template_begin(PgLogTemplates *templates)
+{
+	HASHCTL	ctl;
+
+	memset(templates, 0, sizeof(PgLogTemplates));
+	if (pg_log_template_hash == NULL)
+		return;
+
+	pg_log_template_load();
+
+	templates->context = AllocSetContextCreate(CurrentMemoryContext,
+						   "pg_log templates",
+						   ALLOCSET_DEFAULT_SIZES);
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(int64);
+	ctl.entrysize = sizeof(PgLogTemplateCounts);
+	ctl.hcxt = templates->context;
+	templates->counts = hash_create("pg_log template counts", 256, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	ctl.keysize = sizeof(PgLogTemplateHourKey);
+	ctl.entrysize = sizeof(PgLogTemplateHour);
+	templates->hours = hash_create("pg_log template hours", 256, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	if (!xact_callback_registered)
+	{
+		RegisterXactCallback(pg_log_template_xact_callback, NULL);
+		RegisterSubXactCallback(pg_log_template_subxact_callback, NULL);
+		xact_callback_registered = true;
+	}
+}
+
+/*
+ * set template_id column of log entry and count it
+ */
+void pg_log_template_add(PgLogTemplates *templates, Datum *values, bool *nulls)
+{
+	PgLogSlice		tokens[PG_LOG_TEMPLATE_MAX_TOKENS];
+	PgLogTemplateCounts	*counts;
+	text			*message;
+	int			n;
+	int64			id;
+	bool			found;
+
+	nulls[PG_LOG_COL_TEMPLATE_ID] = true;
+	if (templates->counts == NULL || nulls[PG_LOG_COL_MESSAGE])
+		return;
+
+	message = DatumGetTextPP(values[PG_LOG_COL_MESSAGE]);
+	n = pg_log_template_tokens(VARDATA_ANY(message), VARSIZE_ANY_EXHDR(message), tokens);
+	if (n == 0)
+		return;
+
+	LWLockAcquire(pg_log_template_lock, LW_EXCLUSIVE);
+	id = pg_log_template_match(tokens, n);
+	LWLockRelease(pg_log_template_lock);
+	if (id == 0)
+		return;
+
+	values[PG_LOG_COL_TEMPLATE_ID] = Int64GetDatum(id);
+	nulls[PG_LOG_COL_TEMPLATE_ID] = false;
+
+	counts = hash_search(templates->counts, &id, HASH_ENTER, &found);
+	if (!found)
+	{
+		counts->ntokens = n;
+		counts->entries = 0;
+		counts->first_seen = 0;
+		counts->last_seen = 0;
+	}
+	counts->entries++;
+	if (!nulls[PG_LOG_COL_LOG_TIME])
+	{
+		TimestampTz		log_time = DatumGetTimestampTz(values[PG_LOG_COL_LOG_TIME]);
+		PgLogTemplateHourKey	key;
+		PgLogTemplateHour	*hour;
+
+		if (counts->first_seen == 0 || log_time < counts->first_seen)
+			counts->first_seen = log_time;
+		if (counts->last_seen == 0 || log_time > counts->last_seen)
+			counts->last_seen = log_time;
+
+		memset(&key, 0, sizeof(key));
+		key.id = id;
+		key.hour = log_time - log_time % USECS_PER_HOUR;
+		if (log_time % USECS_PER_HOUR < 0)
+			key.hour -= USECS_PER_HOUR;
+		hour = hash_search(templates->hours, &key, HASH_ENTER, &found);
+		if (!found)
+			hour->entries = 0;
+		hour->entries++;
+	}
+}
+
+static void pg_log_template_execute(SPIPlanPtr plan, Datum *values, char *nulls, const char *table)
+{
+	int	ret_code = SPI_execute_plan(plan, values, nulls, false, 0);
+
+	if (ret_code != SPI_OK_INSERT)
+		elog(ERROR, "pg_log: INSERT INTO %s failed: %d", table, ret_code);
+}
+
+/*
+ * merge counts of refresh into pglog_templates and pglog_template_hourly
+ */
+void pg_log_template_end(PgLogTemplates *templates)
+{
+	Oid			argtypes[6] = { INT8OID, INT4OID, TEXTOID, INT8OID, TIMESTAMPTZOID, TIMESTAMPTZOID };
+	HASH_SEQ_STATUS		hash_seq;
+	PgLogTemplateCounts	*counts;
+	PgLogTemplateHour	*hour;
+	SPIPlanPtr		plan;
+	Datum			values[6];
+	char			nulls[6];
+	int			ntemplates = 0;
+
+	if (templates->counts == NULL)
+		return;
+
+	memset(nulls, ' ', sizeof(nulls));
+	plan = SPI_prepare(pg_log_template_upsert, 6, argtypes);
+	if (plan == NULL)
+		elog(ERROR, "pg_log: SPI_prepare failed for INSERT INTO pglog_templates");
+	hash_seq_init(&hash_seq, templates->counts);
+	while ((counts = (PgLogTemplateCounts *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		PgLogTemplateKey	key;
+		PgLogTemplateEntry	*entry;
+		char			text[PG_LOG_TEMPLATE_LEN];
+		MemoryContext		oldcontext;
+		PgLogTemplatePending	*published;
+
+		memset(&key, 0, sizeof(key));
+		key.dbid = MyDatabaseId;
+		key.id = counts->id;
+		LWLockAcquire(pg_log_template_lock, LW_SHARED);
+		entry = hash_search(pg_log_template_hash, &key, HASH_FIND, NULL);
+		if (entry != NULL)
+			strlcpy(text, entry->text, PG_LOG_TEMPLATE_LEN);
+		LWLockRelease(pg_log_template_lock);
+		if (entry == NULL)
+			continue;
+
+		values[0] = Int64GetDatum(counts->id);
+		values[1] = Int32GetDatum(counts->ntokens);
+		values[2] = CStringGetTextDatum(text);
+		values[3] = Int64GetDatum(counts->entries);
+		values[4] = TimestampTzGetDatum(counts->first_seen);
+		values[5] = TimestampTzGetDatum(counts->last_seen);
+		nulls[4] = nulls[5] = (counts->first_seen != 0) ? ' ' : 'n';
+		pg_log_template_execute(plan, values, nulls, "pglog_templates");
+		ntemplates++;
+
+		oldcontext = MemoryContextSwitchTo(TopTransactionContext);
+		published = palloc(sizeof(PgLogTemplatePending));
+		published->counts = *counts;
+		published->subid = GetCurrentSubTransactionId();
+		pending = lappend(pending, published);
+		MemoryContextSwitchTo(oldcontext);
+	}
+	SPI_freeplan(plan);
+
+	argtypes[1] = TIMESTAMPTZOID;
+	argtypes[2] = INT8OID;
+	memset(nulls, ' ', sizeof(nulls));
+	plan = SPI_prepare(pg_log_template_hour_upsert, 3, argtypes);
+	if (plan == NULL)
+		elog(ERROR, "pg_log: SPI_prepare failed for INSERT INTO pglog_template_hourly");
+	hash_seq_init(&hash_seq, templates->hours);
+	while ((hour = (PgLogTemplateHour *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		values[0] = Int64GetDatum(hour->key.id);
+		values[1] = TimestampTzGetDatum(hour->key.hour);
+		values[2] = Int64GetDatum(hour->entries);
+		pg_log_template_execute(plan, values, nulls, "pglog_template_hourly");
+	}
+	SPI_freeplan(plan);
+
+	MemoryContextDelete(templates->context);
+	templates->counts = NULL;
+	templates->hours = NULL;
+
+	if (ntemplates > 0)
+		elog(DEBUG1, "pg_log: merged counts of %d templates", ntemplates);
+}
+
+/*
+ * templates of current database in shared memory, with counts committed
+ * since server start and counts loaded from pglog_templates
+ */
+Datum pg_log_template_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo 	*rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext 	oldcontext;
+	HASH_SEQ_STATUS	hash_seq;
+	PgLogTemplateEntry *entry;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_SYNTAX_ERROR),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+	if (pg_log_template_hash == NULL)
+		elog(ERROR, "pg_log: pg_log must be loaded with shared_preload_libraries");
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	tupstore = tuplestore_begin_heap((rsinfo->allowedModes & SFRM_Materialize_Random) != 0, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	LWLockAcquire(pg_log_template_lock, LW_SHARED);
+	hash_seq_init(&hash_seq, pg_log_template_hash);
+	while ((entry = (PgLogTemplateEntry *) hash_seq_search(&hash_seq)) != NULL)
+	{
+		Datum	values[5];
+		bool	nulls[5];
+
+		if (entry->key.dbid != MyDatabaseId)
+			continue;
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = Int64GetDatum(entry->key.id);
+		values[1] = CStringGetTextDatum(entry->text);
+		values[2] = Int64GetDatum(entry->entries);
+		values[3] = TimestampTzGetDatum(entry->first_seen);
+		values[4] = TimestampTzGetDatum(entry->last_seen);
+		nulls[3] = nulls[4] = (entry->entries == 0);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	LWLockRelease(pg_log_template_lock);
+
+	return (Datum) 0;
+}
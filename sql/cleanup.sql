@@ -0,0 +1,4 @@
+ALTER SYSTEM RESET log_line_prefix;
+ALTER SYSTEM RESET log_timezone;
+SELECT pg_reload_conf();
+SELECT pg_sleep(1);
@@ -0,0 +1,22 @@
+SET datestyle = 'ISO, MDY';
+SET timezone = 'UTC';
+--
+-- csvlog format: quoted fields with commas, quotes and newlines
+--
+SELECT regress_log_source('csvlog', 'csvlog', ARRAY[
+ '2001-02-03 07:00:00.250 UTC,"carol","app",4001,"10.0.0.2:5432",3c5e.1,1,"SELECT",2001-02-03 06:59:00 UTC,3/4,0,ERROR,42P01,"relation ""u"" does not exist",,,,,,"select * from u where a = ''x''",15,,"psql","client backend",,0',
+ '2001-02-03 07:00:01 UTC,"carol","app",4001,"10.0.0.2:5432",3c5e.1,2,"idle",2001-02-03 06:59:00 UTC,3/0,0,LOG,00000,"duration: 2.5 ms  statement: select a,',
+ 'b from v",,,,,,,,,"psql","client backend",,1234',
+ '2001-02-03 07:00:02.000 UTC,,,4002,,3c5f.2,1,,2001-02-03 07:00:02 UTC,,0,LOG,00000,"autovacuum launcher started",,,,,,,,,,"autovacuum launcher",,0']);
+SELECT pg_log_refresh();
+SELECT l.id, l.log_time, l.pid, s.name AS severity, l.sqlstate, l.query_id,
+       replace(l.message, E'\n', '|') AS message
+  FROM regress_csvlog l LEFT JOIN pglog_severities s ON s.id = l.severity_id ORDER BY l.id;
+SELECT l.id, u.name AS user_name, d.name AS database_name, a.name AS application_name,
+       h.name AS client_host, l.statement
+  FROM regress_csvlog l LEFT JOIN pglog_users u ON u.id = l.user_id
+  LEFT JOIN pglog_databases d ON d.id = l.database_id
+  LEFT JOIN pglog_applications a ON a.id = l.application_id
+  LEFT JOIN pglog_client_hosts h ON h.id = l.client_host_id ORDER BY l.id;
+SELECT kind, statement, calls, total_ms FROM pglog_slow_queries WHERE statement = 'select a, b from v';
+SELECT l.id FROM regress_csvlog l JOIN pglog_slow_queries q USING (fingerprint) ORDER BY l.id;
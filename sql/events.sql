@@ -0,0 +1,76 @@
+SET datestyle = 'ISO, MDY';
+SET timezone = 'UTC';
+--
+-- event tables filled from messages of log_checkpoints,
+-- log_autovacuum_min_duration, log_lock_waits, log_temp_files,
+-- log_connections and log_disconnections
+--
+SELECT regress_log_source('events', 'stderr', ARRAY[
+ '2001-02-05 00:00:00.000 UTC [6001] LOG:  checkpoint starting: immediate force wait',
+ '2001-02-05 00:00:01.000 UTC [6001] LOG:  checkpoint complete: wrote 12 buffers (0.1%); 0 WAL file(s) added, 0 removed, 1 recycled; write=0.5 s, sync=0.25 s, total=1.0 s; sync files=9, longest=0.125 s, average=0.0625 s; distance=42 kB, estimate=64 kB; lsn=0/1A2B3C4, redo lsn=0/1A2B3B0',
+ '2001-02-05 00:01:00.000 UTC [6002] LOG:  automatic vacuum of table "app.public.t": index scans: 1',
+ E'\tpages: 0 removed, 1234 remain, 0 skipped due to pins, 0 skipped frozen',
+ E'\ttuples: 100 removed, 5000 remain, 0 are dead but not yet removable',
+ E'\tbuffer usage: 100 hits, 5 misses, 3 dirtied',
+ E'\tavg read rate: 1.5 MB/s, avg write rate: 0.5 MB/s',
+ E'\tWAL usage: 10 records, 2 full page images, 12345 bytes',
+ E'\tsystem usage: CPU: user: 0.01 s, system: 0.00 s, elapsed: 0.05 s',
+ '2001-02-05 00:01:01.000 UTC [6002] LOG:  automatic analyze of table "app.public.t"',
+ E'\tsystem usage: CPU: user: 0.00 s, system: 0.00 s, elapsed: 0.02 s',
+ '2001-02-05 00:01:02.000 UTC [6002] LOG:  automatic aggressive vacuum to prevent wraparound of table "app.public.u": index scans: 0',
+ E'\tsystem usage: CPU: user: 0.00 s, system: 0.00 s, elapsed: 0.25 s',
+ '2001-02-05 00:02:00.000 UTC [6003] LOG:  process 6003 still waiting for ShareLock on transaction 5678 after 1000.5 ms',
+ '2001-02-05 00:02:00.000 UTC [6003] DETAIL:  Processes holding the lock: 6004, 6005. Wait queue: 6003.',
+ '2001-02-05 00:02:00.000 UTC [6003] STATEMENT:  update t set v = 1 where id = 1',
+ '2001-02-05 00:02:01.000 UTC [6003] LOG:  process 6003 acquired ShareLock on transaction 5678 after 1500.25 ms',
+ '2001-02-05 00:02:02.000 UTC [6006] LOG:  process 6006 still waiting for AccessExclusiveLock on relation 16384 of database 5 after 1000.0 ms',
+ '2001-02-05 00:03:00.000 UTC [6007] ERROR:  deadlock detected',
+ '2001-02-05 00:03:00.000 UTC [6007] DETAIL:  Process 6007 waits for ShareLock on transaction 100; blocked by process 6008.',
+ E'\tProcess 6008 waits for ShareLock on transaction 101; blocked by process 6007.',
+ E'\tProcess 6007: update t set v = 2 where id = 2',
+ E'\tProcess 6008: update t set v = 3 where id = 1',
+ '2001-02-05 00:03:00.000 UTC [6007] HINT:  See server log for query details.',
+ '2001-02-05 00:04:00.000 UTC [6009] LOG:  temporary file: path "base/pgsql_tmp/pgsql_tmp6009.0", size 12345678',
+ '2001-02-05 00:04:00.000 UTC [6009] STATEMENT:  select * from big order by 1',
+ '2001-02-05 00:05:00.000 UTC [6010] LOG:  connection received: host=10.0.0.4 port=50412',
+ '2001-02-05 00:05:00.100 UTC [6010] LOG:  connection authorized: user=erin database=app application_name=psql',
+ '2001-02-05 00:06:02.345 UTC [6010] LOG:  disconnection: session time: 0:01:02.345 user=erin database=app host=10.0.0.4 port=50412',
+ '2001-02-05 00:07:00.000 UTC [6011] LOG:  sentinel']);
+SELECT pg_log_refresh();
+SELECT log_time, kind, flags, buffers_written, buffers_pct, wal_added, wal_removed, wal_recycled
+  FROM pglog_checkpoints WHERE log_time >= '2001-02-05' AND log_time < '2001-02-06' ORDER BY log_time;
+SELECT write_s, sync_s, total_s, sync_files, longest_sync_s, average_sync_s, distance_kb, estimate_kb, lsn, redo_lsn
+  FROM pglog_checkpoints WHERE log_time >= '2001-02-05' AND log_time < '2001-02-06' ORDER BY log_time;
+SELECT log_time, kind, aggressive, wraparound, database, relation, index_scans, pages_removed, pages_remain,
+       tuples_removed, tuples_remain
+  FROM pglog_autovacuum WHERE log_time >= '2001-02-05' AND log_time < '2001-02-06' ORDER BY log_time;
+SELECT kind, buffer_hits, buffer_misses, buffer_dirtied, read_ms, read_rate_mbs, write_rate_mbs, wal_records,
+       wal_fpi, wal_bytes, cpu_user_s, cpu_system_s, elapsed_s
+  FROM pglog_autovacuum WHERE log_time >= '2001-02-05' AND log_time < '2001-02-06' ORDER BY log_time;
+SELECT database, relation, kind, runs, elapsed_s, pages_removed, tuples_removed, wal_bytes
+  FROM pglog_autovacuum_tables WHERE first_seen >= '2001-02-05' AND first_seen < '2001-02-06'
+ ORDER BY relation COLLATE "C", kind COLLATE "C";
+SELECT log_time, pid, event, lock_mode, lock_object, database, relation, wait_ms, holders, wait_queue
+  FROM pglog_lock_waits WHERE log_time >= '2001-02-05' AND log_time < '2001-02-06' ORDER BY log_time;
+-- edges of the waiting entry and of the deadlock report
+SELECT log_time, pid, event, waiter, blocker, lock_mode, lock_object, statement
+  FROM pglog_lock_edges WHERE log_time >= '2001-02-05' AND log_time < '2001-02-06' ORDER BY log_time, waiter, blocker;
+SELECT t.log_time, t.pid, t.path, t.size_bytes, t.statement, t.fingerprint = l.fingerprint AS same_fingerprint
+  FROM pglog_temp_files t JOIN regress_events l ON l.pid = t.pid AND l.log_time = t.log_time
+ WHERE t.log_time >= '2001-02-05' AND log_time < '2001-02-06';
+SELECT hour, files, total_bytes, max_bytes, statement
+  FROM pglog_temp_files_hourly WHERE hour >= '2001-02-05' AND hour < '2001-02-06';
+SELECT connected_at, disconnected_at, duration_s, pid, user_name, database_name, application_name, client_host,
+       client_port
+  FROM pglog_sessions WHERE disconnected_at >= '2001-02-05' AND disconnected_at < '2001-02-06';
+-- completion read by a later refresh than its start gets its flags
+SELECT regress_log_append('events', ARRAY[
+ '2001-02-05 00:08:00.000 UTC [6001] LOG:  checkpoint starting: time',
+ '2001-02-05 00:08:10.000 UTC [6012] LOG:  sentinel']);
+SELECT pg_log_refresh();
+SELECT regress_log_append('events', ARRAY[
+ '2001-02-05 00:08:30.000 UTC [6001] LOG:  checkpoint complete: wrote 3 buffers (0.0%); 0 WAL file(s) added, 0 removed, 0 recycled; write=0.25 s, sync=0.0 s, total=0.5 s; sync files=0, longest=0.0 s, average=0.0 s; distance=1 kB, estimate=64 kB',
+ '2001-02-05 00:09:00.000 UTC [6013] LOG:  sentinel']);
+SELECT pg_log_refresh();
+SELECT log_time, kind, flags, buffers_written, total_s
+  FROM pglog_checkpoints WHERE log_time >= '2001-02-05 00:08' AND log_time < '2001-02-06' ORDER BY log_time;
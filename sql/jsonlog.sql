@@ -0,0 +1,21 @@
+SET datestyle = 'ISO, MDY';
+SET timezone = 'UTC';
+--
+-- jsonlog format: escaped characters and structural characters in
+-- strings, null values and keys which are not columns
+--
+SELECT regress_log_source('jsonlog', 'jsonlog', ARRAY[
+ '{"timestamp":"2001-02-03 08:00:00.125 UTC","user":"dave","dbname":"app","pid":5001,"remote_host":"10.0.0.3","remote_port":5433,"session_id":"3c60.1","line_num":1,"ps":"SELECT","session_start":"2001-02-03 07:59:00 UTC","vxid":"3/5","txid":0,"error_severity":"ERROR","state_code":"22012","message":"division by zero","statement":"select 1/0","func_name":"int4div","file_name":"int.c","file_line_num":841,"application_name":"psql","backend_type":"client backend","query_id":-42}',
+ '{"timestamp":"2001-02-03 08:00:01.000 UTC","user":"dave","dbname":"app","pid":5001,"error_severity":"LOG","state_code":"00000","message":"duration: 1.5 ms  statement: select \"x\"\nfrom w","application_name":"psql","backend_type":"client backend","query_id":77}',
+ '{"timestamp":"2001-02-03 08:00:02.000 UTC","pid":5002,"error_severity":"WARNING","message":"a: b, {c}","detail":null,"hint":"try \\ again","backend_type":"checkpointer","query_id":0}']);
+SELECT pg_log_refresh();
+SELECT l.id, l.log_time, l.pid, s.name AS severity, l.sqlstate, l.query_id,
+       replace(l.message, E'\n', '|') AS message
+  FROM regress_jsonlog l LEFT JOIN pglog_severities s ON s.id = l.severity_id ORDER BY l.id;
+SELECT l.id, u.name AS user_name, d.name AS database_name, a.name AS application_name,
+       h.name AS client_host, l.location, l.detail, l.hint, l.statement
+  FROM regress_jsonlog l LEFT JOIN pglog_users u ON u.id = l.user_id
+  LEFT JOIN pglog_databases d ON d.id = l.database_id
+  LEFT JOIN pglog_applications a ON a.id = l.application_id
+  LEFT JOIN pglog_client_hosts h ON h.id = l.client_host_id ORDER BY l.id;
+SELECT kind, statement, calls, total_ms FROM pglog_slow_queries WHERE statement = 'select "x" from w';
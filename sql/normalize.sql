@@ -0,0 +1,22 @@
+SET datestyle = 'ISO, MDY';
+SET timezone = 'UTC';
+--
+-- statements of "duration:" entries are grouped by fingerprint of their
+-- normalized text: constants, lists of constants, comments, case and
+-- spaces do not change it
+--
+SELECT regress_log_source('normalize', 'stderr', ARRAY[
+ '2001-02-04 00:00:00.000 UTC [7001] LOG:  duration: 1.0 ms  statement: SELECT  *  FROM t WHERE a IN (1, 2, 3) AND b = ''x''''y''',
+ '2001-02-04 00:00:01.000 UTC [7001] LOG:  duration: 2.0 ms  statement: select * from t where A in (4,5) and b=''z''',
+ '2001-02-04 00:00:02.000 UTC [7001] LOG:  duration: 0.25 ms  execute S_1: select $1::int, E''a\''b'', $$dollar$$, x''0F'' -- comment',
+ '2001-02-04 00:00:03.000 UTC [7001] LOG:  duration: 4.0 ms  statement: SELECT ARRAY[1,2] , "Mixed"."Col" FROM s.t /* c /* nested */ */ WHERE v::text = 1.5e-3',
+ '2001-02-04 00:00:04.000 UTC [7001] LOG:  duration: 8.0 ms  statement: select f(1), g ( a ) from t',
+ E'\twhere id in (select id from u)',
+ '2001-02-04 00:00:05.000 UTC [7001] LOG:  duration: 3.0 ms',
+ '2001-02-04 00:00:06.000 UTC [7002] LOG:  sentinel']);
+SELECT pg_log_refresh();
+SELECT kind, statement, calls, total_ms FROM pglog_slow_queries
+ WHERE first_seen >= '2001-02-04' AND first_seen < '2001-02-05' ORDER BY statement COLLATE "C";
+-- entry without statement has no fingerprint
+SELECT count(fingerprint) AS entries, count(DISTINCT fingerprint) AS fingerprints FROM regress_normalize;
+SELECT count(*) FROM regress_normalize l JOIN pglog_slow_queries q USING (fingerprint);
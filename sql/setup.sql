@@ -0,0 +1,47 @@
+--
+-- test log files are written into the data directory and read with
+-- pg_log_refresh(): log_line_prefix and log_timezone are set for the
+-- whole server until the cleanup test
+--
+SET client_min_messages = warning;
+CREATE EXTENSION pg_log;
+RESET client_min_messages;
+UPDATE pg_log_sources SET enabled = false WHERE name = 'postgresql';
+ALTER SYSTEM SET log_line_prefix = '%m [%p] ';
+ALTER SYSTEM SET log_timezone = 'UTC';
+SELECT pg_reload_conf();
+SELECT pg_sleep(1);
+--
+-- write lines into pg_log_regress_<name>.log as is: csv format with
+-- delimiter and quote which are not in lines
+--
+CREATE FUNCTION regress_log_file(log_name text, log_lines text[]) RETURNS text AS $$
+DECLARE
+ path text := current_setting('data_directory') || '/pg_log_regress_' || log_name || '.log';
+BEGIN
+ EXECUTE format('COPY (SELECT unnest(%L::text[])) TO %L WITH (format csv, delimiter %L, quote %L)',
+  log_lines, path, E'\x02', E'\x01');
+ RETURN path;
+END
+$$ LANGUAGE plpgsql;
+--
+-- add lines to file, which keeps its inode
+--
+CREATE FUNCTION regress_log_append(log_name text, log_lines text[]) RETURNS void AS $$
+BEGIN
+ PERFORM regress_log_file(log_name,
+  string_to_array(rtrim(pg_read_file('pg_log_regress_' || log_name || '.log'), E'\n'), E'\n') || log_lines);
+END
+$$ LANGUAGE plpgsql;
+--
+-- source regress_<name> reading lines of log_format into table
+-- regress_<name>
+--
+CREATE FUNCTION regress_log_source(log_name text, log_format text, log_lines text[]) RETURNS void AS $$
+BEGIN
+ EXECUTE format('CREATE TABLE %I (LIKE pglog)', 'regress_' || log_name);
+ INSERT INTO pg_log_sources(name, path, format, target_table)
+  VALUES ('regress_' || log_name, regress_log_file(log_name, log_lines), log_format,
+          ('regress_' || log_name)::regclass);
+END
+$$ LANGUAGE plpgsql;
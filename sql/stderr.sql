@@ -0,0 +1,80 @@
+SET datestyle = 'ISO, MDY';
+SET timezone = 'UTC';
+--
+-- stderr format: entries of several lines, parts and typed columns of
+-- log_line_prefix '%m [%p] '
+--
+SELECT regress_log_source('stderr', 'stderr', ARRAY[
+ '2001-02-03 04:05:06.789 UTC [1001] LOG:  database system is ready to accept connections',
+ '2001-02-03 04:05:07.000 UTC [1002] ERROR:  relation "t" does not exist at character 15',
+ '2001-02-03 04:05:07.000 UTC [1002] STATEMENT:  select * from t',
+ '2001-02-03 04:05:08.123 UTC [1003] LOG:  duration: 12.25 ms  statement: select *',
+ E'\tfrom t where id = 42',
+ '2001-02-03 04:05:08.500 UTC [1003] LOG:  duration: 0.5 ms  statement: SELECT * FROM t WHERE id=7',
+ '2001-02-03 04:05:09.500 UTC [1003] WARNING:  first line',
+ E'\tsecond line',
+ '2001-02-03 04:05:09.500 UTC [1003] DETAIL:  detail line',
+ '2001-02-03 04:05:09.500 UTC [1003] HINT:  hint line',
+ '2001-02-03 04:05:10.000 UTC [1004] LOG:  sentinel']);
+SELECT pg_log_refresh();
+SELECT l.id, l.log_time, l.pid, s.name AS severity, replace(l.message, E'\n', '|') AS message
+  FROM regress_stderr l LEFT JOIN pglog_severities s ON s.id = l.severity_id
+ WHERE l.message <> 'sentinel' ORDER BY l.id;
+SELECT id, detail, hint, statement FROM regress_stderr
+ WHERE detail IS NOT NULL OR hint IS NOT NULL OR statement IS NOT NULL ORDER BY id;
+-- statement part and both duration entries have a fingerprint, the same
+-- for both duration entries
+SELECT count(fingerprint) AS entries, count(DISTINCT fingerprint) AS fingerprints FROM regress_stderr;
+SELECT kind, statement, calls, total_ms, min_ms, max_ms, histogram[1:5] AS histogram, first_seen, last_seen
+  FROM pglog_slow_queries WHERE statement = 'select * from t where id = ?';
+-- next refresh reads lines added to the file
+SELECT regress_log_append('stderr', ARRAY[
+ '2001-02-03 04:05:11.000 UTC [1005] LOG:  appended',
+ '2001-02-03 04:05:11.500 UTC [1005] LOG:  duration: 0.125 ms',
+ '2001-02-03 04:05:12.000 UTC [1005] LOG:  sentinel']);
+SELECT pg_log_refresh();
+SELECT id, pid, message FROM regress_stderr WHERE id > 7 AND message <> 'sentinel' ORDER BY id;
+SELECT count(*) FROM regress_stderr WHERE message <> 'sentinel';
+-- last entry is only read when the next one starts
+SELECT id, pid FROM regress_stderr WHERE message = 'sentinel';
+-- duration_ms of duration entries, also without statement (log_duration)
+SELECT id, duration_ms FROM regress_stderr WHERE duration_ms IS NOT NULL ORDER BY id;
+--
+-- specialized matcher of '%t [%p] %q%u@%d ': processes without session
+-- stop at %q, [unknown] values are NULL
+--
+ALTER SYSTEM SET log_line_prefix = '%t [%p] %q%u@%d ';
+SELECT pg_reload_conf();
+SELECT pg_sleep(1);
+SELECT regress_log_source('stderr_user', 'stderr', ARRAY[
+ '2001-02-03 05:00:00 UTC [2001] alice@app LOG:  statement: select 1',
+ '2001-02-03 05:00:01 UTC [2002] LOG:  autovacuum launcher started',
+ '2001-02-03 05:00:02 UTC [2003] [unknown]@[unknown] LOG:  incomplete startup packet',
+ '2001-02-03 05:00:03 UTC [2004] LOG:  sentinel']);
+SELECT pg_log_refresh();
+SELECT l.id, l.log_time, l.pid, u.name AS user_name, d.name AS database_name, l.message
+  FROM regress_stderr_user l LEFT JOIN pglog_users u ON u.id = l.user_id
+  LEFT JOIN pglog_databases d ON d.id = l.database_id
+ WHERE l.message <> 'sentinel' ORDER BY l.id;
+--
+-- generic matcher: values end where the next literal starts
+--
+ALTER SYSTEM SET log_line_prefix = '%t [%p]: [%l-1] user=%u,db=%d,app=%a,client=%h ';
+SELECT pg_reload_conf();
+SELECT pg_sleep(1);
+SELECT regress_log_source('stderr_generic', 'stderr', ARRAY[
+ '2001-02-03 06:00:00 UTC [3001]: [1-1] user=bob,db=app,app=psql,client=10.0.0.1 LOG:  statement: select 2',
+ '2001-02-03 06:00:01 UTC [3001]: [2-1] user=bob,db=app,app=psql,client=10.0.0.1 ERROR:  syntax error at or near "selec" at character 1',
+ '2001-02-03 06:00:01 UTC [3001]: [2-1] user=bob,db=app,app=psql,client=10.0.0.1 STATEMENT:  selec 3',
+ '2001-02-03 06:00:02 UTC [3002]: [1-1] user=bob,db=app,app=psql,client=10.0.0.1 LOG:  sentinel']);
+SELECT pg_log_refresh();
+SELECT l.id, l.log_time, l.pid, u.name AS user_name, d.name AS database_name, a.name AS application_name,
+       h.name AS client_host, l.message, l.statement
+  FROM regress_stderr_generic l LEFT JOIN pglog_users u ON u.id = l.user_id
+  LEFT JOIN pglog_databases d ON d.id = l.database_id
+  LEFT JOIN pglog_applications a ON a.id = l.application_id
+  LEFT JOIN pglog_client_hosts h ON h.id = l.client_host_id
+ WHERE l.message <> 'sentinel' ORDER BY l.id;
+ALTER SYSTEM SET log_line_prefix = '%m [%p] ';
+SELECT pg_reload_conf();
+SELECT pg_sleep(1);